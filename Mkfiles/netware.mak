@@ -39,6 +39,7 @@ NASM =	nasm.o \
 	stdscan.o \
 	strfunc.o tokhash.o \
 	segalloc.o \
+	relax.o \
 	preproc-nop.o \
 	rdstrnum.o \
 	\
@@ -63,7 +64,7 @@ LIBOBJ = snprintf.o vsnprintf.o strlcpy.o \
 	realpath.o filename.o srcfile.o \
 	zerobuf.o readnum.o bsi.o \
 	rbtree.o hashtbl.o \
-	raa.o saa.o \
+	raa.o saa.o arena.o atom.o parallel.o \
 	common.o \
 	insnsa.o insnsb.o insnsd.o insnsn.o \
 	regs.o regvals.o regflags.o regdis.o \
@@ -146,26 +147,29 @@ $(OBJDIR)/version.mak: $(PROOT)/version $(PROOT)/version.pl $(OBJDIR)
 # @continuation: "\"
 #-- Everything below is generated by mkdep.pl - do not edit --#
 assemble.o: assemble.c assemble.h compiler.h disp8.h insns.h listing.h \
- nasm.h nasmlib.h tables.h
+ nasm.h nasmlib.h relax.h tables.h
 directiv.o: directiv.c compiler.h directiv.h hashtbl.h nasm.h
-eval.o: eval.c compiler.h eval.h float.h labels.h nasm.h nasmlib.h
+eval.o: eval.c atom.h arena.h compiler.h eval.h float.h labels.h nasm.h \
+ nasmlib.h
 exprlib.o: exprlib.c nasm.h
 float.o: float.c compiler.h float.h nasm.h
-labels.o: labels.c compiler.h hashtbl.h labels.h nasm.h nasmlib.h
+labels.o: labels.c atom.h compiler.h labels.h nasm.h nasmlib.h
 listing.o: listing.c compiler.h listing.h nasm.h nasmlib.h
-nasm.o: nasm.c assemble.h compiler.h eval.h float.h iflag.h insns.h labels.h \
- listing.h nasm.h nasmlib.h outform.h parser.h preproc.h raa.h saa.h \
- stdscan.h ver.h
-parser.o: parser.c compiler.h eval.h float.h insns.h nasm.h nasmlib.h \
- parser.h stdscan.h tables.h
+nasm.o: nasm.c atom.h assemble.h compiler.h eval.h float.h iflag.h insns.h labels.h \
+ listing.h nasm.h nasmlib.h outform.h parser.h preproc.h raa.h relax.h \
+ saa.h stdscan.h ver.h
+parser.o: parser.c arena.h compiler.h eval.h float.h insns.h nasm.h \
+ nasmlib.h parser.h stdscan.h tables.h
 pptok.o: pptok.c compiler.h hashtbl.h nasmlib.h preproc.h
 preproc-nop.o: preproc-nop.c compiler.h listing.h nasm.h nasmlib.h preproc.h
-preproc.o: preproc.c compiler.h eval.h hashtbl.h listing.h nasm.h nasmlib.h \
+preproc.o: preproc.c atom.h compiler.h eval.h hashtbl.h listing.h nasm.h nasmlib.h \
  preproc.h quote.h stdscan.h tables.h tokens.h
 quote.o: quote.c compiler.h nasmlib.h quote.h
 rdstrnum.o: rdstrnum.c compiler.h nasm.h nasmlib.h
+relax.o: relax.c compiler.h nasm.h nasmlib.h relax.h
 segalloc.o: segalloc.c compiler.h insns.h nasm.h nasmlib.h
-stdscan.o: stdscan.c compiler.h insns.h nasm.h nasmlib.h quote.h stdscan.h
+stdscan.o: stdscan.c atom.h arena.h compiler.h insns.h nasm.h nasmlib.h quote.h \
+ stdscan.h
 strfunc.o: strfunc.c nasm.h nasmlib.h
 tokhash.o: tokhash.c compiler.h hashtbl.h insns.h nasm.h stdscan.h
 common.o: common.c compiler.h insns.h nasm.h nasmlib.h
@@ -175,6 +179,8 @@ ndisasm.o: ndisasm.c compiler.h disasm.h insns.h nasm.h nasmlib.h sync.h \
  ver.h
 sync.o: sync.c compiler.h nasmlib.h sync.h
 macros.o: macros.c hashtbl.h nasmlib.h outform.h tables.h
+arena.o: arena.c arena.h compiler.h nasmlib.h
+atom.o: atom.c arena.h atom.h compiler.h hashtbl.h nasmlib.h
 bsi.o: bsi.c compiler.h nasmlib.h
 crc64.o: crc64.c compiler.h hashtbl.h nasmlib.h
 error.o: error.c compiler.h nasmlib.h
@@ -184,6 +190,7 @@ hashtbl.o: hashtbl.c compiler.h hashtbl.h nasm.h
 ilog2.o: ilog2.c compiler.h nasmlib.h
 malloc.o: malloc.c compiler.h nasmlib.h
 md5c.o: md5c.c md5.h
+parallel.o: parallel.c compiler.h nasmlib.h
 raa.o: raa.c nasmlib.h raa.h
 rbtree.o: rbtree.c rbtree.h
 readnum.o: readnum.c compiler.h nasm.h nasmlib.h
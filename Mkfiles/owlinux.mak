@@ -66,6 +66,7 @@ NASM =	asm/nasm.$(O) \
 	asm/stdscan.$(O) \
 	asm/strfunc.$(O) asm/tokhash.$(O) \
 	asm/segalloc.$(O) \
+	asm/relax.$(O) \
 	asm/preproc-nop.$(O) \
 	asm/rdstrnum.$(O) \
 	\
@@ -90,7 +91,8 @@ LIBOBJ = stdlib/snprintf.$(O) stdlib/vsnprintf.$(O) stdlib/strlcpy.$(O) \
 	nasmlib/realpath.$(O) nasmlib/filename.$(O) nasmlib/srcfile.$(O) \
 	nasmlib/zerobuf.$(O) nasmlib/readnum.$(O) nasmlib/bsi.$(O) \
 	nasmlib/rbtree.$(O) nasmlib/hashtbl.$(O) \
-	nasmlib/raa.$(O) nasmlib/saa.$(O) \
+	nasmlib/raa.$(O) nasmlib/saa.$(O) nasmlib/arena.$(O) \
+	nasmlib/atom.$(O) nasmlib/parallel.$(O) \
 	common/common.$(O) \
 	x86/insnsa.$(O) x86/insnsb.$(O) x86/insnsd.$(O) x86/insnsn.$(O) \
 	x86/regs.$(O) x86/regvals.$(O) x86/regflags.$(O) x86/regdis.$(O) \
@@ -253,38 +255,42 @@ everything: all doc rdf
 #-- Everything below is generated by mkdep.pl - do not edit --#
 asm/assemble.$(O): asm/assemble.c asm/assemble.h include/compiler.h \
  include/disp8.h include/insns.h asm/listing.h include/nasm.h \
- include/nasmlib.h include/tables.h
+ include/nasmlib.h asm/relax.h include/tables.h
 asm/directiv.$(O): asm/directiv.c include/compiler.h asm/directiv.h \
  include/hashtbl.h include/nasm.h
-asm/eval.$(O): asm/eval.c include/compiler.h asm/eval.h asm/float.h \
- include/labels.h include/nasm.h include/nasmlib.h
+asm/eval.$(O): asm/eval.c include/atom.h include/arena.h include/compiler.h asm/eval.h \
+ asm/float.h include/labels.h include/nasm.h include/nasmlib.h
 asm/exprlib.$(O): asm/exprlib.c include/nasm.h
 asm/float.$(O): asm/float.c include/compiler.h asm/float.h include/nasm.h
-asm/labels.$(O): asm/labels.c include/compiler.h include/hashtbl.h \
+asm/labels.$(O): asm/labels.c include/atom.h include/compiler.h \
  include/labels.h include/nasm.h include/nasmlib.h
 asm/listing.$(O): asm/listing.c include/compiler.h asm/listing.h \
  include/nasm.h include/nasmlib.h
-asm/nasm.$(O): asm/nasm.c asm/assemble.h include/compiler.h asm/eval.h \
+asm/nasm.$(O): asm/nasm.c include/atom.h asm/assemble.h include/compiler.h asm/eval.h \
  asm/float.h include/iflag.h include/insns.h include/labels.h asm/listing.h \
  include/nasm.h include/nasmlib.h output/outform.h asm/parser.h \
- asm/preproc.h include/raa.h include/saa.h asm/stdscan.h include/ver.h
-asm/parser.$(O): asm/parser.c include/compiler.h asm/eval.h asm/float.h \
- include/insns.h include/nasm.h include/nasmlib.h asm/parser.h asm/stdscan.h \
+ asm/preproc.h asm/relax.h include/raa.h include/saa.h asm/stdscan.h \
+ include/ver.h
+asm/parser.$(O): asm/parser.c include/arena.h include/compiler.h asm/eval.h \
+ asm/float.h include/insns.h include/nasm.h include/nasmlib.h asm/parser.h asm/stdscan.h \
  include/tables.h
 asm/pptok.$(O): asm/pptok.c include/compiler.h include/hashtbl.h \
  include/nasmlib.h asm/preproc.h
 asm/preproc-nop.$(O): asm/preproc-nop.c include/compiler.h asm/listing.h \
  include/nasm.h include/nasmlib.h asm/preproc.h
-asm/preproc.$(O): asm/preproc.c include/compiler.h asm/eval.h \
+asm/preproc.$(O): asm/preproc.c include/atom.h include/compiler.h asm/eval.h \
  include/hashtbl.h asm/listing.h include/nasm.h include/nasmlib.h \
  asm/preproc.h asm/quote.h asm/stdscan.h include/tables.h asm/tokens.h
 asm/quote.$(O): asm/quote.c include/compiler.h include/nasmlib.h asm/quote.h
 asm/rdstrnum.$(O): asm/rdstrnum.c include/compiler.h include/nasm.h \
  include/nasmlib.h
+asm/relax.$(O): asm/relax.c include/compiler.h include/nasm.h \
+ include/nasmlib.h asm/relax.h
 asm/segalloc.$(O): asm/segalloc.c include/compiler.h include/insns.h \
  include/nasm.h include/nasmlib.h
-asm/stdscan.$(O): asm/stdscan.c include/compiler.h include/insns.h \
- include/nasm.h include/nasmlib.h asm/quote.h asm/stdscan.h
+asm/stdscan.$(O): asm/stdscan.c include/atom.h include/arena.h include/compiler.h \
+ include/insns.h include/nasm.h include/nasmlib.h asm/quote.h \
+ asm/stdscan.h
 asm/strfunc.$(O): asm/strfunc.c include/nasm.h include/nasmlib.h
 asm/tokhash.$(O): asm/tokhash.c include/compiler.h include/hashtbl.h \
  include/insns.h include/nasm.h asm/stdscan.h
@@ -300,6 +306,10 @@ disasm/sync.$(O): disasm/sync.c include/compiler.h include/nasmlib.h \
  disasm/sync.h
 macros/macros.$(O): macros/macros.c include/hashtbl.h include/nasmlib.h \
  output/outform.h include/tables.h
+nasmlib/arena.$(O): nasmlib/arena.c include/arena.h include/compiler.h \
+ include/nasmlib.h
+nasmlib/atom.$(O): nasmlib/atom.c include/arena.h include/atom.h \
+ include/compiler.h include/hashtbl.h include/nasmlib.h
 nasmlib/bsi.$(O): nasmlib/bsi.c include/compiler.h include/nasmlib.h
 nasmlib/crc64.$(O): nasmlib/crc64.c include/compiler.h include/hashtbl.h \
  include/nasmlib.h
@@ -312,6 +322,8 @@ nasmlib/hashtbl.$(O): nasmlib/hashtbl.c include/compiler.h include/hashtbl.h \
 nasmlib/ilog2.$(O): nasmlib/ilog2.c include/compiler.h include/nasmlib.h
 nasmlib/malloc.$(O): nasmlib/malloc.c include/compiler.h include/nasmlib.h
 nasmlib/md5c.$(O): nasmlib/md5c.c include/md5.h
+nasmlib/parallel.$(O): nasmlib/parallel.c include/compiler.h \
+ include/nasmlib.h
 nasmlib/raa.$(O): nasmlib/raa.c include/nasmlib.h include/raa.h
 nasmlib/rbtree.$(O): nasmlib/rbtree.c include/rbtree.h
 nasmlib/readnum.$(O): nasmlib/readnum.c include/compiler.h include/nasm.h \
@@ -183,11 +183,13 @@
 
 #include "nasm.h"
 #include "nasmlib.h"
+#include "hashtbl.h"
 #include "assemble.h"
 #include "insns.h"
 #include "tables.h"
 #include "disp8.h"
 #include "listing.h"
+#include "relax.h"
 
 enum match_result {
     /*
@@ -226,7 +228,116 @@ typedef struct {
 #define GEN_MODRM(mod, reg, rm)                     \
         (((mod) << 6) | (((reg) & 7) << 3) | ((rm) & 7))
 
-static iflag_t cpu;             /* cpu level received from nasm.c */
+static threadlocal iflag_t cpu; /* cpu level received from nasm.c */
+
+/*
+ * Per-line memo of the template find_match() picked and of the size
+ * insn_size() computed with it, indexed by the line number in the
+ * insn.  The snapshot of the instruction has to agree with the line
+ * as it is now for either to be reused, so a line which changes
+ * between passes is simply matched and sized again.
+ */
+struct line_memo {
+    const struct itemplate  *temp;      /* template picked, or NULL */
+    int64_t                 size;       /* size of one copy, or -1 */
+    enum opcode             opcode;
+    int                     operands;
+    int                     bits;
+    int8_t                  broadcast;
+    int                     prefixes[MAXPREFIX];
+    iflag_t                 cpu;
+    int                     addr_size;
+    int                     evex_rm;
+    bool                    bnd;
+    operand                 *oprs;      /* follows the structure */
+};
+
+static struct line_memo **line_memo;
+static size_t line_memo_size;
+
+/*
+ * INCBIN files, mapped in once and kept for all the passes, indexed
+ * by resolved path.  The modification time is checked on each use, so
+ * a file which changes under us is mapped in again.
+ */
+struct incbin_file {
+    int64_t             mtime;
+    bool                valid;          /* the map holds the file */
+    struct nasm_filemap map;
+};
+
+static struct hash_table incbin_files;
+
+/*
+ * The encode buffer.  While it is active, out() collects the bytes of
+ * an instruction here, with its relocated fields on the side, and
+ * encbuf_end() hands the lot to the listing and ofmt->output_block()
+ * in one go.  Anything which doesn't fit goes straight through, after
+ * what has been collected so far.
+ */
+#define ENCBUF_SIZE     64
+#define ENCBUF_FIELDS   8
+
+static threadlocal struct {
+    bool active;
+    int32_t segto;
+    int64_t offset;             /* of the first byte */
+    size_t len;
+    int nfields;
+    uint8_t data[ENCBUF_SIZE];
+    struct out_field fields[ENCBUF_FIELDS];
+} encbuf;
+
+/*
+ * Code generation in batches.  On the final pass with -j, nasm.c
+ * hands over runs of lines whose sizes are known from the pass before,
+ * and they are encoded on several threads.  Everything a line would
+ * have handed to the output format, and any errors, go into a log of
+ * its own, and the logs are then played back in source order.
+ */
+struct batch_line {
+    insn        ins;            /* with its own copy of the eops */
+    int32_t     segment;
+    int64_t     offset;
+    int         bits;
+    iflag_t     cpu;
+    int64_t     size;           /* what it came to last time */
+    int64_t     done;           /* what it came to this time */
+    int32_t     lineno;         /* where it came from */
+    const char  *fname;
+    uint8_t     *log;
+    size_t      loglen, logsize;
+};
+
+#define BATCH_LINES     4096    /* lines to a batch */
+#define BATCH_JOB       256     /* lines to a job */
+
+static struct batch_line *batch;
+static int batch_lines;
+static threadlocal struct batch_line *batch_cur; /* being encoded */
+
+enum batch_op {
+    BATCH_OUTPUT,               /* ofmt->output() */
+    BATCH_BLOCK,                /* ofmt->output_block() */
+    BATCH_FILL,                 /* ofmt->output_fill() */
+    BATCH_ERROR                 /* nasm_error() */
+};
+
+/*
+ * A record in a log, followed by len bytes of data, padded out to a
+ * multiple of 8, and then by nfields struct out_field
+ */
+struct batch_rec {
+    enum batch_op   op;
+    enum out_type   type;
+    uint64_t        size;       /* or the count, for BATCH_FILL */
+    int32_t         segto, segment, wrt;
+    int             severity;
+    int             nfields;
+    size_t          len;
+};
+
+#define BATCH_PAD(len)  (((len) + 7) & ~(size_t)7)
 
 static int64_t calcsize(int32_t, int64_t, int, insn *,
                         const struct itemplate *);
@@ -234,9 +345,14 @@ static void gencode(int32_t segment, int64_t offset, int bits,
                     insn * ins, const struct itemplate *temp,
                     int64_t insn_end);
 static enum match_result find_match(const struct itemplate **tempp,
+                                    const struct itemplate **jumpp,
                                     insn *instruction,
                                     int32_t segment, int64_t offset, int bits);
 static enum match_result matches(const struct itemplate *, insn *, int bits);
+static struct line_memo **line_memo_slot(int32_t lineno);
+static bool line_memo_matches(const struct line_memo *, const insn *, int bits);
+static bool line_memo_sizes(const struct line_memo *, const insn *);
+static void line_memo_set_values(struct line_memo *, const insn *);
 static opflags_t regflag(const operand *);
 static int32_t regval(const operand *);
 static int rexflags(int, opflags_t, int);
@@ -323,6 +439,331 @@ static int addrsize(enum out_type type, uint64_t size)
     }
 }
 
+/*
+ * this call to src_get determines when we call the
+ * debug-format-specific "linenum" function
+ * it updates lineno and lnfname to the current values
+ * returning 0 if "same as last time", -2 if lnfname
+ * changed, and the amount by which lineno changed,
+ * if it did. thus, these variables must be static
+ */
+static void out_linenum(int32_t segto)
+{
+    static int32_t lineno = 0;     /* static!!! */
+    static const char *lnfname = NULL;
+
+    /* Never batched with debug info, and the statics aren't ours */
+    if (batch_cur)
+        return;
+
+    if (src_get(&lineno, &lnfname))
+        dfmt->linenum(lnfname, lineno, segto);
+}
+
+/*
+ * Add a record to the log of the line being encoded
+ */
+static struct batch_rec *batch_rec(enum batch_op op, size_t len,
+                                   int nfields)
+{
+    struct batch_line *bl = batch_cur;
+    size_t need = sizeof(struct batch_rec) + BATCH_PAD(len) +
+        nfields * sizeof(struct out_field);
+    struct batch_rec *r;
+
+    if (bl->loglen + need > bl->logsize) {
+        bl->logsize = bl->logsize ? bl->logsize << 1 : 256;
+        if (bl->logsize < bl->loglen + need)
+            bl->logsize = bl->loglen + need;
+        bl->log = nasm_realloc(bl->log, bl->logsize);
+    }
+
+    r = (struct batch_rec *)(bl->log + bl->loglen);
+    bl->loglen += need;
+    r->op = op;
+    r->nfields = nfields;
+    r->len = len;
+    return r;
+}
+
+/*
+ * Everything assemble() hands to the output format goes through
+ * these, so that a line being encoded in a batch can log it instead.
+ */
+static void backend_output(int32_t segto, const void *data,
+                           enum out_type type, uint64_t size,
+                           int32_t segment, int32_t wrt)
+{
+    struct batch_rec *r;
+    size_t len;
+
+    if (!batch_cur) {
+        ofmt->output(segto, data, type, size, segment, wrt);
+        return;
+    }
+
+    if (type == OUT_RAWDATA)
+        len = size;
+    else if (type == OUT_RESERVE)
+        len = 0;
+    else
+        len = sizeof(int64_t);
+
+    r = batch_rec(BATCH_OUTPUT, len, 0);
+    r->type = type;
+    r->size = size;
+    r->segto = segto;
+    r->segment = segment;
+    r->wrt = wrt;
+    if (len)
+        memcpy(r + 1, data, len);
+}
+
+static void backend_block(int32_t segto, const uint8_t *data, size_t len,
+                          const struct out_field *fields, int nfields)
+{
+    struct batch_rec *r;
+
+    if (!batch_cur) {
+        ofmt->output_block(segto, data, len, fields, nfields);
+        return;
+    }
+
+    r = batch_rec(BATCH_BLOCK, len, nfields);
+    r->segto = segto;
+    memcpy(r + 1, data, len);
+    memcpy((uint8_t *)(r + 1) + BATCH_PAD(len), fields,
+           nfields * sizeof(struct out_field));
+}
+
+static void backend_fill(int32_t segto, const void *data, size_t len,
+                         uint64_t count)
+{
+    struct batch_rec *r;
+
+    if (!batch_cur) {
+        ofmt->output_fill(segto, data, len, count);
+        return;
+    }
+
+    r = batch_rec(BATCH_FILL, len, 0);
+    r->size = count;
+    r->segto = segto;
+    memcpy(r + 1, data, len);
+}
+
+static void encbuf_flush(void)
+{
+    const uint8_t *data = encbuf.data;
+    size_t pos = 0;
+    int i;
+
+    if (!encbuf.len)
+        return;
+
+    for (i = 0; i < encbuf.nfields; i++) {
+        const struct out_field *f = &encbuf.fields[i];
+
+        if (f->pos > pos)
+            lfmt->output(encbuf.offset + pos, data + pos, OUT_RAWDATA,
+                         f->pos - pos);
+        lfmt->output(encbuf.offset + f->pos, &f->addr, f->type, f->size);
+        pos = f->pos + addrsize(f->type, f->size);
+    }
+    if (encbuf.len > pos)
+        lfmt->output(encbuf.offset + pos, data + pos, OUT_RAWDATA,
+                     encbuf.len - pos);
+
+    out_linenum(encbuf.segto);
+
+    backend_block(encbuf.segto, data, encbuf.len,
+                  encbuf.fields, encbuf.nfields);
+
+    encbuf.len = 0;
+    encbuf.nfields = 0;
+}
+
+static void encbuf_begin(void)
+{
+    encbuf.active = true;
+    encbuf.len = 0;
+    encbuf.nfields = 0;
+}
+
+static void encbuf_end(void)
+{
+    encbuf_flush();
+    encbuf.active = false;
+}
+
+/*
+ * Add some output to the encode buffer, if there is room for it
+ */
+static bool encbuf_add(int64_t offset, int32_t segto, const void *data,
+                       enum out_type type, uint64_t size,
+                       int32_t segment, int32_t wrt, int asize)
+{
+    size_t len = type == OUT_RAWDATA ? size : (size_t)asize;
+    struct out_field *f;
+
+    if (encbuf.len + len > ENCBUF_SIZE ||
+        (type != OUT_RAWDATA && encbuf.nfields == ENCBUF_FIELDS))
+        encbuf_flush();
+    if (len > ENCBUF_SIZE)
+        return false;
+
+    if (!encbuf.len) {
+        encbuf.segto = segto;
+        encbuf.offset = offset;
+    }
+
+    if (type == OUT_RAWDATA) {
+        memcpy(encbuf.data + encbuf.len, data, len);
+    } else {
+        f = &encbuf.fields[encbuf.nfields++];
+        f->pos = encbuf.len;
+        f->type = type;
+        f->size = size;
+        f->addr = *(const int64_t *)data;
+        f->segment = segment;
+        f->wrt = wrt;
+        memset(encbuf.data + encbuf.len, 0, len);
+    }
+    encbuf.len += len;
+    return true;
+}
+
+/*
+ * Get the contents of an INCBIN file, mapping it in unless this has
+ * already been done.  Returns NULL, having reported it, if it can't
+ * be read.
+ */
+static const struct nasm_filemap *incbin_map(const char *fname)
+{
+    struct incbin_file *ib;
+    struct hash_insert hi;
+    void **ibp;
+    char *path;
+    int64_t mtime;
+    FILE *fp;
+
+    if (!incbin_files.table)
+        hash_init(&incbin_files, HASH_SMALL);
+
+    path = nasm_realpath(fname);
+    mtime = nasm_file_mtime(path);
+
+    ibp = hash_find(&incbin_files, path, &hi);
+    if (ibp) {
+        ib = *ibp;
+        nasm_free(path);
+        if (ib->valid && ib->mtime == mtime)
+            return &ib->map;
+        if (ib->valid)
+            nasm_unmap_file(&ib->map);
+        ib->valid = false;
+    } else {
+        nasm_new(ib);
+        hash_add(&hi, path, ib);
+    }
+
+    fp = nasm_open_read(fname, NF_BINARY);
+    if (!fp) {
+        nasm_error(ERR_NONFATAL, "`incbin': unable to open file `%s'",
+                   fname);
+        return NULL;
+    }
+    ib->valid = nasm_map_file(&ib->map, fp);
+    fclose(fp);
+    if (!ib->valid) {
+        nasm_error(ERR_NONFATAL, "`incbin': unable to read file `%s'",
+                   fname);
+        return NULL;
+    }
+
+    ib->mtime = mtime;
+    return &ib->map;
+}
+
+/*
+ * The part of its file an INCBIN asks for, or NULL if the file
+ * can't be read.  An offset past the end of the file gives nothing,
+ * which is an error on the final pass.
+ */
+static const char *incbin_data(const insn *instruction, size_t *lenp,
+                               bool final)
+{
+    const extop *e = instruction->eops;
+    const struct nasm_filemap *map;
+    size_t base = 0;
+    size_t len;
+
+    map = incbin_map(e->stringval);
+    if (!map)
+        return NULL;
+
+    len = map->size;
+    if (e->next) {
+        base = e->next->offset;
+        if (base > len) {
+            if (final)
+                nasm_error(ERR_NONFATAL, "`incbin': unexpected EOF while"
+                           " reading file `%s'", e->stringval);
+            base = len;
+        }
+        len -= base;
+        if (e->next->next && len > (size_t)e->next->next->offset)
+            len = (size_t)e->next->next->offset;
+    }
+
+    *lenp = len;
+    return map->data + base;
+}
+
+/*
+ * Render a data directive into a single buffer, if it has nothing
+ * in it which needs relocating, so that it can be output (and
+ * repeated) in one go.  Returns NULL if it can't be done.
+ */
+static uint8_t *data_render(const insn *instruction, int64_t wsize,
+                            size_t *lenp)
+{
+    const extop *e;
+    uint8_t *buf, *p;
+    size_t len = 0;
+
+    list_for_each(e, instruction->eops) {
+        if (e->type == EOT_DB_NUMBER) {
+            if (wsize > 8 || e->segment != NO_SEG || e->wrt != NO_SEG)
+                return NULL;
+            len += wsize;
+        } else if (e->type == EOT_DB_STRING ||
+                   e->type == EOT_DB_STRING_FREE) {
+            len += e->stringlen + (wsize - e->stringlen % wsize) % wsize;
+        }
+    }
+    if (!len)
+        return NULL;
+
+    p = buf = nasm_malloc(len);
+    list_for_each(e, instruction->eops) {
+        if (e->type == EOT_DB_NUMBER) {
+            WRITEADDR(p, e->offset, wsize);
+        } else if (e->type == EOT_DB_STRING ||
+                   e->type == EOT_DB_STRING_FREE) {
+            size_t align = (wsize - e->stringlen % wsize) % wsize;
+
+            memcpy(p, e->stringval, e->stringlen);
+            p += e->stringlen;
+            memset(p, 0, align);
+            p += align;
+        }
+    }
+
+    *lenp = len;
+    return buf;
+}
+
 /*
  * This routine wrappers the real output format's output routine,
  * in order to pass a copy of the data off to the listing file
@@ -333,8 +774,6 @@ static void out(int64_t offset, int32_t segto, const void *data,
                 enum out_type type, uint64_t size,
                 int32_t segment, int32_t wrt)
 {
-    static int32_t lineno = 0;     /* static!!! */
-    static const char *lnfname = NULL;
     uint8_t p[8];
     int asize = addrsize(type, size); 	    /* Address size in bytes */
     const int amax  = ofmt->maxbits >> 3; /* Maximum address size in bytes */
@@ -358,19 +797,16 @@ static void out(int64_t offset, int32_t segto, const void *data,
         asize = 0;              /* No longer an address */
     }
 
-    lfmt->output(offset, data, type, size);
-
-    /*
-     * this call to src_get determines when we call the
-     * debug-format-specific "linenum" function
-     * it updates lineno and lnfname to the current values
-     * returning 0 if "same as last time", -2 if lnfname
-     * changed, and the amount by which lineno changed,
-     * if it did. thus, these variables must be static
-     */
+    /* Nothing is output in absolute space; don't bother buffering */
+    if (encbuf.active && segto != NO_SEG) {
+        if ((type == OUT_RAWDATA || (asize && asize <= amax)) &&
+            encbuf_add(offset, segto, data, type, size, segment, wrt, asize))
+            return;
+        encbuf_flush();
+    }
 
-    if (src_get(&lineno, &lnfname))
-        dfmt->linenum(lnfname, lineno, segto);
+    lfmt->output(offset, data, type, size);
+    out_linenum(segto);
 
     if (asize && asize > amax) {
         if (type != OUT_ADDRESS || (int)size < 0) {
@@ -382,7 +818,7 @@ static void out(int64_t offset, int32_t segto, const void *data,
             nasm_error(ERR_WARNING | ERR_WARN_ZEXTRELOC,
                     "%d-bit unsigned relocation zero-extended from %d bits\n",
                     asize << 3, ofmt->maxbits);
-            ofmt->output(segto, data, type, amax, segment, wrt);
+            backend_output(segto, data, type, amax, segment, wrt);
             size = asize - amax;
         }
         data = zero_buffer;
@@ -390,7 +826,7 @@ static void out(int64_t offset, int32_t segto, const void *data,
 	segment = wrt = NO_SEG;
     }
 
-    ofmt->output(segto, data, type, size, segment, wrt);
+    backend_output(segto, data, type, size, segment, wrt);
 }
 
 static void out_imm8(int64_t offset, int32_t segment,
@@ -405,6 +841,24 @@ static void out_imm8(int64_t offset, int32_t segment,
     }
 }
 
+/*
+ * Can jmp_match() pick the short form of this jump depending on
+ * where the target is?
+ */
+static bool jmp_relaxable(const insn *ins, const struct itemplate *temp)
+{
+    uint8_t c = temp->code[0];
+
+    if (((c & ~1) != 0370) || (ins->oprs[0].type & STRICT))
+        return false;
+    if (!optimizing)
+        return false;
+    if (optimizing < 0 && c == 0371)
+        return false;
+
+    return true;
+}
+
 static bool jmp_match(int32_t segment, int64_t offset, int bits,
                       insn * ins, const struct itemplate *temp)
 {
@@ -413,11 +867,7 @@ static bool jmp_match(int32_t segment, int64_t offset, int bits,
     uint8_t c = code[0];
     bool is_byte;
 
-    if (((c & ~1) != 0370) || (ins->oprs[0].type & STRICT))
-        return false;
-    if (!optimizing)
-        return false;
-    if (optimizing < 0 && c == 0371)
+    if (!jmp_relaxable(ins, temp))
         return false;
 
     isize = calcsize(segment, offset, bits, ins, temp);
@@ -462,9 +912,35 @@ int64_t assemble(int32_t segment, int64_t offset, int bits, iflag_t cp,
     if (wsize) {
         extop *e;
         int32_t t = instruction->times;
+        uint8_t *buf = NULL;
+        size_t len;
+
         if (t < 0)
 	    nasm_panic(0, "instruction->times < 0 (%"PRId32") in assemble()", t);
 
+        if (segment != NO_SEG && t > 0)
+            buf = data_render(instruction, wsize, &len);
+
+        if (buf) {
+            if (t == 1) {
+                out(offset, segment, buf, OUT_RAWDATA, len, NO_SEG, NO_SEG);
+            } else {
+                /*
+                 * The listing gets the first copy, as usual, and the
+                 * output format all of them at once, so that anything
+                 * it has to say about them it says once.
+                 */
+                lfmt->output(offset, buf, OUT_RAWDATA, len);
+                out_linenum(segment);
+                backend_fill(segment, buf, len, t);
+                lfmt->output(offset + len, NULL, OUT_RAWDATA, 0);
+                lfmt->uplevel(LIST_TIMES);
+            }
+            offset += (int64_t)len * t;
+            nasm_free(buf);
+            t = 0;
+        }
+
         while (t--) {           /* repeat TIMES times */
             list_for_each(e, instruction->eops) {
                 if (e->type == EOT_DB_NUMBER) {
@@ -508,82 +984,42 @@ int64_t assemble(int32_t segment, int64_t offset, int bits, iflag_t cp,
     }
 
     if (instruction->opcode == I_INCBIN) {
-        const char *fname = instruction->eops->stringval;
-        FILE *fp;
-
-        fp = nasm_open_read(fname, NF_BINARY);
-        if (!fp) {
-            nasm_error(ERR_NONFATAL, "`incbin': unable to open file `%s'",
-                  fname);
-        } else if (fseek(fp, 0L, SEEK_END) < 0) {
-            nasm_error(ERR_NONFATAL, "`incbin': unable to seek on file `%s'",
-                  fname);
-            fclose(fp);
-        } else {
-            static char buf[4096];
-            size_t t = instruction->times;
-            size_t base = 0;
-            size_t len;
-
-            len = ftell(fp);
-            if (instruction->eops->next) {
-                base = instruction->eops->next->offset;
-                len -= base;
-                if (instruction->eops->next->next &&
-                    len > (size_t)instruction->eops->next->next->offset)
-                    len = (size_t)instruction->eops->next->next->offset;
-            }
+        const char *data;
+        size_t t = instruction->times;
+        size_t len;
+
+        data = incbin_data(instruction, &len, true);
+        if (!data)
+            return 0;
+
+        /*
+         * Dummy call to lfmt->output to give the offset to the
+         * listing module.
+         */
+        lfmt->output(offset, NULL, OUT_RAWDATA, 0);
+        lfmt->uplevel(LIST_INCBIN);
+        while (t--) {
+            if (len)
+                out(offset, segment, data, OUT_RAWDATA, len,
+                    NO_SEG, NO_SEG);
+        }
+        lfmt->downlevel(LIST_INCBIN);
+        if (instruction->times > 1) {
             /*
              * Dummy call to lfmt->output to give the offset to the
              * listing module.
              */
             lfmt->output(offset, NULL, OUT_RAWDATA, 0);
-            lfmt->uplevel(LIST_INCBIN);
-            while (t--) {
-                size_t l;
-
-                fseek(fp, base, SEEK_SET);
-                l = len;
-                while (l > 0) {
-                    int32_t m;
-                    m = fread(buf, 1, l > sizeof(buf) ? sizeof(buf) : l, fp);
-                    if (!m) {
-                        /*
-                         * This shouldn't happen unless the file
-                         * actually changes while we are reading
-                         * it.
-                         */
-                        nasm_error(ERR_NONFATAL,
-                              "`incbin': unexpected EOF while"
-                              " reading file `%s'", fname);
-                        t = 0;  /* Try to exit cleanly */
-                        break;
-                    }
-                    out(offset, segment, buf, OUT_RAWDATA, m,
-                        NO_SEG, NO_SEG);
-                    l -= m;
-                }
-            }
-            lfmt->downlevel(LIST_INCBIN);
-            if (instruction->times > 1) {
-                /*
-                 * Dummy call to lfmt->output to give the offset to the
-                 * listing module.
-                 */
-                lfmt->output(offset, NULL, OUT_RAWDATA, 0);
-                lfmt->uplevel(LIST_TIMES);
-                lfmt->downlevel(LIST_TIMES);
-            }
-            fclose(fp);
-            return instruction->times * len;
+            lfmt->uplevel(LIST_TIMES);
+            lfmt->downlevel(LIST_TIMES);
         }
-        return 0;               /* if we're here, there's an error */
+        return instruction->times * len;
     }
 
     /* Check to see if we need an address-size prefix */
     add_asp(instruction, bits);
 
-    m = find_match(&temp, instruction, segment, offset, bits);
+    m = find_match(&temp, NULL, instruction, segment, offset, bits);
 
     if (m == MOK_GOOD) {
         /* Matches! */
@@ -591,8 +1027,25 @@ int64_t assemble(int32_t segment, int64_t offset, int bits, iflag_t cp,
         itimes = instruction->times;
         if (insn_size < 0)  /* shouldn't be, on pass two */
             nasm_panic(0, "errors made it through from pass one");
-        else
+        else if (instruction->opcode == I_RESB && itimes > 1 &&
+                 insn_size == instruction->oprs[0].offset) {
+            /*
+             * A TIMES'd RESB with no prefixes is one reservation as
+             * far as the output format is concerned; the listing
+             * shows the first copy.
+             */
+            if (insn_size > 0) {
+                lfmt->output(offset, NULL, OUT_RESERVE, insn_size);
+                out_linenum(segment);
+                backend_output(segment, NULL, OUT_RESERVE,
+                               insn_size * itimes, NO_SEG, NO_SEG);
+            }
+            lfmt->output(offset + insn_size, NULL, OUT_RAWDATA, 0);
+            lfmt->uplevel(LIST_TIMES);
+            offset += insn_size * itimes;
+        } else
             while (itimes--) {
+                encbuf_begin();
                 for (j = 0; j < MAXPREFIX; j++) {
                     uint8_t c = 0;
                     switch (instruction->prefixes[j]) {
@@ -707,6 +1160,7 @@ int64_t assemble(int32_t segment, int64_t offset, int bits, iflag_t cp,
                 insn_end = offset + insn_size;
                 gencode(segment, offset, bits, instruction,
                         temp, insn_end);
+                encbuf_end();
                 offset += insn_size;
                 if (itimes > 0 && itimes == instruction->times - 1) {
                     /*
@@ -760,11 +1214,137 @@ int64_t assemble(int32_t segment, int64_t offset, int bits, iflag_t cp,
     return 0;
 }
 
+/*
+ * Number of prefix bytes which go with an instruction on top of
+ * what calcsize() counts
+ */
+static int prefix_bytes(const insn *ins, int bits)
+{
+    int j, n = 0;
+
+    for (j = 0; j < MAXPREFIX; j++) {
+        switch (ins->prefixes[j]) {
+        case P_A16:
+            if (bits != 16)
+                n++;
+            break;
+        case P_A32:
+            if (bits != 32)
+                n++;
+            break;
+        case P_O16:
+            if (bits != 16)
+                n++;
+            break;
+        case P_O32:
+            if (bits == 16)
+                n++;
+            break;
+        case P_A64:
+        case P_O64:
+        case P_EVEX:
+        case P_VEX3:
+        case P_VEX2:
+        case P_NOBND:
+        case P_none:
+            break;
+        default:
+            n++;
+            break;
+        }
+    }
+
+    return n;
+}
+
+/*
+ * The template find_match() falls back to when jmp_match() turns
+ * down the short form of a jump
+ */
+static const struct itemplate *jmp_near(insn *ins, int bits,
+                                        const struct itemplate *jump)
+{
+    const struct itemplate_sel *sel;
+
+    sel = nasm_insn_select[ins->opcode][ins->operands];
+    while (sel->temp != jump)
+        sel++;
+
+    for (sel++; sel->temp; sel++) {
+        switch (matches(sel->temp, ins, bits)) {
+        case MOK_GOOD:
+            return sel->temp;
+        case MOK_JUMP:
+            return NULL;        /* Another conditional form; give up */
+        default:
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Hand a jump which jmp_match() could encode either way to the
+ * relaxation: the size of the line with the short and the near form,
+ * and where the target is.  rep_prefix is the REP prefix slot as it
+ * was before jmp_match() had a chance to drop a BND prefix.
+ */
+static void relax_jump(int32_t segment, int64_t offset, int bits,
+                       insn *ins, const struct itemplate *temp,
+                       const struct itemplate *jump, int rep_prefix)
+{
+    const struct itemplate *near;
+    struct relax_branch branch;
+    bool unknown = !!(ins->oprs[0].opflags & OPFLAG_UNKNOWN);
+    int64_t size;
+    insn tmp;
+
+    if (!jmp_relaxable(ins, jump))
+        return;
+    if (!unknown && ins->oprs[0].segment != segment)
+        return;                 /* Always near */
+
+    tmp = *ins;
+    tmp.prefixes[PPS_REP] = rep_prefix;
+
+    branch.is_short = (temp == jump);
+    near = branch.is_short ? jmp_near(&tmp, bits, jump) : temp;
+    if (!near || (near->code[0] & ~1) == 0370)
+        return;
+
+    branch.lineno   = ins->lineno;
+    branch.segment  = segment;
+    branch.offset   = offset;
+    branch.tsegment = unknown ? NO_SEG : ins->oprs[0].segment;
+    branch.target   = ins->oprs[0].offset;
+    branch.forward  = !!(ins->oprs[0].opflags & OPFLAG_FORWARD);
+
+    branch.jsize = calcsize(segment, offset, bits, &tmp, jump);
+    if (branch.jsize < 0)
+        return;
+    if (jump->code[0] == 0371 && tmp.prefixes[PPS_REP] == P_BND)
+        tmp.prefixes[PPS_REP] = P_none;
+    branch.ssize = (branch.jsize + prefix_bytes(&tmp, bits)) * ins->times;
+
+    tmp = *ins;
+    tmp.prefixes[PPS_REP] = rep_prefix;
+    size = calcsize(segment, offset, bits, &tmp, near);
+    if (size < 0)
+        return;
+    branch.nsize = (size + prefix_bytes(&tmp, bits)) * ins->times;
+
+    relax_branch(&branch);
+}
+
 int64_t insn_size(int32_t segment, int64_t offset, int bits, iflag_t cp,
                   insn * instruction)
 {
     const struct itemplate *temp;
+    const struct itemplate *jump;
     enum match_result m;
+    struct line_memo **slot, *memo;
+    int rep_prefix;
 
     cpu = cp;
 
@@ -801,77 +1381,51 @@ int64_t insn_size(int32_t segment, int64_t offset, int bits, iflag_t cp,
     }
 
     if (instruction->opcode == I_INCBIN) {
-        const char *fname = instruction->eops->stringval;
-        FILE *fp;
-        int64_t val = 0;
         size_t len;
 
-        fp = nasm_open_read(fname, NF_BINARY);
-        if (!fp)
-            nasm_error(ERR_NONFATAL, "`incbin': unable to open file `%s'",
-                  fname);
-        else if (fseek(fp, 0L, SEEK_END) < 0)
-            nasm_error(ERR_NONFATAL, "`incbin': unable to seek on file `%s'",
-                  fname);
-        else {
-            len = ftell(fp);
-            if (instruction->eops->next) {
-                len -= instruction->eops->next->offset;
-                if (instruction->eops->next->next &&
-                    len > (size_t)instruction->eops->next->next->offset) {
-                    len = (size_t)instruction->eops->next->next->offset;
-                }
-            }
-            val = instruction->times * len;
-        }
-        if (fp)
-            fclose(fp);
-        return val;
+        if (!incbin_data(instruction, &len, false))
+            return 0;
+        return instruction->times * len;
     }
 
     /* Check to see if we need an address-size prefix */
     add_asp(instruction, bits);
 
-    m = find_match(&temp, instruction, segment, offset, bits);
+    /* Nothing about this line has changed since it was last sized? */
+    slot = line_memo_slot(instruction->lineno);
+    memo = slot ? *slot : NULL;
+    if (line_memo_matches(memo, instruction, bits) &&
+        line_memo_sizes(memo, instruction))
+        return memo->size * instruction->times;
+
+    rep_prefix = instruction->prefixes[PPS_REP];
+
+    m = find_match(&temp, &jump, instruction, segment, offset, bits);
     if (m == MOK_GOOD) {
         /* we've matched an instruction. */
         int64_t isize;
-        int j;
+
+        if (jump)
+            relax_jump(segment, offset, bits, instruction, temp, jump,
+                       rep_prefix);
+
+        /*
+         * If the template was memoized, take a snapshot of the
+         * operand values before calcsize() adds its own prefixes.
+         */
+        memo = slot ? *slot : NULL;
+        if (memo && memo->temp == temp &&
+            line_memo_matches(memo, instruction, bits))
+            line_memo_set_values(memo, instruction);
+        else
+            memo = NULL;
 
         isize = calcsize(segment, offset, bits, instruction, temp);
         if (isize < 0)
             return -1;
-        for (j = 0; j < MAXPREFIX; j++) {
-            switch (instruction->prefixes[j]) {
-            case P_A16:
-                if (bits != 16)
-                    isize++;
-                break;
-            case P_A32:
-                if (bits != 32)
-                    isize++;
-                break;
-            case P_O16:
-                if (bits != 16)
-                    isize++;
-                break;
-            case P_O32:
-                if (bits == 16)
-                    isize++;
-                break;
-            case P_A64:
-            case P_O64:
-            case P_EVEX:
-            case P_VEX3:
-            case P_VEX2:
-            case P_NOBND:
-            case P_none:
-                break;
-            default:
-                isize++;
-                break;
-            }
-        }
+        isize += prefix_bytes(instruction, bits);
+        if (memo)
+            memo->size = isize;
         return isize * instruction->times;
     } else {
         return -1;                  /* didn't match any instruction */
@@ -2048,17 +2602,406 @@ static int op_evexflags(const operand * o, int mask, uint8_t byte)
     return evexflags(val, o->decoflags, mask, byte);
 }
 
+/*
+ * Operand class signature of an instruction, in the same form as
+ * the ITSEL_SIG() of a template (see insns.h).
+ */
+static uint32_t insn_sig(const insn *instruction)
+{
+    uint32_t sig = 0;
+    enum itsel_kind kind;
+    int i;
+
+    /*
+     * A {vex}/{evex} prefix makes a template with a mismatching
+     * encoding a more specific error than a mismatching operand
+     * class, so we can't skip anything ahead of matches().
+     */
+    if (instruction->prefixes[PPS_VEX])
+        return 0;
+
+    for (i = 0; i < instruction->operands; i++) {
+        switch (instruction->oprs[i].type & OPTYPE_MASK) {
+        case REGISTER:
+            kind = ITSEL_REG;
+            break;
+        case REGISTER|REGMEM:
+            kind = ITSEL_REG_EA;
+            break;
+        case MEMORY:
+            kind = ITSEL_MEM;
+            break;
+        case IMMEDIATE:
+            kind = ITSEL_IMM;
+            break;
+        default:
+            kind = ITSEL_OTHER;
+            break;
+        }
+        sig |= (UINT32_C(1) << kind) << (i * ITSEL_KIND_BITS);
+    }
+
+    return sig;
+}
+
+static struct line_memo **line_memo_slot(int32_t lineno)
+{
+    size_t n;
+
+    if (lineno <= 0)
+        return NULL;
+
+    if ((size_t)lineno >= line_memo_size) {
+        n = line_memo_size ? line_memo_size : 1024;
+        while (n <= (size_t)lineno)
+            n <<= 1;
+        line_memo = nasm_realloc(line_memo, n * sizeof *line_memo);
+        memset(line_memo + line_memo_size, 0,
+               (n - line_memo_size) * sizeof *line_memo);
+        line_memo_size = n;
+    }
+
+    return &line_memo[lineno];
+}
+
+/*
+ * Does the memo agree with the instruction in everything matches()
+ * looks at?
+ */
+static bool line_memo_matches(const struct line_memo *memo,
+                              const insn *instruction, int bits)
+{
+    int i;
+
+    if (!memo || !memo->temp ||
+        memo->opcode != instruction->opcode ||
+        memo->operands != instruction->operands ||
+        memo->bits != bits ||
+        memo->broadcast != instruction->evex_brerop ||
+        memcmp(memo->prefixes, instruction->prefixes, sizeof memo->prefixes) ||
+        memcmp(&memo->cpu, &cpu, sizeof cpu))
+        return false;
+
+    for (i = 0; i < instruction->operands; i++) {
+        if (memo->oprs[i].type != instruction->oprs[i].type ||
+            memo->oprs[i].decoflags != instruction->oprs[i].decoflags)
+            return false;
+    }
+
+    return true;
+}
+
+/*
+ * Does the memo also agree with the instruction in the operand values
+ * and everything else calcsize() looks at?
+ */
+static bool line_memo_sizes(const struct line_memo *memo,
+                            const insn *instruction)
+{
+    const operand *m, *o;
+    int i;
+
+    if (memo->size < 0 ||
+        memo->addr_size != instruction->addr_size ||
+        memo->evex_rm != instruction->evex_rm ||
+        memo->bnd != globalbnd)
+        return false;
+
+    for (i = 0; i < instruction->operands; i++) {
+        m = &memo->oprs[i];
+        o = &instruction->oprs[i];
+        if (m->offset != o->offset || m->segment != o->segment ||
+            m->wrt != o->wrt || m->opflags != o->opflags ||
+            m->eaflags != o->eaflags || m->disp_size != o->disp_size ||
+            m->basereg != o->basereg || m->indexreg != o->indexreg ||
+            m->scale != o->scale || m->hintbase != o->hintbase ||
+            m->hinttype != o->hinttype)
+            return false;
+    }
+
+    return true;
+}
+
+static void line_memo_set_values(struct line_memo *memo,
+                                 const insn *instruction)
+{
+    int i;
+
+    memo->size      = -1;
+    memo->addr_size = instruction->addr_size;
+    memo->evex_rm   = instruction->evex_rm;
+    memo->bnd       = globalbnd;
+    for (i = 0; i < instruction->operands; i++)
+        memo->oprs[i] = instruction->oprs[i];
+}
+
+static void line_memo_set(struct line_memo **slot, const insn *instruction,
+                          int bits, const struct itemplate *temp)
+{
+    struct line_memo *memo = *slot;
+
+    if (!memo || memo->operands != instruction->operands) {
+        memo = nasm_realloc(memo, sizeof(struct line_memo) +
+                            instruction->operands * sizeof(operand));
+        memo->oprs = (operand *)(memo + 1);
+        *slot = memo;
+    }
+
+    memo->temp      = temp;
+    memo->opcode    = instruction->opcode;
+    memo->operands  = instruction->operands;
+    memo->bits      = bits;
+    memo->broadcast = instruction->evex_brerop;
+    memo->cpu       = cpu;
+    memcpy(memo->prefixes, instruction->prefixes, sizeof memo->prefixes);
+    line_memo_set_values(memo, instruction);
+}
+
+void assemble_cleanup(void)
+{
+    struct incbin_file *ib;
+    const char *key;
+    struct hash_tbl_node *it = NULL;
+    size_t i;
+
+    for (i = 0; i < line_memo_size; i++)
+        nasm_free(line_memo[i]);
+    nasm_free(line_memo);
+    line_memo = NULL;
+    line_memo_size = 0;
+
+    while ((ib = hash_iterate(&incbin_files, &it, &key)) != NULL) {
+        nasm_free((void *)key);
+        if (ib->valid)
+            nasm_unmap_file(&ib->map);
+        nasm_free(ib);
+    }
+    hash_free(&incbin_files);
+
+    if (batch) {
+        for (i = 0; i < BATCH_LINES; i++)
+            nasm_free(batch[i].log);
+        nasm_free(batch);
+        batch = NULL;
+    }
+}
+
+/*
+ * A copy of the extended operands of an instruction, strings and all,
+ * which outlives the line: the ones the parser makes point into it.
+ */
+static extop *eops_copy(const extop *e)
+{
+    extop *head = NULL, **tail = &head;
+    extop *c;
+    size_t len;
+
+    for (; e; e = e->next) {
+        bool string = e->type == EOT_DB_STRING ||
+            e->type == EOT_DB_STRING_FREE;
+
+        len = string ? e->stringlen : 0;
+        c = nasm_malloc(sizeof(extop) + len);
+        *c = *e;
+        if (string) {
+            c->type = EOT_DB_STRING;
+            c->stringval = (char *)(c + 1);
+            memcpy(c->stringval, e->stringval, len);
+        }
+        c->next = NULL;
+        *tail = c;
+        tail = &c->next;
+    }
+
+    return head;
+}
+
+static void eops_free(extop *e)
+{
+    extop *next;
+
+    for (; e; e = next) {
+        next = e->next;
+        nasm_free(e);
+    }
+}
+
+/*
+ * Add a line to the batch, to be assembled at the given offset when
+ * the batch is flushed; size is what it has to come to.  Returns true
+ * if the batch is now full.
+ */
+bool assemble_batch_add(int32_t segment, int64_t offset, int bits,
+                        iflag_t cp, insn *instruction, int64_t size)
+{
+    struct batch_line *bl;
+
+    if (!batch)
+        batch = nasm_zalloc(BATCH_LINES * sizeof(*batch));
+
+    bl = &batch[batch_lines++];
+    bl->ins       = *instruction;
+    bl->ins.label = NULL;
+    bl->ins.eops  = eops_copy(instruction->eops);
+    bl->segment   = segment;
+    bl->offset    = offset;
+    bl->bits      = bits;
+    bl->cpu       = cp;
+    bl->size      = size;
+    bl->lineno    = src_get_linnum();
+    bl->fname     = src_get_fname();
+    bl->loglen    = 0;
+
+    return batch_lines == BATCH_LINES;
+}
+
+static void batch_job(void *arg, int job)
+{
+    struct batch_line *bl;
+    int i, end;
+
+    (void)arg;
+
+    end = (job + 1) * BATCH_JOB;
+    if (end > batch_lines)
+        end = batch_lines;
+
+    for (i = job * BATCH_JOB; i < end; i++) {
+        bl = batch_cur = &batch[i];
+        bl->done = assemble(bl->segment, bl->offset, bl->bits, bl->cpu,
+                            &bl->ins);
+    }
+    batch_cur = NULL;
+}
+
+/*
+ * Play back the log of a line
+ */
+static void batch_replay(const struct batch_line *bl)
+{
+    const struct batch_rec *r;
+    const uint8_t *data;
+    size_t pos = 0;
+
+    while (pos < bl->loglen) {
+        r = (const struct batch_rec *)(bl->log + pos);
+        data = (const uint8_t *)(r + 1);
+        pos += sizeof(*r) + BATCH_PAD(r->len) +
+            r->nfields * sizeof(struct out_field);
+
+        switch (r->op) {
+        case BATCH_OUTPUT:
+            ofmt->output(r->segto, r->type == OUT_RESERVE ? NULL : data,
+                         r->type, r->size, r->segment, r->wrt);
+            break;
+        case BATCH_BLOCK:
+            ofmt->output_block(r->segto, data, r->len,
+                               (const struct out_field *)
+                               (data + BATCH_PAD(r->len)), r->nfields);
+            break;
+        case BATCH_FILL:
+            ofmt->output_fill(r->segto, data, r->len, r->size);
+            break;
+        case BATCH_ERROR:
+            nasm_error(r->severity, "%s", (const char *)data);
+            break;
+        }
+    }
+}
+
+/*
+ * Assemble the lines in the batch on up to nasm_jobs threads, and
+ * hand them to the output format in order, each with the source line
+ * it came from set for any errors.  Returns false if any of them came
+ * to a different size from last time, which puts everything after it
+ * out of phase.
+ */
+bool assemble_batch_flush(void)
+{
+    struct batch_line *bl;
+    int32_t lineno;
+    const char *fname;
+    bool same = true;
+    int i;
+
+    if (!batch_lines)
+        return true;
+
+    nasm_parallel(batch_job, NULL, (batch_lines + BATCH_JOB - 1) / BATCH_JOB,
+                  nasm_jobs);
+
+    lineno = src_get_linnum();
+    fname  = src_get_fname();
+    for (i = 0; i < batch_lines; i++) {
+        bl = &batch[i];
+        if (bl->fname != src_get_fname())
+            src_set_fname(bl->fname);
+        src_set_linnum(bl->lineno);
+        batch_replay(bl);
+        if (bl->done != bl->size)
+            same = false;
+        eops_free(bl->ins.eops);
+    }
+    src_set(lineno, fname);
+
+    batch_lines = 0;
+    return same;
+}
+
+/*
+ * Log an error from a line being assembled in a batch.  Returns false
+ * if it isn't from one, or is fatal, and has to be reported as usual.
+ */
+bool assemble_batch_error(int severity, const char *fmt, va_list args)
+{
+    struct batch_rec *r;
+    char msg[1024];
+    size_t len;
+
+    if (!batch_cur || (severity & ERR_MASK) >= ERR_FATAL)
+        return false;
+
+    vsnprintf(msg, sizeof msg, fmt, args);
+    len = strlen(msg) + 1;
+    r = batch_rec(BATCH_ERROR, len, 0);
+    r->severity = severity;
+    memcpy(r + 1, msg, len);
+    return true;
+}
+
 static enum match_result find_match(const struct itemplate **tempp,
+                                    const struct itemplate **jumpp,
                                     insn *instruction,
                                     int32_t segment, int64_t offset, int bits)
 {
+    const struct itemplate_sel *sel, *sels;
     const struct itemplate *temp;
     enum match_result m, merr;
     opflags_t xsizeflags[MAX_OPERANDS];
     bool opsizemissing = false;
+    bool jumps = false;
     int8_t broadcast = instruction->evex_brerop;
+    struct line_memo **slot;
+    uint32_t isig;
     int i;
 
+    if (jumpp)
+        *jumpp = NULL;
+
+    /* The memo is shared, so lines encoded in a batch leave it alone */
+    slot = batch_cur ? NULL : line_memo_slot(instruction->lineno);
+    if (slot && line_memo_matches(*slot, instruction, bits)) {
+        *tempp = (*slot)->temp;
+        return MOK_GOOD;
+    }
+
+    merr = MERR_INVALOP;
+    temp = NULL;
+
+    sels = nasm_insn_select[instruction->opcode][instruction->operands];
+    if (!sels)
+        goto done;
+
     /* broadcasting uses a different data element size */
     for (i = 0; i < instruction->operands; i++)
         if (i == broadcast)
@@ -2066,12 +3009,16 @@ static enum match_result find_match(const struct itemplate **tempp,
         else
             xsizeflags[i] = instruction->oprs[i].type & SIZE_MASK;
 
-    merr = MERR_INVALOP;
+    isig = insn_sig(instruction);
 
-    for (temp = nasm_instructions[instruction->opcode];
-         temp->opcode != I_none; temp++) {
+    for (sel = sels; (temp = sel->temp); sel++) {
+        if ((sel->sig & isig) != isig)
+            continue;
         m = matches(temp, instruction, bits);
         if (m == MOK_JUMP) {
+            if (jumpp && !jumps)
+                *jumpp = temp;
+            jumps = true;
             if (jmp_match(segment, offset, bits, instruction, temp))
                 m = MOK_GOOD;
             else
@@ -2089,8 +3036,15 @@ static enum match_result find_match(const struct itemplate **tempp,
         }
         if (m > merr)
             merr = m;
-        if (merr == MOK_GOOD)
+        if (merr == MOK_GOOD) {
+            /*
+             * Remember the template unless the choice depended on
+             * the offset of a jump target.
+             */
+            if (slot && !jumps)
+                line_memo_set(slot, instruction, bits, temp);
             goto done;
+        }
     }
 
     /* No match, but see if we can get a fuzzy operand size match... */
@@ -2120,8 +3074,9 @@ static enum match_result find_match(const struct itemplate **tempp,
     }
 
     /* Try matching again... */
-    for (temp = nasm_instructions[instruction->opcode];
-         temp->opcode != I_none; temp++) {
+    for (sel = sels; (temp = sel->temp); sel++) {
+        if ((sel->sig & isig) != isig)
+            continue;
         m = matches(temp, instruction, bits);
         if (m == MOK_JUMP) {
             if (jmp_match(segment, offset, bits, instruction, temp))
@@ -44,4 +44,9 @@ int64_t insn_size(int32_t segment, int64_t offset, int bits, iflag_t cp,
                insn * instruction);
 int64_t assemble(int32_t segment, int64_t offset, int bits, iflag_t cp,
                  insn * instruction);
+void assemble_cleanup(void);
+bool assemble_batch_add(int32_t segment, int64_t offset, int bits,
+                        iflag_t cp, insn *instruction, int64_t size);
+bool assemble_batch_flush(void);
+bool assemble_batch_error(int severity, const char *fmt, va_list args);
 #endif
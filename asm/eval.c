@@ -45,18 +45,21 @@
 
 #include "nasm.h"
 #include "nasmlib.h"
+#include "arena.h"
+#include "atom.h"
 #include "eval.h"
 #include "labels.h"
 #include "float.h"
 
-#define TEMPEXPRS_DELTA 128
 #define TEMPEXPR_DELTA 8
 
 static scanner scan;            /* Address of scanner routine */
 
-static expr **tempexprs = NULL;
-static int ntempexprs;
-static int tempexprs_size = 0;
+/*
+ * Finished expression vectors live in tempexprs until the next call
+ * to evaluate(); the one under construction is built in tempexpr.
+ */
+static struct arena tempexprs;
 
 static expr *tempexpr;
 static int ntempexpr;
@@ -80,9 +83,10 @@ extern int32_t abs_offset;      /* ABSOLUTE segment offset */
  */
 void eval_cleanup(void)
 {
-    while (ntempexprs)
-        nasm_free(tempexprs[--ntempexprs]);
-    nasm_free(tempexprs);
+    arena_free(&tempexprs);
+    nasm_free(tempexpr);
+    tempexpr = NULL;
+    tempexpr_size = 0;
 }
 
 /*
@@ -90,8 +94,7 @@ void eval_cleanup(void)
  */
 static void begintemp(void)
 {
-    tempexpr = NULL;
-    tempexpr_size = ntempexpr = 0;
+    ntempexpr = 0;
 }
 
 static void addtotemp(int32_t type, int64_t value)
@@ -107,13 +110,11 @@ static void addtotemp(int32_t type, int64_t value)
 
 static expr *finishtemp(void)
 {
+    expr *e;
+
     addtotemp(0L, 0L);          /* terminate */
-    while (ntempexprs >= tempexprs_size) {
-        tempexprs_size += TEMPEXPRS_DELTA;
-        tempexprs = nasm_realloc(tempexprs,
-                                 tempexprs_size * sizeof(*tempexprs));
-    }
-    return tempexprs[ntempexprs++] = tempexpr;
+    e = arena_alloc(&tempexprs, ntempexpr * sizeof(*tempexpr));
+    return memcpy(e, tempexpr, ntempexpr * sizeof(*tempexpr));
 }
 
 /*
@@ -909,7 +910,13 @@ static expr *expr6(int critical)
                 label_seg = in_abs_seg ? abs_seg : location.segment;
                 label_ofs = in_abs_seg ? abs_offset : location.offset;
             } else {
-                if (!lookup_label(tokval->t_charptr, &label_seg, &label_ofs)) {
+                struct atom *name = tokval->t_atom;
+
+                if (i != TOKEN_ID || !name)
+                    name = atom_get(tokval->t_charptr,
+                                    strlen(tokval->t_charptr));
+
+                if (!lookup_label_atom(name, &label_seg, &label_ofs)) {
                     scope = local_scope(tokval->t_charptr);
                     if (critical == 2) {
                         nasm_error(ERR_NONFATAL, "symbol `%s%s' undefined",
@@ -927,8 +934,12 @@ static expr *expr6(int critical)
                         label_seg = NO_SEG;
                         label_ofs = 1;
                     }
+                } else if (opflags && passn > 1 &&
+                           !is_current_label(name)) {
+                    /* Still the value from the previous pass */
+                    *opflags |= OPFLAG_FORWARD;
                 }
-                if (opflags && is_extern(tokval->t_charptr))
+                if (opflags && is_extern_atom(name))
                     *opflags |= OPFLAG_EXTERN;
             }
             addtotemp(type, label_ofs);
@@ -974,8 +985,7 @@ expr *evaluate(scanner sc, void *scprivate, struct tokenval *tv,
     else
         i = tokval->t_type;
 
-    while (ntempexprs)          /* initialize temporary storage */
-        nasm_free(tempexprs[--ntempexprs]);
+    arena_reset(&tempexprs);    /* initialize temporary storage */
 
     e = bexpr(critical);
     if (!e)
@@ -43,7 +43,7 @@
 
 #include "nasm.h"
 #include "nasmlib.h"
-#include "hashtbl.h"
+#include "atom.h"
 #include "labels.h"
 
 /*
@@ -93,6 +93,7 @@ union label {                   /* actual label structures */
         int64_t offset;
         char *label, *special;
         int is_global, is_norm;
+        int pass;               /* pass it was last defined on */
     } defn;
     struct {
         int32_t movingon;
@@ -109,7 +110,6 @@ struct permts {                 /* permanent text storage */
 
 extern int64_t global_offset_changed;   /* defined in nasm.c */
 
-static struct hash_table ltab;          /* labels hash table */
 static union label *ldata;              /* all label data blocks */
 static union label *lfree;              /* labels free block */
 static struct permts *perm_head;        /* start of perm. text storage */
@@ -142,37 +142,13 @@ static void out_symdef(char *name, int32_t segment, int64_t offset,
 }
 
 /*
- * Internal routine: finds the `union label' corresponding to the
- * given label name. Creates a new one, if it isn't found, and if
- * `create' is true.
+ * Internal routine: finds the `union label' belonging to an atom,
+ * which is where labels are kept. Creates a new one, if it isn't
+ * found, and if `create' is true.
  */
-static union label *find_label(char *label, int create, int *created)
+static union label *find_atom(struct atom *name, int create, int *created)
 {
-    char *prev;
-    int prevlen, len;
-    union label *lptr, **lpp;
-    char label_str[IDLEN_MAX];
-    struct hash_insert ip;
-
-    if (islocal(label)) {
-        prev = prevlabel;
-        prevlen = strlen(prev);
-        len = strlen(label);
-        if (prevlen + len >= IDLEN_MAX) {
-            nasm_error(ERR_NONFATAL, "identifier length exceed %i bytes",
-                       IDLEN_MAX);
-            return NULL;
-        }
-        memcpy(label_str, prev, prevlen);
-        memcpy(label_str+prevlen, label, len+1);
-        label = label_str;
-    } else {
-        prev = "";
-        prevlen = 0;
-    }
-
-    lpp = (union label **) hash_find(&ltab, label, &ip);
-    lptr = lpp ? *lpp : NULL;
+    union label *lptr = name->label;
 
     if (lptr || !create) {
         if (created)
@@ -194,22 +170,56 @@ static union label *find_label(char *label, int create, int *created)
         *created = 1;
 
     lfree->admin.movingon = BOGUS_VALUE;
-    lfree->defn.label = perm_copy(label);
+    lfree->defn.label = (char *)name->str;
     lfree->defn.special = NULL;
     lfree->defn.is_global = NOT_DEFINED_YET;
 
-    hash_add(&ip, lfree->defn.label, lfree);
+    name->label = lfree;
     return lfree++;
 }
 
-bool lookup_label(char *label, int32_t *segment, int64_t *offset)
+/*
+ * Internal routine: finds the `union label' corresponding to the
+ * given label name. Creates a new one, if it isn't found, and if
+ * `create' is true.
+ */
+static union label *find_label(char *label, int create, int *created)
 {
-    union label *lptr;
+    char *prev;
+    int prevlen, len;
+    char label_str[IDLEN_MAX];
 
-    if (!initialized)
-        return false;
+    len = strlen(label);
+    if (islocal(label)) {
+        prev = prevlabel;
+        prevlen = strlen(prev);
+        if (prevlen + len >= IDLEN_MAX) {
+            nasm_error(ERR_NONFATAL, "identifier length exceed %i bytes",
+                       IDLEN_MAX);
+            return NULL;
+        }
+        memcpy(label_str, prev, prevlen);
+        memcpy(label_str+prevlen, label, len+1);
+        label = label_str;
+        len += prevlen;
+    }
 
-    lptr = find_label(label, 0, NULL);
+    return find_atom(atom_get(label, len), create, created);
+}
+
+/*
+ * The same for a name which has already been interned; only local
+ * labels need another lookup.
+ */
+static union label *find_label_atom(struct atom *name)
+{
+    if (islocal(name->str))
+        return find_label((char *)name->str, 0, NULL);
+    return find_atom(name, 0, NULL);
+}
+
+static bool label_value(union label *lptr, int32_t *segment, int64_t *offset)
+{
     if (lptr && (lptr->defn.is_global & DEFINED_BIT)) {
         *segment = lptr->defn.segment;
         *offset = lptr->defn.offset;
@@ -219,6 +229,38 @@ bool lookup_label(char *label, int32_t *segment, int64_t *offset)
     return false;
 }
 
+bool lookup_label(char *label, int32_t *segment, int64_t *offset)
+{
+    if (!initialized)
+        return false;
+
+    return label_value(find_label(label, 0, NULL), segment, offset);
+}
+
+bool lookup_label_atom(struct atom *label, int32_t *segment, int64_t *offset)
+{
+    if (!initialized)
+        return false;
+
+    return label_value(find_label_atom(label), segment, offset);
+}
+
+/*
+ * Has the label been defined on this pass yet?  If not, it still has
+ * the value from the previous pass.
+ */
+bool is_current_label(struct atom *label)
+{
+    union label *lptr;
+
+    if (!initialized)
+        return false;
+
+    lptr = find_label_atom(label);
+    return (lptr && (lptr->defn.is_global & DEFINED_BIT) &&
+            lptr->defn.pass == passn);
+}
+
 bool is_extern(char *label)
 {
     union label *lptr;
@@ -230,6 +272,17 @@ bool is_extern(char *label)
     return (lptr && (lptr->defn.is_global & EXTERN_BIT));
 }
 
+bool is_extern_atom(struct atom *label)
+{
+    union label *lptr;
+
+    if (!initialized)
+        return false;
+
+    lptr = find_label_atom(label);
+    return (lptr && (lptr->defn.is_global & EXTERN_BIT));
+}
+
 void redefine_label(char *label, int32_t segment, int64_t offset, char *special,
                     bool is_norm, bool isextrn)
 {
@@ -270,6 +323,7 @@ void redefine_label(char *label, int32_t segment, int64_t offset, char *special,
 
     lptr->defn.offset = offset;
     lptr->defn.segment = segment;
+    lptr->defn.pass = passn;
 
     if (pass0 == 1) {
         exi = !!(lptr->defn.is_global & GLOBAL_BIT);
@@ -331,6 +385,7 @@ void define_label(char *label, int32_t segment, int64_t offset, char *special,
     lptr->defn.segment = segment;
     lptr->defn.offset = offset;
     lptr->defn.is_norm = (!islocalchar(label[0]) && is_norm);
+    lptr->defn.pass = passn;
 
     if (pass0 == 1 || (!is_norm && !isextrn && (segment > 0) && (segment & 1))) {
         exi = !!(lptr->defn.is_global & GLOBAL_BIT);
@@ -421,8 +476,6 @@ void declare_as_global(char *label, char *special)
 
 int init_labels(void)
 {
-    hash_init(&ltab, HASH_LARGE);
-
     ldata = lfree = (union label *)nasm_malloc(LBLK_SIZE);
     init_block(lfree);
 
@@ -446,8 +499,6 @@ void cleanup_labels(void)
 
     initialized = false;
 
-    hash_free(&ltab);
-
     lptr = lhold = ldata;
     while (lptr) {
         lptr = &lptr[LABEL_BLOCK-1];
@@ -463,6 +514,26 @@ void cleanup_labels(void)
     }
 }
 
+/*
+ * Move every label defined so far by what shift() returns for its
+ * segment and offset, as if the code in front of it had changed size.
+ */
+void shift_labels(int64_t (*shift)(int32_t segment, int64_t offset))
+{
+    union label *lptr, *l;
+    int j;
+
+    for (lptr = ldata; lptr; lptr = lptr[LABEL_BLOCK - 1].admin.next) {
+        for (j = 0; j < LABEL_BLOCK - 1; j++) {
+            l = &lptr[j];
+            if (l->admin.movingon == END_LIST)
+                return;
+            if ((l->defn.is_global & (DEFINED_BIT | EXTERN_BIT)) == DEFINED_BIT)
+                l->defn.offset += shift(l->defn.segment, l->defn.offset);
+        }
+    }
+}
+
 static void init_block(union label *blk)
 {
     int j;
@@ -51,6 +51,13 @@
 #define LIST_INDENT  40
 #define LIST_HEXBIT  18
 
+/*
+ * Lines are formatted straight into one big buffer, which is written
+ * out whenever it can't take another listing line.
+ */
+#define LIST_BUF_SIZE (128*1024)
+#define LIST_EMIT_MAX (2 * LIST_MAX_LEN + 2 * LIST_INDENT + 128)
+
 typedef struct MacroInhibit MacroInhibit;
 
 static struct MacroInhibit {
@@ -59,16 +66,18 @@ static struct MacroInhibit {
     int inhibiting;
 } *mistack;
 
-static char xdigit[] = "0123456789ABCDEF";
+static const char xdigit[] = "0123456789ABCDEF";
 
 #define HEX(a,b) (*(a)=xdigit[((b)>>4)&15],(a)[1]=xdigit[(b)&15]);
 
 static char listline[LIST_MAX_LEN];
+static size_t listlinelen;
 static bool listlinep;
 
 static char listerror[LIST_MAX_LEN];
 
 static char listdata[2 * LIST_INDENT];  /* we need less than that actually */
+static size_t listdatalen;
 static int32_t listoffset;
 
 static int32_t listlineno;
@@ -81,48 +90,128 @@ static int listlevel, listlevel_e;
 
 static FILE *listfp;
 
-static void list_emit(void)
+static char *listbuf;
+static size_t listbuflen;
+
+static void list_flush(void)
+{
+    if (listbuflen) {
+        fwrite(listbuf, 1, listbuflen, listfp);
+        listbuflen = 0;
+    }
+}
+
+/* Like "%*d" */
+static char *list_dec(char *p, int32_t v, int width)
+{
+    char tmp[12];
+    uint32_t u = v < 0 ? -(uint32_t)v : (uint32_t)v;
+    int n = 0;
+
+    do {
+        tmp[n++] = '0' + u % 10;
+        u /= 10;
+    } while (u);
+    if (v < 0)
+        tmp[n++] = '-';
+
+    while (width-- > n)
+        *p++ = ' ';
+    while (n)
+        *p++ = tmp[--n];
+    return p;
+}
+
+/* Like "%08"PRIX32 */
+static char *list_hex32(char *p, uint32_t v)
 {
     int i;
 
-    if (!listlinep && !listdata[0])
-        return;
+    for (i = 28; i >= 0; i -= 4)
+        *p++ = xdigit[(v >> i) & 15];
+    return p;
+}
 
-    fprintf(listfp, "%6"PRId32" ", listlineno);
+static char *list_fill(char *p, char c, size_t n)
+{
+    memset(p, c, n);
+    return p + n;
+}
 
-    if (listdata[0])
-        fprintf(listfp, "%08"PRIX32" %-*s", listoffset, LIST_HEXBIT + 1,
-                listdata);
-    else
-        fprintf(listfp, "%*s", LIST_HEXBIT + 10, "");
+static char *list_copy(char *p, const char *s, size_t n)
+{
+    memcpy(p, s, n);
+    return p + n;
+}
+
+static char *list_level(char *p)
+{
+    if (listlevel < 10)
+        *p++ = ' ';
+    *p++ = '<';
+    p = list_dec(p, listlevel_e, 0);
+    *p++ = '>';
+    return p;
+}
+
+static void list_emit(void)
+{
+    char *p;
+
+    if (!listlinep && !listdatalen)
+        return;
+
+    if (listbuflen + LIST_EMIT_MAX > LIST_BUF_SIZE)
+        list_flush();
+    p = listbuf + listbuflen;
+
+    p = list_dec(p, listlineno, 6);
+    *p++ = ' ';
+
+    if (listdatalen) {
+        p = list_hex32(p, listoffset);
+        *p++ = ' ';
+        p = list_copy(p, listdata, listdatalen);
+        if (listdatalen < LIST_HEXBIT + 1)
+            p = list_fill(p, ' ', LIST_HEXBIT + 1 - listdatalen);
+    } else {
+        p = list_fill(p, ' ', LIST_HEXBIT + 10);
+    }
 
     if (listlevel_e)
-        fprintf(listfp, "%s<%d>", (listlevel < 10 ? " " : ""),
-                listlevel_e);
+        p = list_level(p);
     else if (listlinep)
-        fprintf(listfp, "    ");
+        p = list_fill(p, ' ', 4);
 
-    if (listlinep)
-        fprintf(listfp, " %s", listline);
+    if (listlinep) {
+        *p++ = ' ';
+        p = list_copy(p, listline, listlinelen);
+    }
 
-    putc('\n', listfp);
+    *p++ = '\n';
     listlinep = false;
     listdata[0] = '\0';
+    listdatalen = 0;
 
     if (listerror[0]) {
-	fprintf(listfp, "%6"PRId32"          ", listlineno);
-	for (i = 0; i < LIST_HEXBIT; i++)
-	    putc('*', listfp);
-	
-	if (listlevel_e)
-	    fprintf(listfp, " %s<%d>", (listlevel < 10 ? " " : ""),
-		    listlevel_e);
-	else
-	    fprintf(listfp, "     ");
-
-	fprintf(listfp, "  %s\n", listerror);
-	listerror[0] = '\0';
+        p = list_dec(p, listlineno, 6);
+        p = list_fill(p, ' ', 10);
+        p = list_fill(p, '*', LIST_HEXBIT);
+
+        if (listlevel_e) {
+            *p++ = ' ';
+            p = list_level(p);
+        } else {
+            p = list_fill(p, ' ', 5);
+        }
+
+        p = list_fill(p, ' ', 2);
+        p = list_copy(p, listerror, strlen(listerror));
+        *p++ = '\n';
+        listerror[0] = '\0';
     }
+
+    listbuflen = p - listbuf;
 }
 
 static void list_init(const char *fname)
@@ -139,7 +228,12 @@ static void list_init(const char *fname)
         return;
     }
 
+    listbuf = nasm_malloc(LIST_BUF_SIZE);
+    listbuflen = 0;
+
     *listline = '\0';
+    listlinelen = 0;
+    listdatalen = 0;
     listlineno = 0;
     *listerror = '\0';
     listp = true;
@@ -163,18 +257,23 @@ static void list_cleanup(void)
     }
 
     list_emit();
+    list_flush();
+    nasm_free(listbuf);
     fclose(listfp);
 }
 
-static void list_out(int32_t offset, char *str)
+static void list_out(int32_t offset, const char *str)
 {
-    if (strlen(listdata) + strlen(str) > LIST_HEXBIT) {
-        strcat(listdata, "-");
+    size_t len = strlen(str);
+
+    if (listdatalen + len > LIST_HEXBIT) {
+        listdata[listdatalen++] = '-';
         list_emit();
     }
-    if (!listdata[0])
+    if (!listdatalen)
         listoffset = offset;
-    strcat(listdata, str);
+    memcpy(listdata + listdatalen, str, len + 1);
+    listdatalen += len;
 }
 
 static void list_address(int32_t offset, const char *brackets,
@@ -209,12 +308,20 @@ static void list_output(int32_t offset, const void *data,
     {
         uint8_t const *p = data;
 
-	if (size == 0 && !listdata[0])
+	if (size == 0 && !listdatalen)
 	    listoffset = offset;
         while (size--) {
-            HEX(q, *p);
-            q[2] = '\0';
-            list_out(offset++, q);
+            /* the same as list_out() of each byte in hex */
+            if (listdatalen + 2 > LIST_HEXBIT) {
+                listdata[listdatalen++] = '-';
+                list_emit();
+            }
+            if (!listdatalen)
+                listoffset = offset;
+            HEX(listdata + listdatalen, *p);
+            listdatalen += 2;
+            listdata[listdatalen] = '\0';
+            offset++;
             p++;
         }
 	break;
@@ -263,8 +370,11 @@ static void list_line(int type, char *line)
     list_emit();
     listlineno = src_get_linnum();
     listlinep = true;
-    strncpy(listline, line, LIST_MAX_LEN - 1);
-    listline[LIST_MAX_LEN - 1] = '\0';
+    listlinelen = strlen(line);
+    if (listlinelen > LIST_MAX_LEN - 1)
+        listlinelen = LIST_MAX_LEN - 1;
+    memcpy(listline, line, listlinelen);
+    listline[listlinelen] = '\0';
     listlevel_e = listlevel;
 }
 
@@ -320,8 +430,10 @@ static void list_error(int severity, const char *pfx, const char *msg)
 
     snprintf(listerror, sizeof listerror, "%s%s", pfx, msg);
 
-    if ((severity & ERR_MASK) >= ERR_FATAL)
+    if ((severity & ERR_MASK) >= ERR_FATAL) {
 	list_emit();
+	list_flush();           /* we won't get to list_cleanup() */
+    }
 }
 
 
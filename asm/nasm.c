@@ -49,6 +49,8 @@
 #include "nasmlib.h"
 #include "saa.h"
 #include "raa.h"
+#include "hashtbl.h"
+#include "atom.h"
 #include "float.h"
 #include "stdscan.h"
 #include "insns.h"
@@ -56,6 +58,7 @@
 #include "parser.h"
 #include "eval.h"
 #include "assemble.h"
+#include "relax.h"
 #include "labels.h"
 #include "outform.h"
 #include "listing.h"
@@ -109,6 +112,7 @@ static FILE *error_file;        /* Where to write error messages */
 
 FILE *ofile = NULL;
 int optimizing = MAX_OPTIMIZE; /* number of optimization passes to take */
+int nasm_jobs = 1;             /* threads we may use */
 static int sb, cmd_sb = 16;    /* by default */
 
 static iflag_t cpu;
@@ -128,6 +132,52 @@ static struct RAA *offsets;
 static struct SAA *forwrefs;    /* keep track of forward references */
 static const struct forwrefinfo *forwref;
 
+/*
+ * The size of a line, for the text of the line, and the segment and
+ * bitness it is assembled in, indexed by line number
+ */
+struct fixed_line {
+    uint64_t hash;              /* of the text, from line_seed */
+    int64_t  size;              /* -1 if there is no entry */
+    int32_t  segment;
+    int      bits;
+};
+
+struct line_table {
+    struct fixed_line   *lines;
+    int32_t             size;
+};
+
+/*
+ * Lines whose size can't change from pass to pass: those with no
+ * label and no symbol, $ or $$ anywhere in them, which went through
+ * the first pass without comment.  The later preparatory passes step
+ * over them without parsing them, as long as the text of the line,
+ * and the segment and bitness it is assembled in, are the same.
+ */
+static struct line_table fixed_lines;
+
+/*
+ * What the hash of a line starts from: the state set by directives
+ * which can change the size of a line without changing its text
+ */
+static uint64_t line_seed;
+
+/*
+ * With -j, the final pass is encoded in batches on several threads
+ * (see assemble_batch_add()).  The lines go in with the size they came
+ * to on the last preparatory pass, which is kept here, so the offsets
+ * of the ones after are known before they are encoded.  The listing
+ * and the debug formats want each line as it goes, so not with those.
+ */
+static struct line_table final_lines;
+static bool batching;           /* -j, and nothing against it */
+static bool batch_flushing;
+static vefunc batch_verror;     /* the error handler while batching */
+
+/* Bigger lines aren't worth logging; a TIMES'd one logs each copy */
+#define BATCH_MAX_SIZE  65536
+
 static const struct preproc_ops *preproc;
 
 #define OP_NORMAL           (1u << 0)
@@ -176,6 +226,7 @@ static const struct warning {
 
 static bool want_usage;
 static bool terminate_after_phase;
+static unsigned int diag_count; /* diagnostics issued so far */
 bool user_nolist = false;
 
 static char *quote_for_make(const char *str);
@@ -443,7 +494,7 @@ int main(int argc, char **argv)
             }
             preproc->cleanup(0);
             if (ofile)
-                fclose(ofile);
+                nasm_close_write(ofile);
             if (ofile && terminate_after_phase)
                 remove(outname);
             ofile = NULL;
@@ -488,7 +539,7 @@ int main(int argc, char **argv)
         }
 
         if (ofile) {
-            fclose(ofile);
+            nasm_close_write(ofile);
             if (terminate_after_phase)
                 remove(outname);
             ofile = NULL;
@@ -504,8 +555,13 @@ int main(int argc, char **argv)
     raa_free(offsets);
     saa_free(forwrefs);
     eval_cleanup();
+    assemble_cleanup();
+    nasm_free(fixed_lines.lines);
+    nasm_free(final_lines.lines);
+    relax_cleanup();
     stdscan_cleanup();
     src_free();
+    atom_cleanup();
 
     return terminate_after_phase;
 }
@@ -658,7 +714,7 @@ static bool process_arg(char *p, char *q)
         return false;
 
     if (p[0] == '-' && !stopoptions) {
-        if (strchr("oOfpPdDiIlFXuUZwW", p[1])) {
+        if (strchr("oOfpPdDiIlFXuUZwWj", p[1])) {
             /* These parameters take values */
             if (!(param = get_param(p, q, &advance)))
                 return advance;
@@ -756,6 +812,19 @@ static bool process_arg(char *p, char *q)
             copy_filename(errname, param);
             break;
 
+        case 'j':       /* number of threads */
+        {
+            char *end;
+
+            nasm_jobs = strtol(param, &end, 10);
+            if (*end || nasm_jobs < 1) {
+                nasm_error(ERR_NONFATAL | ERR_NOFILE | ERR_USAGE,
+                           "invalid number of jobs `%s'", param);
+                nasm_jobs = 1;
+            }
+            break;
+        }
+
         case 'F':       /* specify debug format */
             using_debug_info = true;
             debug_format = param;
@@ -803,6 +872,7 @@ static bool process_arg(char *p, char *q)
                  "    -o outfile  write output to an outfile\n\n"
                  "    -f format   select an output format\n\n"
                  "    -l listfile write listing to a listfile\n\n"
+                 "    -j jobs     assemble using up to <jobs> threads\n\n"
                  "    -I<path>    adds a pathname to the include file path\n");
             printf
                 ("    -O<digit>   optimize branch offsets\n"
@@ -1200,6 +1270,112 @@ static void parse_cmdline(int argc, char **argv)
 
 static enum directives getkw(char **directive, char **value);
 
+static void line_seed_update(void)
+{
+    line_seed = crc64b(CRC64_INIT, &cpu, sizeof cpu);
+    line_seed = crc64b(line_seed, &globalrel, sizeof globalrel);
+    line_seed = crc64b(line_seed, &globalbnd, sizeof globalbnd);
+}
+
+static void line_table_set(struct line_table *lt, int32_t lineno,
+                           uint64_t hash, int64_t size,
+                           int32_t segment, int bits)
+{
+    struct fixed_line *fl;
+
+    if (lineno >= lt->size) {
+        int32_t n = lt->size ? lt->size : 1024;
+        int32_t i;
+
+        while (n <= lineno)
+            n <<= 1;
+        lt->lines = nasm_realloc(lt->lines, n * sizeof *lt->lines);
+        for (i = lt->size; i < n; i++)
+            lt->lines[i].size = -1;
+        lt->size = n;
+    }
+
+    fl = &lt->lines[lineno];
+    fl->hash    = hash;
+    fl->size    = size;
+    fl->segment = segment;
+    fl->bits    = bits;
+}
+
+/*
+ * The entry for a line in this segment and bitness, if there is one;
+ * the caller checks the hash
+ */
+static const struct fixed_line *line_table_get(const struct line_table *lt,
+                                               int32_t lineno,
+                                               int32_t segment, int bits)
+{
+    const struct fixed_line *fl;
+
+    if (lineno >= lt->size)
+        return NULL;
+
+    fl = &lt->lines[lineno];
+    if (fl->size < 0 || fl->segment != segment || fl->bits != bits)
+        return NULL;
+
+    return fl;
+}
+
+/*
+ * The size a line on the final pass goes into the batch with, or -1
+ * if it has to be assembled there and then.  INCBIN uses a table of
+ * files all the threads would share, and errors from a line in a
+ * macro need the macro stack as it is while the line is current.
+ */
+static int64_t batch_size(int32_t lineno, uint64_t hash,
+                          const insn *instruction, int32_t segment, int bits)
+{
+    const struct fixed_line *fl;
+
+    if (instruction->opcode == I_INCBIN || preproc->in_macro())
+        return -1;
+
+    fl = line_table_get(&final_lines, lineno, segment, bits);
+    if (!fl || fl->hash != hash || fl->size > BATCH_MAX_SIZE)
+        return -1;
+
+    return fl->size;
+}
+
+/*
+ * Assemble and output the lines batched up so far.  The output is
+ * gone by the time a line is found to have come to a different size
+ * from the last preparatory pass, so the pass can't be run again:
+ * this is a hard phase error, reported at the end of the pass like
+ * any other offset which changes on the final pass.
+ */
+static void batch_flush(void)
+{
+    if (batch_flushing)
+        return;
+
+    batch_flushing = true;
+    if (!assemble_batch_flush())
+        global_offset_changed++;
+    batch_flushing = false;
+}
+
+/*
+ * The error handler while batching.  Errors from the lines being
+ * encoded go into their logs; anything else which is going to be
+ * seen has to come after the lines before it.
+ */
+static void nasm_verror_batch(int severity, const char *fmt, va_list args)
+{
+    if (assemble_batch_error(severity, fmt, args))
+        return;
+
+    if (!is_suppressed_warning(severity) && !skip_this_pass(severity))
+        batch_flush();
+    batch_verror(severity, fmt, args);
+}
+
 static void assemble_file(char *fname, StrList **depend_ptr)
 {
     char *directive, *value, *p, *q, *special, *line;
@@ -1216,6 +1392,10 @@ static void assemble_file(char *fname, StrList **depend_ptr)
 	nasm_fatal(0, "command line: 32-bit segment size requires a higher cpu");
 
     pass_max = prev_offset_changed = (INT_MAX >> 1) + 2; /* Almost unlimited */
+
+#ifdef HAVE___THREAD
+    batching = nasm_jobs > 1 && !*listname && !using_debug_info;
+#endif
     for (passn = 1; pass0 <= 2; passn++) {
         int pass1, pass2;
         ldfunc def_label;
@@ -1228,8 +1408,11 @@ static void assemble_file(char *fname, StrList **depend_ptr)
 
         globalbits = sb = cmd_sb;   /* set 'bits' to command line default */
         cpu = cmd_cpu;
+        line_seed_update();
         if (pass0 == 2) {
 	    lfmt->init(listname);
+            if (batching)
+                batch_verror = nasm_set_verror(nasm_verror_batch);
         }
         in_abs_seg = false;
         global_offset_changed = 0;  /* set by redefine_label */
@@ -1253,6 +1436,10 @@ static void assemble_file(char *fname, StrList **depend_ptr)
             enum directives d;
             globallineno++;
 
+            if (pass1 == 1 && optimizing > 0)
+                relax_line(globallineno,
+                           in_abs_seg ? NO_SEG : location.segment, offs);
+
             /*
              * Here we parse our directives; this is not handled by the
              * 'real' parser.  This really should be a separate function.
@@ -1262,6 +1449,9 @@ static void assemble_file(char *fname, StrList **depend_ptr)
             if (d) {
                 int err = 0;
 
+                if (pass0 == 2 && batching)
+                    batch_flush();
+
                 switch (d) {
                 case D_SEGMENT:         /* [SEGMENT n] */
                 case D_SECTION:
@@ -1522,6 +1712,7 @@ static void assemble_file(char *fname, StrList **depend_ptr)
                     break;
                 case D_CPU:         /* [CPU] */
                     cpu = get_cpu(value);
+                    line_seed_update();
                     break;
                 case D_LIST:        /* [LIST {+|-}] */
                     value = nasm_skip_spaces(value);
@@ -1560,6 +1751,7 @@ static void assemble_file(char *fname, StrList **depend_ptr)
                     } else {
                         err = 1;
                     }
+                    line_seed_update();
                     break;
                 case D_FLOAT:
                     if (float_option(value)) {
@@ -1584,7 +1776,35 @@ static void assemble_file(char *fname, StrList **depend_ptr)
                                directive);
                 }
             } else {            /* it isn't a directive */
+                uint64_t hash = 0;
+                unsigned int diags = diag_count;
+                bool fixable;
+                const struct fixed_line *fl;
+
+                if (passn > 1 && pass1 == 1 && !in_abs_seg) {
+                    fl = line_table_get(&fixed_lines, globallineno,
+                                        location.segment, sb);
+                    if (fl && fl->hash == crc64(line_seed, line)) {
+                        if (pass0 == 1 && batching)
+                            line_table_set(&final_lines, globallineno,
+                                           fl->hash, fl->size,
+                                           location.segment, sb);
+                        offs += fl->size;
+                        set_curr_offs(offs);
+                        nasm_free(line);
+                        location.offset = offs = get_curr_offs();
+                        continue;
+                    }
+                }
+
+                if (passn == 1 || (pass0 > 0 && batching))
+                    hash = crc64(line_seed, line);
+
                 parse_line(pass1, line, &output_ins, def_label);
+                output_ins.lineno = globallineno;
+
+                fixable = passn == 1 && !using_debug_info && !in_abs_seg &&
+                    !output_ins.label && !stdscan_saw_symbol();
 
                 if (optimizing > 0) {
                     if (forwref != NULL && globallineno == forwref->lineno) {
@@ -1752,6 +1972,12 @@ static void assemble_file(char *fname, StrList **depend_ptr)
                             dfmt->debug_typevalue(typeinfo);
                         }
                         if (l != -1) {
+                            if (fixable && diag_count == diags)
+                                line_table_set(&fixed_lines, globallineno,
+                                               hash, l, location.segment, sb);
+                            if (pass0 == 1 && batching && !in_abs_seg)
+                                line_table_set(&final_lines, globallineno,
+                                               hash, l, location.segment, sb);
                             offs += l;
                             set_curr_offs(offs);
                         }
@@ -1761,10 +1987,23 @@ static void assemble_file(char *fname, StrList **depend_ptr)
                          */
 
                     } else {
-                        offs += assemble(location.segment, offs, sb, cpu,
-                                         &output_ins);
+                        int64_t size = -1;
+
+                        if (batching && !in_abs_seg)
+                            size = batch_size(globallineno, hash, &output_ins,
+                                              location.segment, sb);
+                        if (size >= 0) {
+                            if (assemble_batch_add(location.segment, offs, sb,
+                                                   cpu, &output_ins, size))
+                                batch_flush();
+                        } else {
+                            if (batching)
+                                batch_flush();
+                            size = assemble(location.segment, offs, sb, cpu,
+                                            &output_ins);
+                        }
+                        offs += size;
                         set_curr_offs(offs);
-
                     }
                 }               /* not an EQU */
                 cleanup_insn(&output_ins);
@@ -1773,12 +2012,20 @@ static void assemble_file(char *fname, StrList **depend_ptr)
             location.offset = offs = get_curr_offs();
         }                       /* end while (line = preproc->getline... */
 
+        if (pass0 == 2 && batching) {
+            batch_flush();
+            nasm_set_verror(batch_verror);
+        }
+
         if (pass0 == 2 && global_offset_changed && !terminate_after_phase)
             nasm_error(ERR_NONFATAL,
                        "phase error detected at end of assembly.");
 
-        if (pass1 == 1)
+        if (pass1 == 1) {
             preproc->cleanup(1);
+            relax_pass_done(pass0 == 0 && passn > 1 &&
+                            global_offset_changed && !terminate_after_phase);
+        }
 
         if ((passn > 1 && !global_offset_changed) || pass0 == 2) {
             pass0++;
@@ -1979,6 +2226,8 @@ static void nasm_verror_common(int severity, const char *fmt, va_list args)
     char msg[1024];
     const char *pfx;
 
+    diag_count++;
+
     switch (severity & (ERR_MASK|ERR_NO_SEVERITY)) {
     case ERR_WARNING:
         pfx = "warning: ";
@@ -2022,7 +2271,9 @@ static void nasm_verror_common(int severity, const char *fmt, va_list args)
     if (severity & ERR_USAGE)
         want_usage = true;
 
-    preproc->error_list_macros(severity);
+    /* Lines played back from a batch were never in a macro */
+    if (!batch_flushing)
+        preproc->error_list_macros(severity);
 
     switch (severity & ERR_MASK) {
     case ERR_DEBUG:
@@ -2038,7 +2289,7 @@ static void nasm_verror_common(int severity, const char *fmt, va_list args)
         break;
     case ERR_FATAL:
         if (ofile) {
-            fclose(ofile);
+            nasm_close_write(ofile);
             remove(outname);
             ofile = NULL;
         }
@@ -2050,7 +2301,7 @@ static void nasm_verror_common(int severity, const char *fmt, va_list args)
         fflush(NULL);
         /* abort(); */          /* halt, catch fire, and dump core */
         if (ofile) {
-            fclose(ofile);
+            nasm_close_write(ofile);
             remove(outname);
             ofile = NULL;
         }
@@ -46,6 +46,7 @@
 #include "nasm.h"
 #include "insns.h"
 #include "nasmlib.h"
+#include "arena.h"
 #include "stdscan.h"
 #include "eval.h"
 #include "parser.h"
@@ -61,6 +62,9 @@ static int is_comma_next(void);
 static int i;
 static struct tokenval tokval;
 
+/* Extended operands of the current line, released by cleanup_insn() */
+static struct arena eop_arena;
+
 static int prefix_slot(int prefix)
 {
     switch (prefix) {
@@ -552,7 +556,7 @@ restart_parse:
             }
             first = false;
             fixptr = tail;
-            eop = *tail = nasm_malloc(sizeof(extop));
+            eop = *tail = arena_alloc(&eop_arena, sizeof(extop));
             tail = &eop->next;
             eop->next = NULL;
             eop->type = EOT_NOTHING;
@@ -633,7 +637,8 @@ is_float:
                     eop->stringlen = 0;
                 }
 
-                eop = nasm_realloc(eop, sizeof(extop) + eop->stringlen);
+                eop = arena_alloc(&eop_arena, sizeof(extop) + eop->stringlen);
+                memcpy(eop, *fixptr, sizeof(extop));
                 tail = &eop->next;
                 *fixptr = eop;
                 eop->stringval = (char *)eop + sizeof(extop);
@@ -1159,10 +1164,10 @@ void cleanup_insn(insn * i)
 {
     extop *e;
 
-    while ((e = i->eops)) {
-        i->eops = e->next;
+    list_for_each(e, i->eops) {
         if (e->type == EOT_DB_STRING_FREE)
             nasm_free(e->stringval);
-        nasm_free(e);
     }
+    i->eops = NULL;
+    arena_reset(&eop_arena);
 }
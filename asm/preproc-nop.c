@@ -173,6 +173,11 @@ static void nop_error_list_macros(int severity)
     (void)severity;
 }
 
+static bool nop_in_macro(void)
+{
+    return false;
+}
+
 const struct preproc_ops preproc_nop = {
     nop_reset,
     nop_getline,
@@ -183,4 +188,5 @@ const struct preproc_ops preproc_nop = {
     nop_pre_include,
     nop_include_path,
     nop_error_list_macros,
+    nop_in_macro,
 };
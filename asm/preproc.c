@@ -74,12 +74,14 @@
 #include "nasmlib.h"
 #include "preproc.h"
 #include "hashtbl.h"
+#include "atom.h"
 #include "quote.h"
 #include "stdscan.h"
 #include "eval.h"
 #include "tokens.h"
 #include "tables.h"
 #include "listing.h"
+#include "saa.h"
 
 typedef struct SMacro SMacro;
 typedef struct MMacro MMacro;
@@ -223,6 +225,14 @@ struct tokseq_match {
     int mask_tail;
 };
 
+/*
+ * The text of an identifier is its atom; other text shorter than
+ * TOKEN_INLINE is kept in the Token itself, and anything longer is
+ * a private heap copy.  Only set_text() and steal_text() should
+ * replace the text of an existing Token.
+ */
+#define TOKEN_INLINE 28
+
 struct Token {
     Token *next;
     char *text;
@@ -230,7 +240,9 @@ struct Token {
         SMacro *mac;        /* associated macro for TOK_SMAC_END */
         size_t len;         /* scratch length field */
     } a;                    /* Auxiliary data */
+    struct atom *atom;      /* interned text of a TOK_ID */
     enum pp_token_type type;
+    char inl[TOKEN_INLINE]; /* inline text storage */
 };
 
 /*
@@ -267,7 +279,7 @@ struct Line {
  */
 struct Include {
     Include *next;
-    FILE *fp;
+    const char *pos, *end;      /* what's left of the file */
     Cond *conds;
     Line *expansion;
     const char *fname;
@@ -415,6 +427,18 @@ static struct hash_table mmacros;
  */
 static struct hash_table smacros;
 
+/*
+ * The contents of the source files read so far, by path, so a file
+ * included over and over is only read in once.
+ */
+static struct hash_table srcfiles;
+
+/*
+ * Buffer the lines read are handed out in.
+ */
+static char *linebuf;
+static size_t linebuf_size;
+
 /*
  * The multi-line macro we are currently defining, or the %rep
  * block we are currently reading, if any.
@@ -450,6 +474,34 @@ struct Blocks {
 
 static Blocks blocks = { NULL, NULL };
 
+/*
+ * The expanded line stream of the first pass is recorded here, and
+ * replayed on the following preparatory passes instead of running
+ * the preprocessor again.  __PASS__ is 1 on all of them, so the only
+ * way the expansion can differ between them is through expressions
+ * which refer to labels or to $ and $$; if one of those is seen, or
+ * the preprocessor issues a diagnostic which would be repeated on
+ * every pass, the cache is dropped and we preprocess as usual.  The
+ * final pass always runs the real preprocessor, since it drives the
+ * listing file and the dependency list.
+ */
+struct CachedLine {
+    const char *fname;
+    int32_t lineno;
+    size_t len;                 /* Including the terminating NUL */
+};
+
+enum linecache_mode {
+    LC_OFF,                     /* Not recording or replaying */
+    LC_RECORD,                  /* Recording the output of this pass */
+    LC_REPLAY                   /* Replaying a recorded pass */
+};
+
+static struct SAA *linecache;
+static enum linecache_mode lcmode;
+static bool linecache_ok;       /* Recording complete and usable */
+static uint64_t linecache_lines, linecache_left;
+
 /*
  * Forward declarations.
  */
@@ -460,12 +512,16 @@ static Token *expand_id(Token * tline);
 static Context *get_ctx(const char *name, const char **namep);
 static void make_tok_num(Token * tok, int64_t val);
 static void pp_verror(int severity, const char *fmt, va_list ap);
+static void linecache_invalidate(void);
 static vefunc real_verror;
 static void *new_Block(size_t size);
 static void delete_Blocks(void);
 static Token *new_Token(Token * next, enum pp_token_type type,
                         const char *text, int txtlen);
 static Token *delete_Token(Token * t);
+static Token *dup_Token(Token * next, const Token * src);
+static void set_text(Token * t, const char *text, size_t len);
+static void steal_text(Token * t, char *text);
 
 /*
  * Macros for safe checking of token pointers, avoid *(NULL)
@@ -519,7 +575,7 @@ static Token *reverse_tokens(Token *t)
 static char *check_tasm_directive(char *line)
 {
     int32_t i, j, k, m, len;
-    char *p, *q, *oldline, oldchar;
+    char *p, *q, oldchar;
 
     p = nasm_skip_spaces(line);
 
@@ -540,7 +596,6 @@ static char *check_tasm_directive(char *line)
                  */
                 p[len] = oldchar;
                 len = strlen(p);
-                oldline = line;
                 line = nasm_malloc(len + 2);
                 line[0] = '%';
                 if (k == TM_IFDIFI) {
@@ -554,7 +609,6 @@ static char *check_tasm_directive(char *line)
                 } else {
                     memcpy(line + 1, p, len + 1);
                 }
-                nasm_free(oldline);
                 return line;
             } else if (m < 0) {
                 j = k;
@@ -571,14 +625,17 @@ static char *check_tasm_directive(char *line)
  * number indications as they emerge from GNU cpp (`# lineno "file"
  * flags') into NASM preprocessor line number indications (`%line
  * lineno file').
+ *
+ * Either the line passed in is returned, or a new one which the
+ * caller has to free.
  */
 static char *prepreproc(char *line)
 {
     int lineno, fnlen;
-    char *fname, *oldline;
+    char *fname, *oldline, *tline;
 
+    oldline = line;
     if (line[0] == '#' && line[1] == ' ') {
-        oldline = line;
         fname = oldline + 2;
         lineno = atoi(fname);
         fname += strspn(fname, "0123456789 ");
@@ -587,10 +644,13 @@ static char *prepreproc(char *line)
         fnlen = strcspn(fname, "\"");
         line = nasm_malloc(20 + fnlen);
         snprintf(line, 20 + fnlen, "%%line %d %.*s", lineno, fnlen, fname);
-        nasm_free(oldline);
     }
-    if (tasm_compatible_mode)
-        return check_tasm_directive(line);
+    if (tasm_compatible_mode) {
+        tline = check_tasm_directive(line);
+        if (tline != line && line != oldline)
+            nasm_free(line);
+        line = tline;
+    }
     return line;
 }
 
@@ -723,6 +783,20 @@ hash_findix(struct hash_table *hash, const char *str)
     return p ? *p : NULL;
 }
 
+/*
+ * Make sure the line buffer has room for a line of len characters
+ */
+static char *line_buffer(size_t len)
+{
+    if (len >= linebuf_size) {
+        linebuf_size = linebuf_size ? linebuf_size : 512;
+        while (len >= linebuf_size)
+            linebuf_size <<= 1;
+        linebuf = nasm_realloc(linebuf, linebuf_size);
+    }
+    return linebuf;
+}
+
 /*
  * read line from standart macros set,
  * if there no more left -- return NULL
@@ -744,7 +818,7 @@ static char *line_from_stdmac(void)
             len++;
     }
 
-    line = nasm_malloc(len + 1);
+    line = line_buffer(len);
     q = line;
     while ((c = *stdmacpos++)) {
         if (c >= 0x80) {
@@ -778,7 +852,7 @@ static char *line_from_stdmac(void)
                 head = NULL;
                 tail = &head;
                 list_for_each(t, pd->first) {
-                    *tail = new_Token(NULL, t->type, t->text, 0);
+                    *tail = dup_Token(NULL, t);
                     tail = &(*tail)->next;
                 }
 
@@ -796,77 +870,64 @@ static char *line_from_stdmac(void)
     return line;
 }
 
+/*
+ * Read the next line of the current file into the line buffer.
+ * Backslash-newline pairs are joined, and a line ends at CR, LF or
+ * CR LF.
+ */
 static char *read_line(void)
 {
-    unsigned int size, c, next;
-    const unsigned int delta = 512;
-    const unsigned int pad = 8;
+    const char *p, *eol, *end;
     unsigned int nr_cont = 0;
-    bool cont = false;
-    char *buffer, *p;
+    size_t len = 0, n;
+    bool cont, eof;
+    char *buffer;
 
     /* Standart macros set (predefined) goes first */
-    p = line_from_stdmac();
-    if (p)
-        return p;
+    buffer = line_from_stdmac();
+    if (buffer)
+        return buffer;
 
-    size = delta;
-    p = buffer = nasm_malloc(size);
+    p   = istk->pos;
+    end = istk->end;
+    if (p >= end)
+        return NULL;
 
     for (;;) {
-        c = fgetc(istk->fp);
-        if ((int)(c) == EOF) {
-            p[0] = 0;
-            break;
-        }
+        eol = memchr(p, '\n', end - p);
+        if (!eol)
+            eol = end;
+        n = eol - p;
+        eol = memchr(p, '\r', n);
+        if (eol)
+            n = eol - p;
+        else
+            eol = p + n;
 
-        switch (c) {
-        case '\r':
-            next = fgetc(istk->fp);
-            if (next != '\n')
-                ungetc(next, istk->fp);
-            if (cont) {
-                cont = false;
-                continue;
-            }
-            break;
+        eof  = eol >= end;
+        cont = !eof && n && eol[-1] == '\\';
+        if (cont)
+            n--;
 
-        case '\n':
-            if (cont) {
-                cont = false;
-                continue;
-            }
-            break;
+        buffer = line_buffer(len + n);
+        memcpy(buffer + len, p, n);
+        len += n;
 
-        case '\\':
-            next = fgetc(istk->fp);
-            ungetc(next, istk->fp);
-            if (next == '\r' || next == '\n') {
-                cont = true;
-                nr_cont++;
-                continue;
-            }
-            break;
-        }
+        if (!eof && *eol++ == '\r' && eol < end && *eol == '\n')
+            eol++;
+        p = eol;
 
-        if (c == '\r' || c == '\n') {
-            *p++ = 0;
+        if (!cont)
             break;
-        }
-
-        if (p >= (buffer + size - pad)) {
-            buffer = nasm_realloc(buffer, size + delta);
-            p = buffer + size - pad;
-            size += delta;
-        }
-
-        *p++ = (unsigned char)c;
+        nr_cont++;
     }
 
-    if (p == buffer) {
-        nasm_free(buffer);
+    istk->pos = p;
+
+    if (eof && !len)
         return NULL;
-    }
+
+    buffer[len] = '\0';
 
     src_set_linnum(src_get_linnum() + istk->lineinc +
                    (nr_cont * istk->lineinc));
@@ -1187,6 +1248,61 @@ static void delete_Blocks(void)
     memset(&blocks, 0, sizeof(blocks));
 }
 
+/*
+ * Give a Token the given text: its atom if it is an identifier,
+ * otherwise a copy, inline if it is short enough.
+ */
+static void init_text(Token * t, const char *text, size_t len)
+{
+    char *str;
+
+    if (t->type == TOK_ID) {
+        t->atom = atom_get(text, len);
+        t->text = (char *)t->atom->str;
+        return;
+    }
+
+    t->atom = NULL;
+    str = (len < TOKEN_INLINE) ? t->inl : nasm_malloc(len+1);
+    memcpy(str, text, len);
+    str[len] = '\0';
+    t->text = str;
+}
+
+/*
+ * Release the text of a Token, unless it is inline or an atom
+ */
+static void free_text(Token * t)
+{
+    if (t->text != t->inl && !t->atom)
+        nasm_free(t->text);
+}
+
+/*
+ * Replace the text of a Token with a copy of the given text
+ */
+static void set_text(Token * t, const char *text, size_t len)
+{
+    free_text(t);
+    init_text(t, text, len);
+}
+
+/*
+ * Replace the text of a Token with a string from nasm_malloc(),
+ * which the Token takes over
+ */
+static void steal_text(Token * t, char *text)
+{
+    free_text(t);
+    if (text && t->type == TOK_ID) {
+        init_text(t, text, strlen(text));
+        nasm_free(text);
+    } else {
+        t->text = text;
+        t->atom = NULL;
+    }
+}
+
 /*
  *  this function creates a new Token and passes a pointer to it
  *  back to the caller.  It sets the type and text elements, and
@@ -1211,25 +1327,55 @@ static Token *new_Token(Token * next, enum pp_token_type type,
     t->type = type;
     if (type == TOK_WHITESPACE || !text) {
         t->text = NULL;
+        t->atom = NULL;
     } else {
         if (txtlen == 0)
             txtlen = strlen(text);
-        t->text = nasm_malloc(txtlen+1);
-        memcpy(t->text, text, txtlen);
-        t->text[txtlen] = '\0';
+        init_text(t, text, txtlen);
     }
     return t;
 }
 
+/*
+ * Copy a Token; identifiers just share the atom
+ */
+static Token *dup_Token(Token * next, const Token * src)
+{
+    Token *t;
+
+    if (!src->atom)
+        return new_Token(next, src->type, src->text, 0);
+
+    t = new_Token(next, src->type, NULL, 0);
+    t->atom = src->atom;
+    t->text = src->text;
+    return t;
+}
+
 static Token *delete_Token(Token * t)
 {
     Token *next = t->next;
-    nasm_free(t->text);
+    free_text(t);
     t->next = freeTokens;
     freeTokens = t;
     return next;
 }
 
+/*
+ * Like hash_findix, with the text of an identifier Token as the key;
+ * the atom already has the hash.
+ */
+static void *hash_findix_tok(struct hash_table *hash, Token * t)
+{
+    void **p;
+
+    if (t->atom)
+        p = hash_findih(hash, t->text, t->atom->hashi, NULL);
+    else
+        p = hash_findi(hash, t->text, NULL);
+    return p ? *p : NULL;
+}
+
 /*
  * Convert a line of tokens back into text.
  * If expand_locals is not zero, identifiers of the form "%$*xxx"
@@ -1245,7 +1391,6 @@ static char *detoken(Token * tlist, bool expand_locals)
     list_for_each(t, tlist) {
         if (t->type == TOK_PREPROC_ID && t->text[1] == '!') {
             char *v;
-            char *q = t->text;
 
             v = t->text + 2;
             if (*v == '\'' || *v == '\"' || *v == '`') {
@@ -1268,11 +1413,10 @@ static char *detoken(Token * tlist, bool expand_locals)
                      * FIXME We better should investigate if accessing
                      * ->text[1] without ->text[0] is safe enough.
                      */
-                    t->text = nasm_zalloc(2);
+                    set_text(t, "\0", 1);
                 } else
-                    t->text = nasm_strdup(p);
+                    set_text(t, p, strlen(p));
             }
-            nasm_free(q);
         }
 
         /* Expand local macros here and not during preprocessing */
@@ -1286,8 +1430,7 @@ static char *detoken(Token * tlist, bool expand_locals)
                 char buffer[40];
                 snprintf(buffer, sizeof(buffer), "..@%"PRIu32".", ctx->number);
                 p = nasm_strcat(buffer, q);
-                nasm_free(t->text);
-                t->text = p;
+                steal_text(t, p);
             }
         }
         if (t->type == TOK_WHITESPACE)
@@ -1336,28 +1479,43 @@ static int ppscan(void *private_data, struct tokenval *tokval)
         return tokval->t_type = TOKEN_EOS;
 
     tokval->t_charptr = tline->text;
+    tokval->t_atom = NULL;
 
-    if (tline->text[0] == '$' && !tline->text[1])
+    /*
+     * $, $$ and labels can all change value between passes, so
+     * any expression using them makes the line cache unusable.
+     */
+    if (tline->text[0] == '$' && !tline->text[1]) {
+        linecache_invalidate();
         return tokval->t_type = TOKEN_HERE;
-    if (tline->text[0] == '$' && tline->text[1] == '$' && !tline->text[2])
+    }
+    if (tline->text[0] == '$' && tline->text[1] == '$' && !tline->text[2]) {
+        linecache_invalidate();
         return tokval->t_type = TOKEN_BASE;
+    }
 
     if (tline->type == TOK_ID) {
         p = tokval->t_charptr = tline->text;
         if (p[0] == '$') {
             tokval->t_charptr++;
+            linecache_invalidate();
             return tokval->t_type = TOKEN_ID;
         }
+        tokval->t_atom = tline->atom;
 
         for (r = p, s = ourcopy; *r; r++) {
-            if (r >= p+MAX_KEYWORD)
+            if (r >= p+MAX_KEYWORD) {
+                linecache_invalidate();
                 return tokval->t_type = TOKEN_ID; /* Not a keyword */
+            }
             *s++ = nasm_tolower(*r);
         }
         *s = '\0';
         /* right, so we have an identifier sitting in temp storage. now,
          * is it actually a register or instruction name, or what? */
-        return nasm_token_hash(ourcopy, tokval);
+        if (nasm_token_hash(ourcopy, tokval) == TOKEN_ID)
+            linecache_invalidate();
+        return tokval->t_type;
     }
 
     if (tline->type == TOK_NUMBER) {
@@ -1499,17 +1657,72 @@ static bool in_list(const StrList *list, const char *str)
     return false;
 }
 
+/*
+ * Get the contents of a source file, reading it in unless this has
+ * already been done.  Returns NULL if it can't be opened.
+ */
+static void *src_open(const char *path, enum file_flags mode)
+{
+    struct nasm_filemap *map;
+    struct hash_insert hi;
+    void **mapp;
+    FILE *fp;
+
+    if (!srcfiles.table)
+        hash_init(&srcfiles, HASH_MEDIUM);
+
+    mapp = hash_find(&srcfiles, path, &hi);
+    if (mapp)
+        return *mapp;
+
+    fp = nasm_open_read(path, mode);
+    if (!fp)
+        return NULL;
+
+    map = nasm_malloc(sizeof(*map));
+    if (!nasm_map_file(map, fp))
+        nasm_fatal(0, "unable to read source file `%s'", path);
+    fclose(fp);
+
+    hash_add(&hi, nasm_strdup(path), map);
+    return map;
+}
+
+static void free_srcfiles(void)
+{
+    struct nasm_filemap *map;
+    const char *key;
+    struct hash_tbl_node *it = NULL;
+
+    while ((map = hash_iterate(&srcfiles, &it, &key)) != NULL) {
+        nasm_free((void *)key);
+        nasm_unmap_file(map);
+        nasm_free(map);
+    }
+    hash_free(&srcfiles);
+}
+
+static void *file_open(const char *path, enum file_flags mode)
+{
+    return nasm_open_read(path, mode);
+}
+
 /*
  * Open an include file. This routine must always return a valid
  * file pointer if it returns - it's responsible for throwing an
  * ERR_FATAL and bombing out completely if not. It should also try
  * the include path one by one until it finds the file or reaches
  * the end of the path.
+ *
+ * What is opened is up to the open function: a FILE * for
+ * file_open(), and the source file contents for src_open().
  */
-static FILE *inc_fopen(const char *file, StrList **dhead, StrList ***dtail,
-                       char **found_path, bool missing_ok, enum file_flags mode)
+static void *inc_fopen(const char *file, StrList **dhead, StrList ***dtail,
+                       char **found_path, bool missing_ok,
+                       enum file_flags mode,
+                       void *(*open)(const char *, enum file_flags))
 {
-    FILE *fp;
+    void *fp;
     char *prefix = "";
     IncPath *ip = ipath;
     int len = strlen(file);
@@ -1529,7 +1742,7 @@ static FILE *inc_fopen(const char *file, StrList **dhead, StrList ***dtail,
             memcpy(*found_path, sl->str, path_len);
         }
 
-        fp = nasm_open_read(sl->str, mode);
+        fp = open(sl->str, mode);
         if (fp && dhead && !in_list(*dhead, sl->str)) {
             sl->next = NULL;
             **dtail = sl;
@@ -1583,7 +1796,7 @@ FILE *pp_input_fopen(const char *filename, enum file_flags mode)
     StrList *xsl = NULL;
     StrList **xst = &xsl;
 
-    fp = inc_fopen(filename, &xsl, &xst, NULL, true, mode);
+    fp = inc_fopen(filename, &xsl, &xst, NULL, true, mode, file_open);
     if (xsl)
         nasm_free(xsl);
     return fp;
@@ -2191,6 +2404,7 @@ static int do_directive(Token * tline)
     char *p, *pp, *found_path;
     const char *mname;
     Include *inc;
+    struct nasm_filemap *map;
     Context *ctx;
     Cond *cond;
     MMacro *mmac, **mmhead;
@@ -2527,15 +2741,16 @@ static int do_directive(Token * tline)
         p = t->text;
         if (t->type != TOK_INTERNAL_STRING)
             nasm_unquote_cstr(p, i);
-        inc = nasm_malloc(sizeof(Include));
-        inc->next = istk;
-        inc->conds = NULL;
         found_path = NULL;
-        inc->fp = inc_fopen(p, dephead, &deptail, &found_path, pass == 0, NF_TEXT);
-        if (!inc->fp) {
-            /* -MG given but file not found */
-            nasm_free(inc);
-        } else {
+        /* NULL if -MG was given but the file isn't found */
+        map = inc_fopen(p, dephead, &deptail, &found_path, pass == 0,
+                        NF_TEXT, src_open);
+        if (map) {
+            inc = nasm_malloc(sizeof(Include));
+            inc->next = istk;
+            inc->conds = NULL;
+            inc->pos = map->data;
+            inc->end = map->data + map->size;
             inc->fname = src_set_fname(found_path ? found_path : p);
             inc->lineno = src_set_linnum(0);
             inc->lineinc = 1;
@@ -3164,11 +3379,8 @@ issue_error:
             tline = delete_Token(tline);
 
         p = detoken(tline, false);
-        macro_start = nasm_malloc(sizeof(*macro_start));
-        macro_start->next = NULL;
-        macro_start->text = nasm_quote(p, strlen(p));
-        macro_start->type = TOK_STRING;
-        macro_start->a.mac = NULL;
+        macro_start = new_Token(NULL, TOK_STRING, NULL, 0);
+        steal_text(macro_start, nasm_quote(p, strlen(p)));
         nasm_free(p);
 
         /*
@@ -3274,16 +3486,13 @@ issue_error:
         if (t->type != TOK_INTERNAL_STRING)
             nasm_unquote(p, NULL);
 
-        fp = inc_fopen(p, &xsl, &xst, NULL, true, NF_TEXT);
+        fp = inc_fopen(p, &xsl, &xst, NULL, true, NF_TEXT, file_open);
         if (fp) {
             p = xsl->str;
             fclose(fp);         /* Don't actually care about the file */
         }
-        macro_start = nasm_malloc(sizeof(*macro_start));
-        macro_start->next = NULL;
-        macro_start->text = nasm_quote(p, strlen(p));
-        macro_start->type = TOK_STRING;
-        macro_start->a.mac = NULL;
+        macro_start = new_Token(NULL, TOK_STRING, NULL, 0);
+        steal_text(macro_start, nasm_quote(p, strlen(p)));
         if (xsl)
             nasm_free(xsl);
 
@@ -3329,10 +3538,8 @@ issue_error:
             return DIRECTIVE_FOUND;
         }
 
-        macro_start = nasm_malloc(sizeof(*macro_start));
-        macro_start->next = NULL;
+        macro_start = new_Token(NULL, TOK_NUMBER, NULL, 0);
         make_tok_num(macro_start, nasm_unquote(t->text, NULL));
-        macro_start->a.mac = NULL;
 
         /*
          * We now have a macro name, an implicit parameter count of
@@ -3398,7 +3605,7 @@ issue_error:
          * and store an SMacro.
          */
         macro_start = new_Token(NULL, TOK_STRING, NULL, 0);
-        macro_start->text = nasm_quote(pp, len);
+        steal_text(macro_start, nasm_quote(pp, len));
         nasm_free(pp);
         define_smacro(ctx, mname, casesense, 0, macro_start);
         free_tlist(tline);
@@ -3490,11 +3697,9 @@ issue_error:
         if (!len || count < 0 || start >=(int64_t)len)
             start = -1, count = 0; /* empty string */
 
-        macro_start = nasm_malloc(sizeof(*macro_start));
-        macro_start->next = NULL;
-        macro_start->text = nasm_quote((start < 0) ? "" : t->text + start, count);
-        macro_start->type = TOK_STRING;
-        macro_start->a.mac = NULL;
+        macro_start = new_Token(NULL, TOK_STRING, NULL, 0);
+        steal_text(macro_start,
+                   nasm_quote((start < 0) ? "" : t->text + start, count));
 
         /*
          * We now have a macro name, an implicit parameter count of
@@ -3550,10 +3755,8 @@ issue_error:
             return DIRECTIVE_FOUND;
         }
 
-        macro_start = nasm_malloc(sizeof(*macro_start));
-        macro_start->next = NULL;
+        macro_start = new_Token(NULL, TOK_NUMBER, NULL, 0);
         make_tok_num(macro_start, reloc_value(evalresult));
-        macro_start->a.mac = NULL;
 
         /*
          * We now have a macro name, an implicit parameter count of
@@ -3844,10 +4047,10 @@ static Token *expand_mmac_params_range(MMacro *mac, Token *tline, Token ***last)
      * only first token will be passed.
      */
     tm = mac->params[(fst + mac->rotate) % mac->nparam];
-    head = new_Token(NULL, tm->type, tm->text, 0);
+    head = dup_Token(NULL, tm);
     tt = &head->next, tm = tm->next;
     while (tok_isnt_(tm, ",")) {
-        t = new_Token(NULL, tm->type, tm->text, 0);
+        t = dup_Token(NULL, tm);
         *tt = t, tt = &t->next, tm = tm->next;
     }
 
@@ -3858,7 +4061,7 @@ static Token *expand_mmac_params_range(MMacro *mac, Token *tline, Token ***last)
             j = (i + mac->rotate) % mac->nparam;
             tm = mac->params[j];
             while (tok_isnt_(tm, ",")) {
-                t = new_Token(NULL, tm->type, tm->text, 0);
+                t = dup_Token(NULL, tm);
                 *tt = t, tt = &t->next, tm = tm->next;
             }
         }
@@ -3869,7 +4072,7 @@ static Token *expand_mmac_params_range(MMacro *mac, Token *tline, Token ***last)
             j = (i + mac->rotate) % mac->nparam;
             tm = mac->params[j];
             while (tok_isnt_(tm, ",")) {
-                t = new_Token(NULL, tm->type, tm->text, 0);
+                t = dup_Token(NULL, tm);
                 *tt = t, tt = &t->next, tm = tm->next;
             }
         }
@@ -3994,7 +4197,7 @@ static Token *expand_mmac_params(Token * tline)
                         }
                         if (tt) {
                             for (i = 0; i < mac->paramlen[n]; i++) {
-                                *tail = new_Token(NULL, tt->type, tt->text, 0);
+                                *tail = dup_Token(NULL, tt);
                                 tail = &(*tail)->next;
                                 tt = tt->next;
                             }
@@ -4022,8 +4225,7 @@ static Token *expand_mmac_params(Token * tline)
                 *tail = t;
                 tail = &t->next;
                 t->type = type;
-                nasm_free(t->text);
-                t->text = text;
+                steal_text(t, text);
                 t->a.mac = NULL;
             }
             changed = true;
@@ -4101,11 +4303,9 @@ static Token *expand_smacro(Token * tline)
      * routine we copy it back
      */
     if (org_tline) {
-        tline = new_Token(org_tline->next, org_tline->type,
-                          org_tline->text, 0);
+        tline = dup_Token(org_tline->next, org_tline);
         tline->a.mac = org_tline->a.mac;
-        nasm_free(org_tline->text);
-        org_tline->text = NULL;
+        steal_text(org_tline, NULL);
     }
 
     expanded = true;            /* Always expand %+ at least once */
@@ -4123,7 +4323,7 @@ again:
         if ((mname = tline->text)) {
             /* if this token is a local macro, look in local context */
             if (tline->type == TOK_ID) {
-                head = (SMacro *)hash_findix(&smacros, mname);
+                head = (SMacro *)hash_findix_tok(&smacros, tline);
             } else if (tline->type == TOK_PREPROC_ID) {
                 ctx = get_ctx(mname, &mname);
                 head = ctx ? (SMacro *)hash_findix(&ctx->localmac, mname) : NULL;
@@ -4152,18 +4352,15 @@ again:
                     if (!m->expansion) {
                         if (!strcmp("__FILE__", m->name)) {
                             const char *file = src_get_fname();
-                            /* nasm_free(tline->text); here? */
-                            tline->text = nasm_quote(file, strlen(file));
                             tline->type = TOK_STRING;
+                            steal_text(tline, nasm_quote(file, strlen(file)));
                             continue;
                         }
                         if (!strcmp("__LINE__", m->name)) {
-                            nasm_free(tline->text);
                             make_tok_num(tline, src_get_linnum());
                             continue;
                         }
                         if (!strcmp("__BITS__", m->name)) {
-                            nasm_free(tline->text);
                             make_tok_num(tline, globalbits);
                             continue;
                         }
@@ -4339,7 +4536,7 @@ again:
                             tt = new_Token(tline, TOK_ID, m->name, 0);
                             tline = tt;
                         } else {
-                            tt = new_Token(tline, t->type, t->text, 0);
+                            tt = dup_Token(tline, t);
                             tline = tt;
                         }
                     }
@@ -4401,6 +4598,8 @@ err:
     if (org_tline) {
         if (thead) {
             *org_tline = *thead;
+            if (thead->text == thead->inl)
+                org_tline->text = org_tline->inl;
             /* since we just gave text to org_line, don't free it */
             thead->text = NULL;
             delete_Token(thead);
@@ -4488,7 +4687,7 @@ static MMacro *is_mmacro(Token * tline, Token *** params_array)
     Token **params;
     int nparam;
 
-    head = (MMacro *) hash_findix(&mmacros, tline->text);
+    head = (MMacro *) hash_findix_tok(&mmacros, tline);
 
     /*
      * Efficiency: first we see if any macro exists with the given
@@ -4778,7 +4977,7 @@ static int expand_mmacro(Token * tline)
                 }
                 /* fall through */
             default:
-                tt = *tail = new_Token(NULL, x->type, x->text, 0);
+                tt = *tail = dup_Token(NULL, x);
                 break;
             }
             tail = &tt->next;
@@ -4812,6 +5011,54 @@ static int expand_mmacro(Token * tline)
     return 1;
 }
 
+/*
+ * Line cache management; see the comment above struct CachedLine.
+ */
+static void linecache_free(void)
+{
+    if (linecache) {
+        saa_free(linecache);
+        linecache = NULL;
+    }
+    lcmode = LC_OFF;
+    linecache_ok = false;
+}
+
+static void linecache_invalidate(void)
+{
+    if (lcmode == LC_RECORD)
+        linecache_free();
+}
+
+static void linecache_record(const char *line)
+{
+    struct CachedLine cl;
+
+    cl.fname  = src_get_fname();
+    cl.lineno = src_get_linnum();
+    cl.len    = strlen(line) + 1;
+    saa_wbytes(linecache, &cl, sizeof cl);
+    saa_wbytes(linecache, line, cl.len);
+    linecache_lines++;
+}
+
+static char *linecache_replay(void)
+{
+    struct CachedLine cl;
+    char *line;
+
+    if (!linecache_left)
+        return NULL;
+    linecache_left--;
+
+    saa_rnbytes(linecache, &cl, sizeof cl);
+    line = nasm_malloc(cl.len);
+    saa_rnbytes(linecache, line, cl.len);
+    src_set(cl.lineno, cl.fname);
+
+    return line;
+}
+
 /*
  * This function adds macro names to error messages, and suppresses
  * them if necessary.
@@ -4836,6 +5083,13 @@ static void pp_verror(int severity, const char *fmt, va_list arg)
 	 !emitting(istk->conds->state)))
 	return;
 
+    /*
+     * Anything not restricted to a specific pass would be issued
+     * again on every pass, so we can't replay this one.
+     */
+    if (!(severity & (ERR_PASS1|ERR_PASS2)))
+        linecache_invalidate();
+
     /* get %macro name */
     if (!(severity & ERR_NOFILE) && istk && istk->mstk) {
         mmac = istk->mstk;
@@ -4859,20 +5113,39 @@ static void pp_verror(int severity, const char *fmt, va_list arg)
 static void
 pp_reset(char *file, int apass, StrList **deplist)
 {
+    struct nasm_filemap *map;
     Token *t;
 
+    if (apass == 1 && passn > 1 && linecache_ok) {
+        lcmode = LC_REPLAY;
+        linecache_left = linecache_lines;
+        saa_rewind(linecache);
+        src_set(0, file);
+        pass = 1;
+        return;
+    }
+
+    linecache_free();
+    if (apass == 1 && passn == 1) {
+        linecache = saa_init(1);
+        linecache_lines = 0;
+        lcmode = LC_RECORD;
+    }
+
     cstk = NULL;
     istk = nasm_malloc(sizeof(Include));
     istk->next = NULL;
     istk->conds = NULL;
     istk->expansion = NULL;
     istk->mstk = NULL;
-    istk->fp = nasm_open_read(file, NF_TEXT);
+    map = src_open(file, NF_TEXT);
+    if (!map)
+	nasm_fatal(ERR_NOFILE, "unable to open input file `%s'", file);
+    istk->pos = map->data;
+    istk->end = map->data + map->size;
     istk->fname = NULL;
     src_set(0, file);
     istk->lineinc = 1;
-    if (!istk->fp)
-	nasm_fatal(ERR_NOFILE, "unable to open input file `%s'", file);
     defining = NULL;
     nested_mac_count = 0;
     nested_rep_count = 0;
@@ -4911,10 +5184,8 @@ pp_reset(char *file, int apass, StrList **deplist)
      * all the other builtins, because it is special -- it varies between
      * passes.
      */
-    t = nasm_malloc(sizeof(*t));
-    t->next = NULL;
+    t = new_Token(NULL, TOK_NUMBER, NULL, 0);
     make_tok_num(t, apass);
-    t->a.mac = NULL;
     define_smacro(NULL, "__PASS__", true, 0, t);
 }
 
@@ -4923,6 +5194,9 @@ static char *pp_getline(void)
     char *line;
     Token *tline;
 
+    if (lcmode == LC_REPLAY)
+        return linecache_replay();
+
     real_verror = nasm_set_verror(pp_verror);
 
     while (1) {
@@ -4961,7 +5235,7 @@ static char *pp_getline(void)
 
                     list_for_each(t, l->first) {
                         if (t->text || t->type == TOK_WHITESPACE) {
-                            tt = *tail = new_Token(NULL, t->type, t->text, 0);
+                            tt = *tail = dup_Token(NULL, t);
                             tail = &tt->next;
                         }
                     }
@@ -5032,9 +5306,10 @@ static char *pp_getline(void)
             }
             line = read_line();
             if (line) {         /* from the current input file */
-                line = prepreproc(line);
-                tline = tokenize(line);
-                nasm_free(line);
+                char *p = prepreproc(line);
+                tline = tokenize(p);
+                if (p != line)
+                    nasm_free(p);
                 break;
             }
             /*
@@ -5042,7 +5317,6 @@ static char *pp_getline(void)
              */
             {
                 Include *i = istk;
-                fclose(i->fp);
                 if (i->conds) {
                     /* nasm_error can't be conditionally suppressed */
                     nasm_fatal(0,
@@ -5131,6 +5405,13 @@ static char *pp_getline(void)
     }
 
 done:
+    if (lcmode == LC_RECORD) {
+        if (line)
+            linecache_record(line);
+        else
+            linecache_ok = true;
+    }
+
     nasm_set_verror(real_verror);
     return line;
 }
@@ -5160,7 +5441,6 @@ static void pp_cleanup(int pass)
     while (istk) {
         Include *i = istk;
         istk = istk->next;
-        fclose(i->fp);
         nasm_free(i);
     }
     while (cstk)
@@ -5168,6 +5448,11 @@ static void pp_cleanup(int pass)
     src_set_fname(NULL);
     if (pass == 0) {
         IncPath *i;
+        linecache_free();
+        free_srcfiles();
+        nasm_free(linebuf);
+        linebuf = NULL;
+        linebuf_size = 0;
         free_llist(predef);
         predef = NULL;
         delete_Blocks();
@@ -5280,8 +5565,8 @@ static void make_tok_num(Token * tok, int64_t val)
 {
     char numbuf[32];
     snprintf(numbuf, sizeof(numbuf), "%"PRId64"", val);
-    tok->text = nasm_strdup(numbuf);
     tok->type = TOK_NUMBER;
+    set_text(tok, numbuf, strlen(numbuf));
 }
 
 static void pp_list_one_macro(MMacro *m, int severity)
@@ -5312,6 +5597,20 @@ static void pp_error_list_macros(int severity)
     src_set(saved_line, saved_fname);
 }
 
+static bool pp_in_macro(void)
+{
+    MMacro *m;
+
+    if (!istk)
+        return false;
+
+    for (m = istk->mstk; m; m = m->next_active) {
+        if (m->name && !m->nolist)
+            return true;
+    }
+    return false;
+}
+
 const struct preproc_ops nasmpp = {
     pp_reset,
     pp_getline,
@@ -5322,4 +5621,5 @@ const struct preproc_ops nasmpp = {
     pp_pre_include,
     pp_include_path,
     pp_error_list_macros,
+    pp_in_macro,
 };
@@ -0,0 +1,445 @@
+/* ----------------------------------------------------------------------- *
+ *
+ *   Copyright 1996-2016 The NASM Authors - All Rights Reserved
+ *   See the file AUTHORS included with the NASM distribution for
+ *   the specific copyright holders.
+ *
+ *   Redistribution and use in source and binary forms, with or without
+ *   modification, are permitted provided that the following
+ *   conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *
+ *     THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ *     CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *     INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ *     MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ *     DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ *     CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *     SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ *     NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *     LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ *     HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *     CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ *     OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ *     EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * ----------------------------------------------------------------------- */
+
+/*
+ * relax.c  relaxation of span-dependent jumps
+ *
+ * On every optimization pass the position of each line is recorded,
+ * together with each jump jmp_match() could encode either short or
+ * near.  At the end of a pass which moved labels, the jumps are then
+ * relaxed against each other: starting with all of them short, any
+ * jump whose target is out of range becomes near, which moves
+ * everything after it, until nothing changes.  That only takes the
+ * line positions, not another pass over the source, and usually
+ * reaches the same sizes the passes would after many iterations.
+ *
+ * The labels are then moved to where that layout puts them, so the
+ * next pass starts out from it and normally just confirms it.
+ * As soon as any other line changes size between passes, as an ALIGN
+ * would, the layout is left to the ordinary passes just as before.
+ */
+
+#include "compiler.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "nasm.h"
+#include "nasmlib.h"
+#include "labels.h"
+#include "relax.h"
+
+/* Limit on relaxations, so they can't keep the labels from settling */
+#define RELAX_MAX_ROUNDS 8
+
+struct relax_pos {
+    int32_t segment;
+    int64_t offset;
+};
+
+/* Line positions of one pass, indexed by line number */
+struct relax_lines {
+    struct relax_pos    *pos;
+    size_t              size;
+    int32_t             nlines;
+    int32_t             *index;         /* sorted by segment and line */
+};
+
+/* A jump as the relaxation sees it */
+struct relax_work {
+    int32_t             tline;          /* line the target is on */
+    int64_t             disp;           /* offset of the target in it */
+    int64_t             delta;          /* growth relative to this pass */
+    bool                is_short;
+};
+
+static struct relax_lines lines[2];
+static struct relax_lines *cur = &lines[0];
+static struct relax_lines *prev = &lines[1];
+
+static struct relax_branch *branches;
+static size_t branches_size;
+static int32_t nbranches;
+
+static int rounds;
+static bool unstable;                   /* other lines change size too */
+
+/* The solution relax_adjust() works from */
+static const int32_t *relax_order;
+static const int64_t *relax_sum;
+
+void relax_line(int32_t lineno, int32_t segment, int64_t offset)
+{
+    size_t n;
+
+    if (lineno <= 0)
+        return;
+
+    if ((size_t)lineno >= cur->size) {
+        n = cur->size ? cur->size : 4096;
+        while (n <= (size_t)lineno)
+            n <<= 1;
+        cur->pos = nasm_realloc(cur->pos, n * sizeof *cur->pos);
+        memset(cur->pos + cur->size, 0, (n - cur->size) * sizeof *cur->pos);
+        cur->size = n;
+    }
+
+    cur->pos[lineno].segment = segment;
+    cur->pos[lineno].offset  = offset;
+    if (lineno > cur->nlines)
+        cur->nlines = lineno;
+}
+
+void relax_branch(const struct relax_branch *branch)
+{
+    if ((size_t)nbranches >= branches_size) {
+        branches_size = branches_size ? branches_size << 1 : 256;
+        branches = nasm_realloc(branches, branches_size * sizeof *branches);
+    }
+    branches[nbranches++] = *branch;
+}
+
+static const struct relax_lines *sort_lines;
+
+static int cmp_lines(const void *a, const void *b)
+{
+    int32_t la = *(const int32_t *)a;
+    int32_t lb = *(const int32_t *)b;
+    int32_t sa = sort_lines->pos[la].segment;
+    int32_t sb = sort_lines->pos[lb].segment;
+
+    if (sa != sb)
+        return sa < sb ? -1 : 1;
+    return la < lb ? -1 : la > lb;
+}
+
+/*
+ * Sort the lines of a pass by segment, and make sure that the
+ * positions within each segment never go backwards.
+ */
+static bool relax_index(struct relax_lines *l)
+{
+    const struct relax_pos *p, *q;
+    int32_t i;
+
+    l->index = nasm_realloc(l->index, l->nlines * sizeof *l->index);
+    for (i = 0; i < l->nlines; i++)
+        l->index[i] = i + 1;
+
+    sort_lines = l;
+    qsort(l->index, l->nlines, sizeof *l->index, cmp_lines);
+
+    for (i = 1; i < l->nlines; i++) {
+        p = &l->pos[l->index[i - 1]];
+        q = &l->pos[l->index[i]];
+        if (p->segment == q->segment && p->offset > q->offset)
+            return false;
+    }
+
+    return true;
+}
+
+/*
+ * Find the line a position belongs to: the first of the lines at
+ * the highest offset not beyond it, or 0 if there is none.
+ */
+static int32_t relax_lookup(const struct relax_lines *l,
+                            int32_t segment, int64_t offset)
+{
+    const struct relax_pos *p;
+    int32_t lo = 0, hi = l->nlines, mid;
+
+    while (lo < hi) {
+        mid = lo + ((hi - lo) >> 1);
+        p = &l->pos[l->index[mid]];
+        if (p->segment < segment ||
+            (p->segment == segment && p->offset <= offset))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    if (!lo || l->pos[l->index[lo - 1]].segment != segment)
+        return 0;
+
+    offset = l->pos[l->index[--lo]].offset;
+    while (lo > 0 && l->pos[l->index[lo - 1]].segment == segment &&
+           l->pos[l->index[lo - 1]].offset == offset)
+        lo--;
+
+    return l->index[lo];
+}
+
+static int cmp_branches(const void *a, const void *b)
+{
+    const struct relax_branch *ba = &branches[*(const int32_t *)a];
+    const struct relax_branch *bb = &branches[*(const int32_t *)b];
+
+    if (ba->segment != bb->segment)
+        return ba->segment < bb->segment ? -1 : 1;
+    return ba->lineno < bb->lineno ? -1 : ba->lineno > bb->lineno;
+}
+
+/*
+ * Index into order[] of the first jump at or after the line
+ */
+static int32_t relax_first(const int32_t *order, int32_t segment,
+                           int32_t lineno)
+{
+    const struct relax_branch *b;
+    int32_t lo = 0, hi = nbranches, mid;
+
+    while (lo < hi) {
+        mid = lo + ((hi - lo) >> 1);
+        b = &branches[order[mid]];
+        if (b->segment < segment ||
+            (b->segment == segment && b->lineno < lineno))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+/* How far the start of a line moves with the jumps as in work[] */
+static int64_t relax_shift(const int32_t *order, const int64_t *sum,
+                           int32_t segment, int32_t lineno)
+{
+    return sum[relax_first(order, segment, lineno)] -
+        sum[relax_first(order, segment, 0)];
+}
+
+/* How far a label moves with the jumps as relaxed */
+static int64_t relax_adjust(int32_t segment, int64_t offset)
+{
+    int32_t lineno;
+
+    if (relax_first(relax_order, segment, 0) ==
+        relax_first(relax_order, segment, INT32_MAX))
+        return 0;               /* No jumps in this segment */
+
+    lineno = relax_lookup(cur, segment, offset);
+    if (!lineno)
+        return 0;
+
+    return relax_shift(relax_order, relax_sum, segment, lineno);
+}
+
+/*
+ * Check that only the jumps changed size since the previous pass.
+ * Any other line which does, such as an ALIGN, depends on the layout
+ * in ways the relaxation can't predict.
+ */
+static bool relax_stable(void)
+{
+    const struct relax_pos *p, *q;
+    int64_t csize, psize;
+    bool *jump;
+    bool stable = true;
+    int32_t i, line;
+
+    if (prev->nlines != cur->nlines)
+        return true;            /* Not the same lines, nothing to compare */
+    if (!relax_index(cur) || !relax_index(prev))
+        return false;
+
+    jump = nasm_zalloc((cur->nlines + 1) * sizeof *jump);
+    for (i = 0; i < nbranches; i++)
+        if (branches[i].lineno <= cur->nlines)
+            jump[branches[i].lineno] = true;
+
+    for (i = 1; i < cur->nlines && stable; i++) {
+        line = cur->index[i - 1];
+        if (jump[line] || prev->index[i - 1] != line)
+            continue;
+        p = &cur->pos[line];
+        q = &cur->pos[cur->index[i]];
+        if (p->segment != q->segment)
+            continue;
+        csize = q->offset - p->offset;
+        p = &prev->pos[line];
+        q = &prev->pos[prev->index[i]];
+        if (p->segment != q->segment)
+            continue;
+        psize = q->offset - p->offset;
+        stable = csize == psize;
+    }
+
+    nasm_free(jump);
+    return stable;
+}
+
+/*
+ * Relax the jumps of the pass just finished, and move the labels to
+ * match if that changes any of them.
+ */
+static bool relax_solve(void)
+{
+    const struct relax_branch *b;
+    const struct relax_lines *l;
+    struct relax_work *work, *w;
+    int32_t *order;
+    int64_t *sum;
+    int64_t from, to, d;
+    bool need_prev = false;
+    bool changed;
+    int32_t i;
+
+    if (!nbranches || !cur->nlines)
+        return false;
+
+    for (i = 0; i < nbranches; i++) {
+        b = &branches[i];
+        if (b->tsegment == NO_SEG || b->lineno > cur->nlines ||
+            cur->pos[b->lineno].segment != b->segment ||
+            cur->pos[b->lineno].offset != b->offset)
+            return false;
+        need_prev |= b->forward;
+    }
+
+    if (!relax_index(cur))
+        return false;
+    if (need_prev && (prev->nlines != cur->nlines || !relax_index(prev)))
+        return false;
+
+    work  = nasm_malloc(nbranches * sizeof *work);
+    order = nasm_malloc(nbranches * sizeof *order);
+    sum   = nasm_malloc((nbranches + 1) * sizeof *sum);
+
+    for (i = 0; i < nbranches; i++) {
+        b = &branches[i];
+        w = &work[i];
+        l = b->forward ? prev : cur;
+        w->tline = relax_lookup(l, b->tsegment, b->target);
+        if (!w->tline || cur->pos[w->tline].segment != b->tsegment) {
+            changed = false;
+            goto done;
+        }
+        w->disp = b->target - l->pos[w->tline].offset;
+        w->is_short = true;
+        w->delta = b->is_short ? 0 : b->ssize - b->nsize;
+        order[i] = i;
+    }
+    qsort(order, nbranches, sizeof *order, cmp_branches);
+
+    do {
+        sum[0] = 0;
+        for (i = 0; i < nbranches; i++)
+            sum[i + 1] = sum[i] + work[order[i]].delta;
+
+        changed = false;
+        for (i = 0; i < nbranches; i++) {
+            b = &branches[i];
+            w = &work[i];
+            if (!w->is_short)
+                continue;
+
+            from = b->offset +
+                relax_shift(order, sum, b->segment, b->lineno);
+            to = cur->pos[w->tline].offset + w->disp +
+                relax_shift(order, sum, b->tsegment, w->tline);
+            d = to - from - b->jsize;
+            if (d < -128 || d > 127) {
+                w->is_short = false;
+                w->delta = b->is_short ? b->nsize - b->ssize : 0;
+                changed = true;
+            }
+        }
+    } while (changed);
+
+    for (i = 0; i < nbranches; i++) {
+        if (work[i].is_short != branches[i].is_short) {
+            changed = true;
+            break;
+        }
+    }
+
+    if (changed) {
+        relax_order = order;
+        relax_sum   = sum;
+        shift_labels(relax_adjust);
+
+        /*
+         * Forward references on the next pass see the labels as
+         * moved, so this is the layout they have to be looked up in.
+         */
+        for (i = 1; i <= cur->nlines; i++)
+            cur->pos[i].offset +=
+                relax_shift(order, sum, cur->pos[i].segment, i);
+    }
+
+done:
+    nasm_free(work);
+    nasm_free(order);
+    nasm_free(sum);
+    return changed;
+}
+
+/*
+ * End of an optimization pass.  If solve is set, the labels moved
+ * and the jumps are worth relaxing before the next pass.
+ */
+void relax_pass_done(bool solve)
+{
+    struct relax_lines *l;
+
+    if (!unstable && cur->nlines)
+        unstable = !relax_stable();
+
+    if (solve && !unstable && rounds < RELAX_MAX_ROUNDS && relax_solve())
+        rounds++;
+
+    l = prev;
+    prev = cur;
+    cur = l;
+    cur->nlines = 0;
+    nbranches = 0;
+}
+
+void relax_cleanup(void)
+{
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        nasm_free(lines[i].pos);
+        nasm_free(lines[i].index);
+        memset(&lines[i], 0, sizeof lines[i]);
+    }
+    nasm_free(branches);
+    branches = NULL;
+    branches_size = 0;
+    nbranches = 0;
+    rounds = 0;
+    unstable = false;
+}
@@ -0,0 +1,67 @@
+/* ----------------------------------------------------------------------- *
+ *
+ *   Copyright 1996-2016 The NASM Authors - All Rights Reserved
+ *   See the file AUTHORS included with the NASM distribution for
+ *   the specific copyright holders.
+ *
+ *   Redistribution and use in source and binary forms, with or without
+ *   modification, are permitted provided that the following
+ *   conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *
+ *     THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ *     CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *     INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ *     MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ *     DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ *     CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *     SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ *     NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *     LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ *     HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *     CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ *     OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ *     EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * ----------------------------------------------------------------------- */
+
+/*
+ * relax.h  header file for relax.c
+ */
+
+#ifndef NASM_RELAX_H
+#define NASM_RELAX_H
+
+#include "compiler.h"
+
+#include "nasm.h"
+
+/*
+ * A jump which jmp_match() could encode either way, as seen by
+ * insn_size() on an optimization pass.
+ */
+struct relax_branch {
+    int32_t     lineno;         /* line of the jump */
+    int32_t     segment;        /* segment and offset of the line */
+    int64_t     offset;
+    int32_t     tsegment;       /* target, NO_SEG if not yet known */
+    int64_t     target;
+    bool        forward;        /* target value is from the previous pass */
+    int64_t     jsize;          /* short size as measured by jmp_match() */
+    int64_t     ssize;          /* size of the line with a short jump */
+    int64_t     nsize;          /* size of the line with a near jump */
+    bool        is_short;       /* short form chosen on this pass */
+};
+
+void relax_line(int32_t lineno, int32_t segment, int64_t offset);
+void relax_branch(const struct relax_branch *branch);
+void relax_pass_done(bool solve);
+void relax_cleanup(void);
+
+#endif /* NASM_RELAX_H */
@@ -40,6 +40,8 @@
 
 #include "nasm.h"
 #include "nasmlib.h"
+#include "arena.h"
+#include "atom.h"
 #include "quote.h"
 #include "stdscan.h"
 #include "insns.h"
@@ -50,9 +52,8 @@
  * stdscan_tempstorage, which can be cleared using stdscan_reset.
  */
 static char *stdscan_bufptr = NULL;
-static char **stdscan_tempstorage = NULL;
-static int stdscan_tempsize = 0, stdscan_templen = 0;
-#define STDSCAN_TEMP_DELTA 256
+static struct arena stdscan_tempstorage;
+static bool stdscan_symbols;    /* symbol, $ or $$ seen since reset */
 
 void stdscan_set(char *str)
 {
@@ -64,15 +65,19 @@ char *stdscan_get(void)
         return stdscan_bufptr;
 }
 
-static void stdscan_pop(void)
+void stdscan_reset(void)
 {
-    nasm_free(stdscan_tempstorage[--stdscan_templen]);
+    arena_reset(&stdscan_tempstorage);
+    stdscan_symbols = false;
 }
 
-void stdscan_reset(void)
+/*
+ * Has anything been scanned since stdscan_reset() whose value can
+ * change from pass to pass: a symbol, $ or $$?
+ */
+bool stdscan_saw_symbol(void)
 {
-    while (stdscan_templen > 0)
-        stdscan_pop();
+    return stdscan_symbols;
 }
 
 /*
@@ -81,29 +86,31 @@ void stdscan_reset(void)
  */
 void stdscan_cleanup(void)
 {
-    stdscan_reset();
-    nasm_free(stdscan_tempstorage);
+    arena_free(&stdscan_tempstorage);
 }
 
 static char *stdscan_copy(char *p, int len)
 {
     char *text;
 
-    text = nasm_malloc(len + 1);
+    text = arena_alloc(&stdscan_tempstorage, len + 1);
     memcpy(text, p, len);
     text[len] = '\0';
 
-    if (stdscan_templen >= stdscan_tempsize) {
-        stdscan_tempsize += STDSCAN_TEMP_DELTA;
-        stdscan_tempstorage = nasm_realloc(stdscan_tempstorage,
-                                           stdscan_tempsize *
-                                           sizeof(char *));
-    }
-    stdscan_tempstorage[stdscan_templen++] = text;
-
     return text;
 }
 
+/*
+ * Identifiers are interned, so that the labels code can find them
+ * without hashing them again.
+ */
+static int stdscan_id(struct tokenval *tv, const char *p, int len)
+{
+    tv->t_atom = atom_get(p, len);
+    tv->t_charptr = (char *)tv->t_atom->str;
+    return tv->t_type = TOKEN_ID;
+}
+
 /*
  * a token is enclosed with braces. proper token type will be assigned
  * accordingly with the token flag.
@@ -140,7 +147,7 @@ int stdscan(void *private_data, struct tokenval *tv)
         (*stdscan_bufptr == '$' && isidstart(stdscan_bufptr[1]))) {
         /* now we've got an identifier */
         bool is_sym = false;
-        int token_type;
+        int token_type, len;
 
         if (*stdscan_bufptr == '$') {
             is_sym = true;
@@ -152,20 +159,30 @@ int stdscan(void *private_data, struct tokenval *tv)
         while (isidchar(*stdscan_bufptr))
             stdscan_bufptr++;
 
-        /* ... copy only up to IDLEN_MAX-1 characters */
-        tv->t_charptr = stdscan_copy(r, stdscan_bufptr - r < IDLEN_MAX ?
-                                     stdscan_bufptr - r : IDLEN_MAX - 1);
+        /* ... use only up to IDLEN_MAX-1 characters */
+        len = stdscan_bufptr - r < IDLEN_MAX ?
+            stdscan_bufptr - r : IDLEN_MAX - 1;
 
-        if (is_sym || stdscan_bufptr - r > MAX_KEYWORD)
-            return tv->t_type = TOKEN_ID;       /* bypass all other checks */
+        if (is_sym || len > MAX_KEYWORD) {
+            stdscan_symbols = true;
+            return stdscan_id(tv, r, len);      /* bypass all other checks */
+        }
 
-        for (s = tv->t_charptr, r = ourcopy; *s; s++)
-            *r++ = nasm_tolower(*s);
-        *r = '\0';
+        for (s = ourcopy; s < ourcopy + len; s++)
+            *s = nasm_tolower(r[s - ourcopy]);
+        *s = '\0';
         /* right, so we have an identifier sitting in temp storage. now,
          * is it actually a register or instruction name, or what? */
         token_type = nasm_token_hash(ourcopy, tv);
 
+        if (token_type == TOKEN_ID || (tv->t_flag & TFLAG_BRC)) {
+            stdscan_symbols = true;
+            stdscan_id(tv, r, len);
+        } else {
+            tv->t_charptr = stdscan_copy(r, len);
+            tv->t_atom = NULL;
+        }
+
 	if (unlikely(tv->t_flag & TFLAG_WARN)) {
 	    nasm_error(ERR_WARNING|ERR_PASS1|ERR_WARN_PTR,
 		       "`%s' is not a NASM keyword", tv->t_charptr);
@@ -185,6 +202,7 @@ int stdscan(void *private_data, struct tokenval *tv)
          * the base of the current segment.
          */
         stdscan_bufptr++;
+        stdscan_symbols = true;
         if (*stdscan_bufptr == '$') {
             stdscan_bufptr++;
             return tv->t_type = TOKEN_BASE;
@@ -243,7 +261,6 @@ int stdscan(void *private_data, struct tokenval *tv)
         } else {
             r = stdscan_copy(r, stdscan_bufptr - r);
             tv->t_integer = readnum(r, &rn_error);
-            stdscan_pop();
             if (rn_error) {
                 /* some malformation occurred */
                 return tv->t_type = TOKEN_ERRNUM;
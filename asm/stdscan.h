@@ -42,6 +42,7 @@
 void stdscan_set(char *str);
 char *stdscan_get(void);
 void stdscan_reset(void);
+bool stdscan_saw_symbol(void);
 int stdscan(void *private_data, struct tokenval *tv);
 int nasm_token_hash(const char *token, struct tokenval *tv);
 void stdscan_cleanup(void);
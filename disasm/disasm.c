@@ -1298,6 +1298,10 @@ int32_t disasm(uint8_t *data, char *output, int outbufsize, int segsize,
     while (ix->n == -1) {
         ix = (const struct disasm_index *)ix->p + *dp++;
     }
+    if (ix->n == -2) {
+        ix = (const struct disasm_index *)ix->p +
+            DISASM_SEL(*dp, prefix.osp, prefix.rep);
+    }
 
     p = (const struct itemplate * const *)ix->p;
     for (n = ix->n; n; n--, p++) {
@@ -53,9 +53,13 @@
 
 #define BPL 8                   /* bytes per line of hex dump */
 
+#define CHUNK_SIZE  (256*1024)  /* bytes handed to each thread with -j */
+#define CHUNK_MARKS 64          /* places to pick up a chunk's output from */
+#define OUTPUT_FLUSH 65536      /* when to write out the serial output */
+
 static const char *help =
     "usage: ndisasm [-a] [-i] [-h] [-r] [-u] [-b bits] [-o origin] [-s sync...]\n"
-    "               [-e bytes] [-k start,bytes] [-p vendor] file\n"
+    "               [-e bytes] [-k start,bytes] [-p vendor] [-j jobs] file\n"
     "   -a or -i activates auto (intelligent) sync\n"
     "   -u same as -b 32\n"
     "   -b 16, -b 32 or -b 64 sets the processor mode\n"
@@ -63,9 +67,53 @@ static const char *help =
     "   -r or -v displays the version number\n"
     "   -e skips <bytes> bytes of header\n"
     "   -k avoids disassembling <bytes> bytes from position <start>\n"
-    "   -p selects the preferred vendor instruction set (intel, amd, cyrix, idt)\n";
+    "   -p selects the preferred vendor instruction set (intel, amd, cyrix, idt)\n"
+    "   -j disassembles on <jobs> threads (not with -a)\n";
+
+/* What to disassemble, and how */
+struct dis_input {
+    const uint8_t *data;
+    size_t size;
+    uint32_t origin;            /* offset of the first byte */
+    int bits;
+    bool autosync;
+    iflag_t prefer;
+    uint32_t (*sync)(uint32_t position, uint32_t *length);
+};
+
+/*
+ * Disassembly of part of the input, from start until an instruction
+ * would begin at or after stop.
+ */
+struct dis_chunk {
+    const struct dis_input *in;
+    size_t start, stop;
+    size_t end;                 /* where it actually ended */
+    char *buf;                  /* the output */
+    size_t len, size;
+    bool flush;                 /* write the output as it goes */
+    int nmarks;                 /* where the first lines start */
+    size_t mark_pos[CHUNK_MARKS];
+    size_t mark_len[CHUNK_MARKS];
+};
+
+/*
+ * Sync points in the order the serial disassembly would see them:
+ * from position "from" on, next_sync() would answer pos and length.
+ */
+struct sync_sched {
+    size_t from;
+    uint32_t pos, length;
+};
 
-static void output_ins(uint32_t, uint8_t *, int, char *);
+static struct sync_sched *sched;
+static size_t nsched;
+static uint32_t sched_origin;
+
+static void disasm_serial(const struct dis_input *in);
+static void disasm_parallel(const struct dis_input *in, int jobs);
+static void output_ins(struct dis_chunk *, uint32_t, const uint8_t *, int,
+                       const char *);
 static void skip(uint32_t dist, FILE * fp);
 
 static void ndisasm_verror(int severity, const char *fmt, va_list va)
@@ -78,19 +126,18 @@ static void ndisasm_verror(int severity, const char *fmt, va_list va)
 
 int main(int argc, char **argv)
 {
-    char buffer[INSN_MAX * 2], *p, *ep, *q;
-    char outbuf[256];
+    char *ep;
     char *pname = *argv;
     char *filename = NULL;
     uint32_t nextsync, synclen, initskip = 0L;
-    int lenread;
-    int32_t lendis;
     bool autosync = false;
     int bits = 16, b;
-    bool eof = false;
+    int jobs = 1;
     iflag_t prefer;
     bool rn_error;
     int32_t offset;
+    struct nasm_filemap map;
+    struct dis_input in;
     FILE *fp;
 
     tolower_init();
@@ -221,6 +268,22 @@ int main(int argc, char **argv)
                     add_sync(nextsync, synclen);
                     p = "";     /* force to next argument */
                     break;
+                case 'j':      /* number of threads */
+                    v = p[1] ? p + 1 : --argc ? *++argv : NULL;
+                    if (!v) {
+                        fprintf(stderr, "%s: `-j' requires an argument\n",
+                                pname);
+                        return 1;
+                    }
+                    jobs = readnum(v, &rn_error);
+                    if (rn_error || jobs < 1) {
+                        fprintf(stderr,
+                                "%s: `-j' requires a positive number\n",
+                                pname);
+                        return 1;
+                    }
+                    p = "";     /* force to next argument */
+                    break;
                 case 'p':      /* preferred vendor */
                     v = p[1] ? p + 1 : --argc ? *++argv : NULL;
                     if (!v) {
@@ -283,89 +346,321 @@ int main(int argc, char **argv)
     if (initskip > 0)
         skip(initskip, fp);
 
+    if (!nasm_map_file(&map, fp)) {
+        fprintf(stderr, "%s: unable to read `%s': %s\n",
+                pname, filename, strerror(errno));
+        return 1;
+    }
+    if (fp != stdin)
+        fclose(fp);
+
+    in.data     = (const uint8_t *)map.data;
+    in.size     = map.size;
+    in.origin   = offset;
+    in.bits     = bits;
+    in.autosync = autosync;
+    in.prefer   = prefer;
+    in.sync     = next_sync;
+
     /*
-     * This main loop is really horrible, and wants rewriting with
-     * an axe. It'll stay the way it is for a while though, until I
-     * find the energy...
+     * With autosync, the sync points depend on everything before, so
+     * that can only be done in order.
      */
+    if (jobs > 1 && !autosync && in.size > CHUNK_SIZE)
+        disasm_parallel(&in, jobs);
+    else
+        disasm_serial(&in);
 
-    p = q = buffer;
-    nextsync = next_sync(offset, &synclen);
-    do {
-        uint32_t to_read = buffer + sizeof(buffer) - p;
-	if ((nextsync || synclen) &&
-	    to_read > nextsync - offset - (p - q))
-            to_read = nextsync - offset - (p - q);
-        if (to_read) {
-            lenread = fread(p, 1, to_read, fp);
-            if (lenread == 0)
-                eof = true;     /* help along systems with bad feof */
-        } else
-            lenread = 0;
-        p += lenread;
-        if ((nextsync || synclen) &&
-	    (uint32_t)offset == nextsync) {
+    nasm_unmap_file(&map);
+    return 0;
+}
+
+static void output_write(struct dis_chunk *c)
+{
+    fwrite(c->buf, 1, c->len, stdout);
+    c->len = 0;
+}
+
+static void output_printf(struct dis_chunk *c, const char *fmt, ...)
+{
+    va_list ap;
+    int n;
+
+    for (;;) {
+        va_start(ap, fmt);
+        n = vsnprintf(c->buf + c->len, c->size - c->len, fmt, ap);
+        va_end(ap);
+        if (n >= 0 && (size_t)n < c->size - c->len)
+            break;
+
+        c->size = c->size ? c->size << 1 : 4096;
+        c->buf = nasm_realloc(c->buf, c->size);
+    }
+    c->len += n;
+}
+
+/* Remember where the line for position pos starts in the output */
+static void output_mark(struct dis_chunk *c, size_t pos)
+{
+    if (c->nmarks < CHUNK_MARKS) {
+        c->mark_pos[c->nmarks] = pos;
+        c->mark_len[c->nmarks] = c->len;
+        c->nmarks++;
+    }
+}
+
+/*
+ * Disassemble from position pos, until the next instruction would
+ * start at or after stop, or the input ends.  Returns the position
+ * reached.
+ */
+static size_t disasm_range(const struct dis_input *in, struct dis_chunk *c,
+                           size_t pos, size_t stop)
+{
+    uint8_t buffer[INSN_MAX * 2];
+    char outbuf[256];
+    const uint8_t *q;
+    uint32_t offset = in->origin + (uint32_t)pos;
+    uint32_t nextsync, synclen;
+    size_t left;
+    int32_t lendis;
+    iflag_t prefer = in->prefer;
+
+    nextsync = in->sync(offset, &synclen);
+    while (pos < stop) {
+        if ((nextsync || synclen) && offset == nextsync) {
             if (synclen) {
-                fprintf(stdout, "%08"PRIX32"  skipping 0x%"PRIX32" bytes\n",
-			offset, synclen);
+                output_mark(c, pos);
+                output_printf(c, "%08"PRIX32"  skipping 0x%"PRIX32" bytes\n",
+                              offset, synclen);
                 offset += synclen;
-                skip(synclen, fp);
+                pos += synclen;
             }
-            p = q = buffer;
-            nextsync = next_sync(offset, &synclen);
-        }
-        while (p > q && (p - q >= INSN_MAX || lenread == 0)) {
-            lendis =
-                disasm((uint8_t *) q, outbuf, sizeof(outbuf), bits,
-		       offset, autosync, &prefer);
-            if (!lendis || lendis > (p - q)
-                || ((nextsync || synclen) &&
-		    (uint32_t)lendis > nextsync - offset))
-                lendis = eatbyte((uint8_t *) q, outbuf, sizeof(outbuf), bits);
-            output_ins(offset, (uint8_t *) q, lendis, outbuf);
-            q += lendis;
-            offset += lendis;
+            nextsync = in->sync(offset, &synclen);
+            continue;
         }
-        if (q >= buffer + INSN_MAX) {
-            uint8_t *r = (uint8_t *) buffer, *s = (uint8_t *) q;
-            int count = p - q;
-            while (count--)
-                *r++ = *s++;
-            p -= (q - buffer);
+
+        if (pos >= in->size)
+            break;
+
+        left = in->size - pos;
+        if ((nextsync || synclen) && left > nextsync - offset)
+            left = nextsync - offset;
+
+        /* Never let the disassembler look beyond what it may use */
+        if (left < sizeof(buffer)) {
+            memset(buffer, 0, sizeof(buffer));
+            memcpy(buffer, in->data + pos, left);
             q = buffer;
+        } else {
+            q = in->data + pos;
         }
-    } while (lenread > 0 || !(eof || feof(fp)));
 
-    if (fp != stdin)
-        fclose(fp);
+        lendis = disasm((uint8_t *)q, outbuf, sizeof(outbuf), in->bits,
+                        offset, in->autosync, &prefer);
+        if (!lendis || (size_t)lendis > left)
+            lendis = eatbyte((uint8_t *)q, outbuf, sizeof(outbuf), in->bits);
 
-    return 0;
+        output_mark(c, pos);
+        output_ins(c, offset, q, lendis, outbuf);
+        pos += lendis;
+        offset += lendis;
+
+        if (c->flush && c->len >= OUTPUT_FLUSH)
+            output_write(c);
+    }
+
+    return pos;
+}
+
+static void disasm_serial(const struct dis_input *in)
+{
+    struct dis_chunk c;
+
+    memset(&c, 0, sizeof c);
+    c.flush = true;
+    disasm_range(in, &c, 0, (size_t)-1);
+    output_write(&c);
+    nasm_free(c.buf);
+}
+
+/*
+ * Build the sync schedule.  next_sync() is asked again only once a
+ * sync point is reached, and its answer then stands until the next
+ * one, which is what this records.
+ */
+static void sync_schedule(uint32_t origin)
+{
+    size_t nsize = 0;
+    uint32_t offset = origin;
+    size_t from = 0;
+    struct sync_sched *s;
+
+    sched_origin = origin;
+    nsched = 0;
+    for (;;) {
+        if (nsched >= nsize) {
+            nsize = nsize ? nsize << 1 : 64;
+            sched = nasm_realloc(sched, nsize * sizeof(*sched));
+        }
+        s = &sched[nsched++];
+        s->from = from;
+        s->pos = next_sync(offset, &s->length);
+
+        /* No more sync points, or one which will never be reached */
+        if ((!s->pos && !s->length) || s->pos < offset)
+            break;
+
+        offset = s->pos + s->length;
+        if ((uint32_t)(offset - origin) <= from)
+            break;              /* Wrapped around */
+        from = (uint32_t)(offset - origin);
+    }
+}
+
+static const struct sync_sched *sched_find(size_t pos)
+{
+    size_t lo = 0, hi = nsched, mid;
+
+    while (hi - lo > 1) {
+        mid = lo + ((hi - lo) >> 1);
+        if (sched[mid].from <= pos)
+            lo = mid;
+        else
+            hi = mid;
+    }
+
+    return &sched[lo];
+}
+
+static uint32_t sched_sync(uint32_t position, uint32_t *length)
+{
+    const struct sync_sched *s;
+
+    s = sched_find((uint32_t)(position - sched_origin));
+    *length = s->length;
+    return s->pos;
+}
+
+static void disasm_chunk(void *arg, int i)
+{
+    struct dis_chunk *c = (struct dis_chunk *)arg + i;
+
+    c->end = disasm_range(c->in, c, c->start, c->stop);
+}
+
+/*
+ * Disassemble on several threads.  The input is cut into chunks,
+ * preferably at sync points, which are disassembled separately and
+ * then written out in order.  Where the instructions of one chunk
+ * run into the next, the disassembly continues here until it falls
+ * into step with the next chunk's, which x86 code does within a few
+ * instructions; the output is exactly that of the serial run.
+ */
+static void disasm_parallel(const struct dis_input *pin, int jobs)
+{
+    struct dis_input in = *pin;
+    struct dis_chunk *chunks, *c, seam;
+    const struct sync_sched *s;
+    size_t *starts, nstarts, b, pos, spos;
+    size_t i, n, k;
+    int m;
+
+    sync_schedule(in.origin);
+    in.sync = sched_sync;
+
+    /* Where the chunks start: at a sync point if there is one near */
+    starts = nasm_malloc((in.size / CHUNK_SIZE + 1) * sizeof(*starts));
+    nstarts = 0;
+    for (b = 0; b < in.size; b += CHUNK_SIZE) {
+        pos = b;
+        s = sched_find(b);
+        spos = (uint32_t)(s->pos - in.origin);
+        if ((s->pos || s->length) && spos >= s->from) {
+            if (spos < b)
+                pos = spos;     /* Don't start in a skipped region */
+            else if (spos - b < CHUNK_SIZE)
+                pos = spos;
+        }
+        if (!nstarts || pos > starts[nstarts - 1])
+            starts[nstarts++] = pos;
+    }
+
+    memset(&seam, 0, sizeof seam);
+    seam.flush = true;
+
+    chunks = nasm_malloc(jobs * sizeof(*chunks));
+    pos = 0;
+    for (i = 0; i < nstarts; i += n) {
+        n = nstarts - i < (size_t)jobs ? nstarts - i : (size_t)jobs;
+        for (k = 0; k < n; k++) {
+            c = &chunks[k];
+            memset(c, 0, sizeof(*c));
+            c->start = starts[i + k];
+            c->stop = (i + k + 1 < nstarts) ? starts[i + k + 1] : (size_t)-1;
+            c->in = &in;
+        }
+        nasm_parallel(disasm_chunk, chunks, n, jobs);
+
+        for (k = 0; k < n; k++) {
+            c = &chunks[k];
+            if (pos < c->end) {
+                /* Find a line of this chunk to carry on from */
+                for (m = 0; m < c->nmarks; m++) {
+                    if (c->mark_pos[m] < pos)
+                        continue;
+                    pos = disasm_range(&in, &seam, pos, c->mark_pos[m]);
+                    if (pos == c->mark_pos[m])
+                        break;
+                }
+                if (m < c->nmarks) {
+                    output_write(&seam);
+                    fwrite(c->buf + c->mark_len[m], 1,
+                           c->len - c->mark_len[m], stdout);
+                    pos = c->end;
+                } else {
+                    pos = disasm_range(&in, &seam, pos, c->stop);
+                }
+            }
+            nasm_free(c->buf);
+        }
+    }
+
+    /* Sync points right at the end */
+    disasm_range(&in, &seam, pos, (size_t)-1);
+    output_write(&seam);
+
+    nasm_free(seam.buf);
+    nasm_free(chunks);
+    nasm_free(starts);
+    nasm_free(sched);
+    sched = NULL;
 }
 
-static void output_ins(uint32_t offset, uint8_t *data,
-                       int datalen, char *insn)
+static void output_ins(struct dis_chunk *c, uint32_t offset,
+                       const uint8_t *data, int datalen, const char *insn)
 {
     int bytes;
-    fprintf(stdout, "%08"PRIX32"  ", offset);
+    output_printf(c, "%08"PRIX32"  ", offset);
 
     bytes = 0;
     while (datalen > 0 && bytes < BPL) {
-        fprintf(stdout, "%02X", *data++);
+        output_printf(c, "%02X", *data++);
         bytes++;
         datalen--;
     }
 
-    fprintf(stdout, "%*s%s\n", (BPL + 1 - bytes) * 2, "", insn);
+    output_printf(c, "%*s%s\n", (BPL + 1 - bytes) * 2, "", insn);
 
     while (datalen > 0) {
-        fprintf(stdout, "         -");
+        output_printf(c, "         -");
         bytes = 0;
         while (datalen > 0 && bytes < BPL) {
-            fprintf(stdout, "%02X", *data++);
+            output_printf(c, "%02X", *data++);
             bytes++;
             datalen--;
         }
-        fprintf(stdout, "\n");
+        output_printf(c, "\n");
     }
 }
 
@@ -215,4 +215,14 @@ char *strsep(char **, const char *);
 # define printf_func(fmt, list)
 #endif
 
+/*
+ * Variables with a copy of their own in each thread, if the compiler
+ * can do them; code which needs them runs on one thread otherwise.
+ */
+#ifdef HAVE___THREAD
+# define threadlocal __thread
+#else
+# define threadlocal
+#endif
+
 #endif	/* NASM_COMPILER_H */
@@ -64,6 +64,8 @@ struct hash_insert {
 
 uint64_t crc64(uint64_t crc, const char *string);
 uint64_t crc64i(uint64_t crc, const char *string);
+uint64_t crc64b(uint64_t crc, const void *data, size_t len);
+uint64_t crc64ib(uint64_t crc, const void *data, size_t len);
 #define CRC64_INIT UINT64_C(0xffffffffffffffff)
 
 /* Some reasonable initial sizes... */
@@ -76,6 +78,8 @@ void **hash_find(struct hash_table *head, const char *string,
 		struct hash_insert *insert);
 void **hash_findi(struct hash_table *head, const char *string,
 		struct hash_insert *insert);
+void **hash_findih(struct hash_table *head, const char *string,
+		uint64_t hash, struct hash_insert *insert);
 void **hash_add(struct hash_insert *insert, const char *string, void *data);
 void *hash_iterate(const struct hash_table *head,
 		   struct hash_tbl_node **iterator,
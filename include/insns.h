@@ -23,20 +23,73 @@ struct itemplate {
     uint32_t        iflag_idx;          /* some flags referenced by index */
 };
 
+/*
+ * Operand class signature of a template: ITSEL_KIND_BITS bits per
+ * operand, one for each kind of instruction operand the template can
+ * accept in that position.  An operand which is none of the kinds
+ * below is ITSEL_OTHER, which every template accepts; matches() has
+ * the final word in any case.
+ */
+enum itsel_kind {
+    ITSEL_OTHER,
+    ITSEL_REG,                  /* register which isn't an EA */
+    ITSEL_REG_EA,               /* register which is also an EA */
+    ITSEL_MEM,                  /* memory reference */
+    ITSEL_IMM,                  /* immediate */
+    ITSEL_KIND_BITS
+};
+
+#define ITSEL_ACCEPT(opd)                                               \
+    ((UINT32_C(1) << ITSEL_OTHER) |                                     \
+     ((uint32_t)is_class((opd) & OPTYPE_MASK, REGISTER) << ITSEL_REG) | \
+     ((uint32_t)is_class((opd) & OPTYPE_MASK, REGISTER|REGMEM) << ITSEL_REG_EA) | \
+     ((uint32_t)is_class((opd) & OPTYPE_MASK, MEMORY) << ITSEL_MEM) |  \
+     ((uint32_t)is_class((opd) & OPTYPE_MASK, IMMEDIATE) << ITSEL_IMM))
+
+#define ITSEL_SIG(a,b,c,d,e)                            \
+    (ITSEL_ACCEPT(a) |                                  \
+     (ITSEL_ACCEPT(b) << ITSEL_KIND_BITS) |             \
+     (ITSEL_ACCEPT(c) << (ITSEL_KIND_BITS*2)) |         \
+     (ITSEL_ACCEPT(d) << (ITSEL_KIND_BITS*3)) |         \
+     (ITSEL_ACCEPT(e) << (ITSEL_KIND_BITS*4)))
+
+/*
+ * Assembler dispatch table: for each opcode and operand count, the
+ * list of candidate templates in their original order, terminated
+ * by a NULL template pointer.
+ */
+struct itemplate_sel {
+    const struct itemplate *temp;
+    uint32_t sig;
+};
+
 /* Disassembler table structure */
 
 /*
  * If n == -1, then p points to another table of 256
- * struct disasm_index, otherwise p points to a list of n
- * struct itemplates to consider.
+ * struct disasm_index; if n == -2, to a table of DISASM_SEL_SIZE
+ * of them, indexed by DISASM_SEL(); otherwise p points to a list
+ * of n struct itemplates to consider.
  */
 struct disasm_index {
     const void *p;
     int n;
 };
 
+/*
+ * Long lists of templates are split up by the ModRM reg field of
+ * the byte after the opcode, and by which of the 66, F2 and F3
+ * prefixes are present, leaving only the templates which could
+ * match.  This has to agree with dissel() in insns.pl.
+ */
+#define DISASM_SEL_SIZE (8*6)
+#define DISASM_SEL(byte, osp, rep)                                      \
+    ((((byte) >> 3) & 7) * 6 + ((osp) ? 3 : 0) +                        \
+     ((rep) == 0xF2 ? 1 : (rep) == 0xF3 ? 2 : 0))
+
 /* Tables for the assembler and disassembler, respectively */
 extern const struct itemplate * const nasm_instructions[];
+extern const struct itemplate_sel * const nasm_insn_select[][MAX_OPERANDS+1];
 extern const struct disasm_index itable[256];
 extern const struct disasm_index * const itable_vex[NASM_VEX_CLASSES][32][4];
 
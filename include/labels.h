@@ -41,8 +41,13 @@
 extern char lprefix[PREFIX_MAX];
 extern char lpostfix[PREFIX_MAX];
 
+struct atom;
+
 bool lookup_label(char *label, int32_t *segment, int64_t *offset);
+bool lookup_label_atom(struct atom *label, int32_t *segment, int64_t *offset);
+bool is_current_label(struct atom *label);
 bool is_extern(char *label);
+bool is_extern_atom(struct atom *label);
 void define_label(char *label, int32_t segment, int64_t offset, char *special,
                   bool is_norm, bool isextrn);
 void redefine_label(char *label, int32_t segment, int64_t offset, char *special,
@@ -51,6 +56,7 @@ void define_common(char *label, int32_t segment, int32_t size, char *special);
 void declare_as_global(char *label, char *special);
 int init_labels(void);
 void cleanup_labels(void);
+void shift_labels(int64_t (*shift)(int32_t segment, int64_t offset));
 char *local_scope(char *label);
 
 #endif /* LABELS_H */
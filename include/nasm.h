@@ -108,6 +108,20 @@ enum out_type {
     OUT_REL8ADR     /* 8-byte relative address */
 };
 
+/*
+ * A field needing relocation in a block of output (see the
+ * output_block() entry point of struct ofmt).  The type, size,
+ * segment and wrt are as they would be passed to ofmt->output(),
+ * with addr the address that would be pointed to by data.
+ */
+struct out_field {
+    size_t pos;                 /* offset of the field in the block */
+    enum out_type type;         /* OUT_ADDRESS or OUT_RELxADR */
+    uint64_t size;
+    int64_t addr;
+    int32_t segment, wrt;
+};
+
 /*
  * A label-lookup function.
  */
@@ -203,10 +217,13 @@ size_t string_transform(char *, size_t, char **, enum strfunc);
  * token-value structures they return, look like this.
  *
  * The return value from the scanner is always a copy of the
- * `t_type' field in the structure.
+ * `t_type' field in the structure.  For TOKEN_ID, `t_atom' is the
+ * interned identifier if the scanner has one, or NULL.
  */
+struct atom;
 struct tokenval {
     char                *t_charptr;
+    struct atom         *t_atom;
     int64_t             t_integer;
     int64_t             t_inttwo;
     enum token_type     t_type;
@@ -345,6 +362,9 @@ struct preproc_ops {
 
     /* Unwind the macro stack when printing an error message */
     void (*error_list_macros)(int severity);
+
+    /* Would error_list_macros() list anything for the current line? */
+    bool (*in_macro)(void);
 };
 
 extern const struct preproc_ops nasmpp;
@@ -652,6 +672,7 @@ typedef struct insn { /* an instruction itself */
     enum ttypes     evex_tuple;             /* Tuple type for compressed Disp8*N */
     int             evex_rm;                /* static rounding mode for AVX512 (EVEX) */
     int8_t          evex_brerop;            /* BR/ER/SAE operand position */
+    int32_t         lineno;                 /* line number in this pass, or 0 */
 } insn;
 
 enum geninfo { GI_SWITCH };
@@ -730,6 +751,30 @@ struct ofmt {
                    enum out_type type, uint64_t size,
                    int32_t segment, int32_t wrt);
 
+    /*
+     * This procedure is called by assemble() with a whole
+     * instruction at a time.  `data' holds its `len' bytes, and
+     * `fields' the `nfields' fields in it which need relocating, in
+     * order; the bytes under a field are not meaningful.  It must
+     * have the same effect as calling output() for the bytes
+     * before the first field, then the first field, and so on.
+     * Formats with nothing better to do can use
+     * generic_output_block() from outlib, which does just that.
+     */
+    void (*output_block)(int32_t segto, const uint8_t *data, size_t len,
+                         const struct out_field *fields, int nfields);
+
+    /*
+     * This procedure is called by assemble() for the repeats of a
+     * TIMES'd data directive with nothing to relocate in it.  It
+     * must have the same effect as calling output() `count' times
+     * with the `len' bytes of raw data at `data'.  segto is never
+     * NO_SEG.  generic_output_fill() from outlib does it that way,
+     * a chunk at a time.
+     */
+    void (*output_fill)(int32_t segto, const void *data, size_t len,
+                        uint64_t count);
+
     /*
      * This procedure is called once for every symbol defined in
      * the module being assembled. It gives the name and value of
@@ -1116,6 +1161,7 @@ extern int passn;               /* Actual pass number */
 
 extern bool tasm_compatible_mode;
 extern int optimizing;
+extern int nasm_jobs;           /* threads the output format may use */
 extern int globalbits;          /* 16, 32 or 64-bit mode */
 extern int globalrel;           /* default to relative addressing? */
 extern int globalbnd;           /* default to using bnd prefix? */
@@ -438,6 +438,12 @@ char *nasm_realpath(const char *rel_path);
 
 const char *prefix_name(int);
 
+/*
+ * Run fn(arg, i) for i = 0...n-1 on up to nthreads threads
+ */
+void nasm_parallel(void (*fn)(void *arg, int i), void *arg,
+                   int n, int nthreads);
+
 /*
  * Wrappers around fopen()... for future change to a dedicated structure
  */
@@ -450,6 +456,21 @@ enum file_flags {
 
 FILE *nasm_open_read(const char *filename, enum file_flags flags);
 FILE *nasm_open_write(const char *filename, enum file_flags flags);
+int nasm_close_write(FILE *f);
+int64_t nasm_file_mtime(const char *filename);
+
+/*
+ * The whole contents of a file, mapped into memory where the system
+ * allows it and read in otherwise.
+ */
+struct nasm_filemap {
+    const char  *data;
+    size_t      size;
+    bool        mapped;         /* mmap()ed, not allocated */
+};
+
+bool nasm_map_file(struct nasm_filemap *map, FILE *fp);
+void nasm_unmap_file(struct nasm_filemap *map);
 
 #define ZERO_BUF_SIZE 4096      /* Default value */
 #if defined(BUFSIZ) && (BUFSIZ > ZERO_BUF_SIZE)
@@ -202,6 +202,9 @@ struct SegmentHeaderRec {
 
 typedef struct RDFFileInfo {
     FILE *fp;                   /* file descriptor; must be open to use this struct */
+    const uint8_t *mem;         /* or else the module's contents in memory */
+    int32_t mem_len;
+    struct nasm_filemap *map;   /* the whole file, if mapped by rdfopen() */
     int rdoff_ver;              /* should be 1; any higher => not guaranteed to work */
     int32_t header_len;
     int32_t header_ofs;
@@ -229,6 +232,7 @@ typedef struct memorybuffer {
 
 typedef struct {
     memorybuffer *buf;          /* buffer containing header records */
+    memorybuffer *last;         /* its last block, where records go */
     int nsegments;              /* number of segments to be written */
     int32_t seglength;             /* total length of all the segments */
 } rdf_headerbuf;
@@ -267,9 +271,12 @@ char *translatesegmenttype(uint16_t type);
 /* RDOFF file manipulation functions */
 int rdfopen(rdffile * f, const char *name);
 int rdfopenhere(rdffile * f, FILE * fp, int *refcount, const char *name);
+int rdfopenmem(rdffile * f, const void *data, int32_t len, int *refcount,
+               const char *name);
 int rdfclose(rdffile * f);
 int rdffindsegment(rdffile * f, int segno);
 int rdfloadseg(rdffile * f, int segment, void *buffer);
+int rdfmapseg(rdffile * f, int segment);
 rdfheaderrec *rdfgetheaderrec(rdffile * f);     /* returns static storage */
 void rdfheaderrewind(rdffile * f);      /* back to start of header */
 void rdfperror(const char *app, const char *name);
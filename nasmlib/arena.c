@@ -0,0 +1,114 @@
+/* ----------------------------------------------------------------------- *
+ *
+ *   Copyright 1996-2016 The NASM Authors - All Rights Reserved
+ *   See the file AUTHORS included with the NASM distribution for
+ *   the specific copyright holders.
+ *
+ *   Redistribution and use in source and binary forms, with or without
+ *   modification, are permitted provided that the following
+ *   conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *
+ *     THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ *     CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *     INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ *     MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ *     DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ *     CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *     SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ *     NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *     LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ *     HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *     CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ *     OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ *     EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * ----------------------------------------------------------------------- */
+
+/*
+ * arena.c	bump allocator for temporaries with a common lifetime
+ */
+
+#include "compiler.h"
+#include "nasmlib.h"
+#include "arena.h"
+
+/* Every allocation is aligned to this */
+#define ARENA_ALIGN	16
+#define ARENA_ROUND(x)	(((x) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+/* Standard block size; bigger requests get a block of their own */
+#define ARENA_BLKLEN	((size_t)1 << 16)
+
+struct arena_block {
+    struct arena_block *next;
+    size_t size;                /* Usable bytes after the header */
+};
+
+#define ARENA_HDRLEN	ARENA_ROUND(sizeof(struct arena_block))
+
+static void arena_extend(struct arena *a, size_t size)
+{
+    struct arena_block *b;
+
+    if (size <= ARENA_BLKLEN && a->spare) {
+        b = a->spare;
+        a->spare = b->next;
+    } else {
+        if (size < ARENA_BLKLEN)
+            size = ARENA_BLKLEN;
+        b = nasm_malloc(ARENA_HDRLEN + size);
+        b->size = size;
+    }
+
+    b->next = a->blocks;
+    a->blocks = b;
+    a->ptr = (char *)b + ARENA_HDRLEN;
+    a->end = a->ptr + b->size;
+}
+
+void *arena_alloc(struct arena *a, size_t size)
+{
+    void *p;
+
+    size = size ? ARENA_ROUND(size) : ARENA_ALIGN;
+    if (size > (size_t)(a->end - a->ptr))
+        arena_extend(a, size);
+
+    p = a->ptr;
+    a->ptr += size;
+    return p;
+}
+
+void arena_reset(struct arena *a)
+{
+    struct arena_block *b;
+
+    while ((b = a->blocks)) {
+        a->blocks = b->next;
+        if (b->size == ARENA_BLKLEN) {
+            b->next = a->spare;
+            a->spare = b;
+        } else {
+            nasm_free(b);
+        }
+    }
+    a->ptr = a->end = NULL;
+}
+
+void arena_free(struct arena *a)
+{
+    struct arena_block *b;
+
+    arena_reset(a);
+    while ((b = a->spare)) {
+        a->spare = b->next;
+        nasm_free(b);
+    }
+}
@@ -0,0 +1,120 @@
+/* ----------------------------------------------------------------------- *
+ *
+ *   Copyright 1996-2016 The NASM Authors - All Rights Reserved
+ *   See the file AUTHORS included with the NASM distribution for
+ *   the specific copyright holders.
+ *
+ *   Redistribution and use in source and binary forms, with or without
+ *   modification, are permitted provided that the following
+ *   conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *
+ *     THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ *     CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *     INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ *     MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ *     DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ *     CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *     SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ *     NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *     LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ *     HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *     CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ *     OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ *     EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * ----------------------------------------------------------------------- */
+
+/*
+ * atom.c	interned identifiers
+ */
+
+#include "compiler.h"
+
+#include <string.h>
+
+#include "nasmlib.h"
+#include "hashtbl.h"
+#include "arena.h"
+#include "atom.h"
+
+#define ATOM_INIT_SIZE	1024            /* must be a power of 2 */
+#define atom_max_load(size)	((size) >> 1)
+
+static struct arena atom_store;         /* the atoms and their text */
+static struct atom **atoms;             /* open-addressed by hash */
+static size_t atoms_size, atoms_load;
+
+static void atom_expand(void)
+{
+    struct atom **newtbl, *a;
+    size_t newsize, mask, pos, inc, i;
+
+    newsize = atoms_size ? atoms_size << 1 : ATOM_INIT_SIZE;
+    newtbl = nasm_zalloc(newsize * sizeof(*newtbl));
+    mask = newsize - 1;
+
+    for (i = 0; i < atoms_size; i++) {
+        if (!(a = atoms[i]))
+            continue;
+        pos = a->hash & mask;
+        inc = ((a->hash >> 32) & mask) | 1;
+        while (newtbl[pos])
+            pos = (pos + inc) & mask;
+        newtbl[pos] = a;
+    }
+
+    nasm_free(atoms);
+    atoms = newtbl;
+    atoms_size = newsize;
+}
+
+struct atom *atom_get(const char *str, size_t len)
+{
+    uint64_t hash = crc64b(CRC64_INIT, str, len);
+    size_t mask, pos, inc;
+    struct atom *a;
+    char *text;
+
+    if (atoms_load >= atom_max_load(atoms_size))
+        atom_expand();
+
+    mask = atoms_size - 1;
+    pos = hash & mask;
+    inc = ((hash >> 32) & mask) | 1;
+
+    while ((a = atoms[pos])) {
+        if (a->hash == hash && a->len == len && !memcmp(a->str, str, len))
+            return a;
+        pos = (pos + inc) & mask;
+    }
+
+    a = arena_alloc(&atom_store, sizeof(struct atom));
+    text = arena_alloc(&atom_store, len + 1);
+    memcpy(text, str, len);
+    text[len] = '\0';
+
+    a->str = text;
+    a->len = len;
+    a->hash = hash;
+    a->hashi = crc64ib(CRC64_INIT, str, len);
+    a->label = NULL;
+
+    atoms[pos] = a;
+    atoms_load++;
+    return a;
+}
+
+void atom_cleanup(void)
+{
+    arena_free(&atom_store);
+    nasm_free(atoms);
+    atoms = NULL;
+    atoms_size = atoms_load = 0;
+}
@@ -42,6 +42,12 @@
 #ifdef HAVE_UNISTD_H
 # include <unistd.h>
 #endif
+#ifdef HAVE_SYS_MMAN_H
+# include <sys/mman.h>
+#endif
+#ifdef HAVE_SYS_STAT_H
+# include <sys/stat.h>
+#endif
 
 /* Missing fseeko/ftello */
 #ifndef HAVE_FSEEKO
@@ -68,6 +74,14 @@
 # endif
 #endif
 
+/* Can we map files rather than read them in? */
+#if defined(HAVE_MMAP) && defined(HAVE_FILENO) && defined(HAVE_SYS_MMAN_H)
+# define nasm_mmap 1
+# ifndef MAP_FAILED
+#  define MAP_FAILED ((void *)-1)
+# endif
+#endif
+
 void nasm_write(const void *ptr, size_t size, FILE *f)
 {
     size_t n = fwrite(ptr, 1, size, f);
@@ -177,6 +191,18 @@ FILE *nasm_open_read(const char *filename, enum file_flags flags)
     return f;
 }
 
+/*
+ * A binary output file is written through a big buffer, so that the
+ * output formats can emit headers, symbols and relocations a field
+ * at a time and still have the file reach the OS in a few large
+ * writes.  One such file is open at a time; nasm_close_write()
+ * releases the buffer.
+ */
+#define WRITE_BUF_SIZE ((size_t)1 << 20)
+
+static FILE *wbuf_file;
+static char *wbuf;
+
 FILE *nasm_open_write(const char *filename, enum file_flags flags)
 {
     FILE *f;
@@ -186,5 +212,120 @@ FILE *nasm_open_write(const char *filename, enum file_flags flags)
         nasm_fatal(ERR_NOFILE, "unable to open output file: `%s': %s",
                    filename, strerror(errno));
 
+    if (f && !(flags & NF_TEXT) && !wbuf_file) {
+        wbuf = nasm_malloc(WRITE_BUF_SIZE);
+        if (!setvbuf(f, wbuf, _IOFBF, WRITE_BUF_SIZE)) {
+            wbuf_file = f;
+        } else {
+            nasm_free(wbuf);
+            wbuf = NULL;
+        }
+    }
+
     return f;
 }
+
+int nasm_close_write(FILE *f)
+{
+    bool buffered = (f == wbuf_file);
+    int err = fclose(f);
+
+    if (buffered) {
+        nasm_free(wbuf);
+        wbuf = NULL;
+        wbuf_file = NULL;
+    }
+
+    return err;
+}
+
+/*
+ * The modification time of a file, or -1 if it can't be found out
+ */
+int64_t nasm_file_mtime(const char *filename)
+{
+#if defined(HAVE_STAT) && defined(HAVE_SYS_STAT_H)
+    struct stat st;
+
+    if (!stat(filename, &st))
+        return st.st_mtime;
+#else
+    (void)filename;
+#endif
+    return -1;
+}
+
+/*
+ * Get the whole contents of an open file, from the current position
+ * on.  The file can be closed afterwards.  Returns false on error.
+ */
+bool nasm_map_file(struct nasm_filemap *map, FILE *fp)
+{
+    off_t pos, end;
+    size_t size, n;
+    char *buf;
+
+    map->data   = NULL;
+    map->size   = 0;
+    map->mapped = false;
+
+    pos = ftello(fp);
+    end = -1;
+    if (pos >= 0 && !fseeko(fp, 0, SEEK_END)) {
+        end = ftello(fp);
+        if (fseeko(fp, pos, SEEK_SET))
+            return false;
+    }
+
+#ifdef nasm_mmap
+    if (end > pos && pos == 0 && (uint64_t)end <= (size_t)-1) {
+        void *p = mmap(NULL, (size_t)end, PROT_READ, MAP_PRIVATE,
+                       fileno(fp), 0);
+        if (p != MAP_FAILED) {
+            map->data   = p;
+            map->size   = (size_t)end;
+            map->mapped = true;
+            return true;
+        }
+    }
+#endif
+
+    /*
+     * Read it in.  The size is only a hint, since text mode or a file
+     * still being written to can make it anything.
+     */
+    size = (end > pos && (uint64_t)(end - pos) < (size_t)-1) ?
+        (size_t)(end - pos) + 1 : BUFSIZ;
+    buf = nasm_malloc(size);
+    for (;;) {
+        n = fread(buf + map->size, 1, size - map->size, fp);
+        map->size += n;
+        if (map->size < size)
+            break;
+        size <<= 1;
+        buf = nasm_realloc(buf, size);
+    }
+
+    if (ferror(fp)) {
+        nasm_free(buf);
+        map->size = 0;
+        return false;
+    }
+
+    map->data = buf;
+    return true;
+}
+
+void nasm_unmap_file(struct nasm_filemap *map)
+{
+#ifdef nasm_mmap
+    if (map->mapped)
+        munmap((void *)map->data, map->size);
+    else
+#endif
+        nasm_free((void *)map->data);
+
+    map->data   = NULL;
+    map->size   = 0;
+    map->mapped = false;
+}
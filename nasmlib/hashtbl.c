@@ -111,10 +111,19 @@ void **hash_find(struct hash_table *head, const char *key,
  */
 void **hash_findi(struct hash_table *head, const char *key,
                   struct hash_insert *insert)
+{
+    return hash_findih(head, key, hash_calci(key), insert);
+}
+
+/*
+ * Same as hash_findi, for a caller which already has the hash of the
+ * key, i.e. crc64i(CRC64_INIT, key).
+ */
+void **hash_findih(struct hash_table *head, const char *key,
+                   uint64_t hash, struct hash_insert *insert)
 {
     struct hash_tbl_node *np;
     struct hash_tbl_node *tbl = head->table;
-    uint64_t hash = hash_calci(key);
     size_t mask = hash_mask(head->size);
     size_t pos = hash_pos(hash, mask);
     size_t inc = hash_inc(hash, mask);
@@ -0,0 +1,127 @@
+/* ----------------------------------------------------------------------- *
+ *
+ *   Copyright 1996-2016 The NASM Authors - All Rights Reserved
+ *   See the file AUTHORS included with the NASM distribution for
+ *   the specific copyright holders.
+ *
+ *   Redistribution and use in source and binary forms, with or without
+ *   modification, are permitted provided that the following
+ *   conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *
+ *     THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ *     CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *     INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ *     MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ *     DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ *     CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *     SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ *     NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *     LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ *     HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *     CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ *     OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ *     EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * ----------------------------------------------------------------------- */
+
+/*
+ * parallel.c	run independent jobs on several threads
+ *
+ * Without thread support everything simply runs in the caller.
+ */
+
+#include "compiler.h"
+#include "nasmlib.h"
+
+#if defined(HAVE_PTHREAD_H) && defined(HAVE_PTHREAD_CREATE)
+# include <pthread.h>
+# define nasm_threads 1
+#endif
+
+struct parallel {
+    void (*fn)(void *arg, int i);
+    void *arg;
+    int n;
+    int nthreads;
+};
+
+struct parallel_thread {
+    const struct parallel *par;
+    int first;
+};
+
+/* Each thread takes every nthreads-th job */
+static void parallel_jobs(const struct parallel *par, int first)
+{
+    int i;
+
+    for (i = first; i < par->n; i += par->nthreads)
+        par->fn(par->arg, i);
+}
+
+#ifdef nasm_threads
+static void *parallel_thread(void *arg)
+{
+    const struct parallel_thread *pt = arg;
+
+    parallel_jobs(pt->par, pt->first);
+    return NULL;
+}
+#endif
+
+/*
+ * Call fn(arg, i) for i = 0...n-1, spread over up to nthreads
+ * threads, and return when all of them are done.
+ */
+void nasm_parallel(void (*fn)(void *arg, int i), void *arg,
+                   int n, int nthreads)
+{
+    struct parallel par;
+#ifdef nasm_threads
+    struct parallel_thread *pt;
+    pthread_t *tids;
+    int t, started;
+#endif
+
+    par.fn       = fn;
+    par.arg      = arg;
+    par.n        = n;
+    par.nthreads = nthreads < n ? nthreads : n;
+    if (par.nthreads < 1)
+        par.nthreads = 1;
+
+#ifdef nasm_threads
+    if (par.nthreads > 1) {
+        pt   = nasm_malloc(par.nthreads * sizeof(*pt));
+        tids = nasm_malloc(par.nthreads * sizeof(*tids));
+
+        /* If a thread can't be started, its jobs run in this one */
+        for (t = 1; t < par.nthreads; t++) {
+            pt[t].par   = &par;
+            pt[t].first = t;
+            if (pthread_create(&tids[t], NULL, parallel_thread, &pt[t]))
+                break;
+        }
+        started = t;
+
+        parallel_jobs(&par, 0);
+        for (t = started; t < par.nthreads; t++)
+            parallel_jobs(&par, t);
+        for (t = 1; t < started; t++)
+            pthread_join(tids[t], NULL);
+
+        nasm_free(pt);
+        nasm_free(tids);
+        return;
+    }
+#endif
+
+    parallel_jobs(&par, 0);
+}
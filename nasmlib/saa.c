@@ -149,6 +149,53 @@ void saa_wbytes(struct SAA *s, const void *data, size_t len)
     }
 }
 
+/*
+ * Write count copies of the len bytes at data; a single repeated byte
+ * is just a memset.
+ */
+void saa_wfill(struct SAA *s, const void *data, size_t len, size_t count)
+{
+    const char *d = data;
+    size_t total = len * count;
+    size_t phase = 0;
+
+    while (total) {
+        size_t l = s->blk_len - s->wpos;
+        if (l > total)
+            l = total;
+        if (l) {
+            char *p = *s->wblk + s->wpos;
+
+            if (len == 1) {
+                memset(p, *d, l);
+            } else {
+                size_t n = l;
+                while (n) {
+                    size_t m = len - phase;
+                    if (m > n)
+                        m = n;
+                    memcpy(p, d + phase, m);
+                    p += m;
+                    n -= m;
+                    phase = (phase + m) % len;
+                }
+            }
+            s->wpos += l;
+            s->wptr += l;
+            total -= l;
+
+            if (s->datalen < s->wptr)
+                s->datalen = s->wptr;
+        }
+        if (total) {
+            if (s->wptr >= s->length)
+                saa_extend(s);
+            s->wblk++;
+            s->wpos = 0;
+        }
+    }
+}
+
 void saa_rewind(struct SAA *s)
 {
     s->rblk = s->blk_ptrs;
@@ -437,10 +437,7 @@ static void register_reloc(struct coff_Section *const sect,
     struct coff_Reloc *r;
     struct coff_Section *sec;
 
-    r = *sect->tail = nasm_malloc(sizeof(struct coff_Reloc));
-    sect->tail = &r->next;
-    r->next = NULL;
-    sect->nrelocs++;
+    r = coff_new_reloc(sect);
 
     r->address = addr;
     r->symbase = SECT_SYMBOLS;
@@ -461,17 +458,9 @@ static void register_reloc(struct coff_Section *const sect,
         r->symbol++;
         if (s->strpos == -1 && !strcmp(sym, s->name)) {
             return;
-        } else if (s->strpos != -1) {
-            int res;
-            char *symname;
-
-            symname = nasm_malloc(s->namlen + 1);
-            saa_fread(coff_strs, s->strpos-4, symname, s->namlen);
-            symname[s->namlen] = '\0';
-            res = strcmp(sym, symname);
-            nasm_free(symname);
-            if (!res)
-                return;
+        } else if (s->strpos != -1 &&
+                   !strcmp(sym, strtab_string(&coff_strs, s->strpos))) {
+            return;
         }
     }
     nasm_panic(0, "codeview: relocation for unregistered symbol: %s", sym);
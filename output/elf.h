@@ -160,6 +160,7 @@
 #define SHT_REL         9
 #define SHT_SHLIB       10
 #define SHT_DYNSYM      11
+#define SHT_SYMTAB_SHNDX 18
 #define SHT_NUM         12
 #define SHT_LOPROC      0x70000000
 #define SHT_HIPROC      0x7fffffff
@@ -185,6 +186,7 @@
 #define SHN_HIPROC      0xff1f
 #define SHN_ABS         0xfff1
 #define SHN_COMMON      0xfff2
+#define SHN_XINDEX      0xffff
 #define SHN_HIRESERVE   0xffff
 
 /* Section align flag */
@@ -916,6 +916,8 @@ const struct ofmt of_aout = {
     aout_init,
     null_setinfo,
     aout_out,
+    generic_output_block,
+    generic_output_fill,
     aout_deflabel,
     aout_section_names,
     null_sectalign,
@@ -940,6 +942,8 @@ const struct ofmt of_aoutb = {
     aoutb_init,
     null_setinfo,
     aout_out,
+    generic_output_block,
+    generic_output_fill,
     aout_deflabel,
     aout_section_names,
     null_sectalign,
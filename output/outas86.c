@@ -637,6 +637,8 @@ const struct ofmt of_as86 = {
     as86_init,
     null_setinfo,
     as86_out,
+    generic_output_block,
+    generic_output_fill,
     as86_deflabel,
     as86_section_names,
     null_sectalign,
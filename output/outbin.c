@@ -722,6 +722,33 @@ static void bin_cleanup(void)
     }
 }
 
+/*
+ * The section output of the given type to segment segto goes into
+ */
+static struct Section *bin_out_section(int32_t segto, enum out_type type)
+{
+    struct Section *s;
+
+    /* Find the segment we are targeting. */
+    s = find_section_by_index(segto);
+    if (!s)
+        nasm_panic(0, "code directed to nonexistent segment?");
+
+    /* "Smart" section-type adaptation code. */
+    if (!(s->flags & TYPE_DEFINED)) {
+        if (type == OUT_RESERVE)
+            s->flags |= TYPE_DEFINED | TYPE_NOBITS;
+        else
+            s->flags |= TYPE_DEFINED | TYPE_PROGBITS;
+    }
+
+    if ((s->flags & TYPE_NOBITS) && (type != OUT_RESERVE))
+        nasm_error(ERR_WARNING, "attempt to initialize memory in a"
+              " nobits section: ignored");
+
+    return s;
+}
+
 static void bin_out(int32_t segto, const void *data,
 		    enum out_type type, uint64_t size,
                     int32_t segment, int32_t wrt)
@@ -742,22 +769,7 @@ static void bin_out(int32_t segto, const void *data,
         return;
     }
 
-    /* Find the segment we are targeting. */
-    s = find_section_by_index(segto);
-    if (!s)
-        nasm_panic(0, "code directed to nonexistent segment?");
-
-    /* "Smart" section-type adaptation code. */
-    if (!(s->flags & TYPE_DEFINED)) {
-        if (type == OUT_RESERVE)
-            s->flags |= TYPE_DEFINED | TYPE_NOBITS;
-        else
-            s->flags |= TYPE_DEFINED | TYPE_PROGBITS;
-    }
-
-    if ((s->flags & TYPE_NOBITS) && (type != OUT_RESERVE))
-        nasm_error(ERR_WARNING, "attempt to initialize memory in a"
-              " nobits section: ignored");
+    s = bin_out_section(segto, type);
 
     switch (type) {
     case OUT_ADDRESS:
@@ -835,6 +847,16 @@ static void bin_out(int32_t segto, const void *data,
     s->length += size;
 }
 
+static void bin_out_fill(int32_t segto, const void *data, size_t len,
+                         uint64_t count)
+{
+    struct Section *s = bin_out_section(segto, OUT_RAWDATA);
+
+    if (s->flags & TYPE_PROGBITS)
+        saa_wfill(s->contents, data, len, count);
+    s->length += len * count;
+}
+
 static void bin_deflabel(char *name, int32_t segment, int64_t offset,
                          int is_global, char *special)
 {
@@ -1663,6 +1685,8 @@ const struct ofmt of_bin = {
     bin_init,
     bin_set_info,
     bin_out,
+    generic_output_block,
+    bin_out_fill,
     bin_deflabel,
     bin_secname,
     bin_sectalign,
@@ -1683,6 +1707,8 @@ const struct ofmt of_ith = {
     ith_init,
     bin_set_info,
     bin_out,
+    generic_output_block,
+    bin_out_fill,
     bin_deflabel,
     bin_secname,
     bin_sectalign,
@@ -1703,6 +1729,8 @@ const struct ofmt of_srec = {
     srec_init,
     bin_set_info,
     bin_out,
+    generic_output_block,
+    bin_out_fill,
     bin_deflabel,
     bin_secname,
     bin_sectalign,
@@ -163,9 +163,11 @@ char coff_outfile[FILENAME_MAX];
 #define RDATA_FLAGS     ((win32 | win64) ? RDATA_FLAGS_WIN : RDATA_FLAGS_DOS)
 
 #define SECT_DELTA 32
+#define RELOC_DELTA 64
 struct coff_Section **coff_sects;
 static int sectlen;
 int coff_nsects;
+static struct segmap sectmap;
 
 struct SAA *coff_syms;
 uint32_t coff_nsyms;
@@ -176,8 +178,7 @@ static int initsym;
 
 static struct RAA *bsym, *symval;
 
-struct SAA *coff_strs;
-static uint32_t strslen;
+struct strtab coff_strs;
 
 static void coff_gen_init(void);
 static void coff_sect_write(struct coff_Section *, const uint8_t *, uint32_t);
@@ -217,14 +218,12 @@ static void coff_gen_init(void)
     coff_nsyms = 0;
     bsym = raa_init();
     symval = raa_init();
-    coff_strs = saa_init(1);
-    strslen = 0;
+    strtab_init(&coff_strs, 4);     /* after the table length */
     def_seg = seg_alloc();
 }
 
 static void coff_cleanup(void)
 {
-    struct coff_Reloc *r;
     int i;
 
     dfmt->cleanup();
@@ -233,19 +232,16 @@ static void coff_cleanup(void)
     for (i = 0; i < coff_nsects; i++) {
         if (coff_sects[i]->data)
             saa_free(coff_sects[i]->data);
-        while (coff_sects[i]->head) {
-            r = coff_sects[i]->head;
-            coff_sects[i]->head = coff_sects[i]->head->next;
-            nasm_free(r);
-        }
+        nasm_free(coff_sects[i]->relocs);
         nasm_free(coff_sects[i]->name);
         nasm_free(coff_sects[i]);
     }
     nasm_free(coff_sects);
+    segmap_free(&sectmap);
     saa_free(coff_syms);
     raa_free(bsym);
     raa_free(symval);
-    saa_free(coff_strs);
+    strtab_free(&coff_strs);
 }
 
 int coff_make_section(char *name, uint32_t flags)
@@ -257,7 +253,6 @@ int coff_make_section(char *name, uint32_t flags)
 
     if (flags != BSS_FLAGS)
         s->data = saa_init(1);
-    s->tail = &s->head;
     if (!strcmp(name, ".text"))
         s->index = def_seg;
     else
@@ -266,9 +261,7 @@ int coff_make_section(char *name, uint32_t flags)
     namelen = strlen(name);
     if (namelen > 8) {
         if (win32 || win64) {
-            s->namepos = strslen + 4;
-            saa_wbytes(coff_strs, name, namelen + 1);
-            strslen += namelen + 1;
+            s->namepos = strtab_add(&coff_strs, name);
         } else {
             namelen = 8;
         }
@@ -282,6 +275,7 @@ int coff_make_section(char *name, uint32_t flags)
         sectlen += SECT_DELTA;
         coff_sects = nasm_realloc(coff_sects, sectlen * sizeof(*coff_sects));
     }
+    segmap_add(&sectmap, s->index, coff_nsects);
     coff_sects[coff_nsects++] = s;
 
     return coff_nsects - 1;
@@ -451,7 +445,7 @@ static int32_t coff_section_names(char *name, int pass, int *bits)
 static void coff_deflabel(char *name, int32_t segment, int64_t offset,
                           int is_global, char *special)
 {
-    int pos = strslen + 4;
+    int32_t pos = -1;
     struct coff_Symbol *sym;
 
     if (special)
@@ -464,17 +458,12 @@ static void coff_deflabel(char *name, int32_t segment, int64_t offset,
         return;
     }
 
-    if (strlen(name) > 8) {
-        size_t nlen = strlen(name)+1;
-        saa_wbytes(coff_strs, name, nlen);
-        strslen += nlen;
-    } else
-        pos = -1;
+    if (strlen(name) > 8)
+        pos = strtab_add(&coff_strs, name);
 
     sym = saa_wstruct(coff_syms);
 
     sym->strpos = pos;
-    sym->namlen = strlen(name);
     if (pos == -1)
         strcpy(sym->name, name);
     sym->is_global = !!is_global;
@@ -482,13 +471,8 @@ static void coff_deflabel(char *name, int32_t segment, int64_t offset,
     if (segment == NO_SEG)
         sym->section = -1;      /* absolute symbol */
     else {
-        int i;
-        sym->section = 0;
-        for (i = 0; i < coff_nsects; i++)
-            if (segment == coff_sects[i]->index) {
-                sym->section = i + 1;
-                break;
-            }
+        int i = segmap_find(&sectmap, segment);
+        sym->section = i + 1;
         if (!sym->section)
             sym->is_global = true;
     }
@@ -510,35 +494,41 @@ static void coff_deflabel(char *name, int32_t segment, int64_t offset,
     coff_nsyms++;
 }
 
+/*
+ * Relocations are kept in a growable array per section.
+ */
+struct coff_Reloc *coff_new_reloc(struct coff_Section *sect)
+{
+    if (sect->nrelocs >= sect->relsize) {
+        sect->relsize = sect->relsize ? sect->relsize << 1 : RELOC_DELTA;
+        sect->relocs = nasm_realloc(sect->relocs,
+                                    sect->relsize * sizeof(*sect->relocs));
+    }
+    return &sect->relocs[sect->nrelocs++];
+}
+
 static int32_t coff_add_reloc(struct coff_Section *sect, int32_t segment,
                               int16_t type)
 {
     struct coff_Reloc *r;
 
-    r = *sect->tail = nasm_malloc(sizeof(struct coff_Reloc));
-    sect->tail = &r->next;
-    r->next = NULL;
+    r = coff_new_reloc(sect);
 
     r->address = sect->len;
     if (segment == NO_SEG) {
         r->symbol = 0, r->symbase = ABS_SYMBOL;
     } else {
-        int i;
-        r->symbase = REAL_SYMBOLS;
-        for (i = 0; i < coff_nsects; i++) {
-            if (segment == coff_sects[i]->index) {
-                r->symbol = i * 2;
-                r->symbase = SECT_SYMBOLS;
-                break;
-            }
-        }
-        if (r->symbase == REAL_SYMBOLS)
+        int i = segmap_find(&sectmap, segment);
+        if (i >= 0) {
+            r->symbol = i * 2;
+            r->symbase = SECT_SYMBOLS;
+        } else {
             r->symbol = raa_read(bsym, segment);
+            r->symbase = REAL_SYMBOLS;
+        }
     }
     r->type = type;
 
-    sect->nrelocs++;
-
     /*
      * Return the fixup for standard COFF common variables.
      */
@@ -548,13 +538,32 @@ static int32_t coff_add_reloc(struct coff_Section *sect, int32_t segment,
     return 0;
 }
 
+/*
+ * The section output to segment segto goes into
+ */
+static struct coff_Section *coff_out_section(int32_t segto)
+{
+    struct coff_Section *s;
+    int i;
+
+    i = segmap_find(&sectmap, segto);
+    s = i >= 0 ? coff_sects[i] : NULL;
+    if (!s) {
+        int tempint;            /* ignored */
+        if (segto != coff_section_names(".text", 2, &tempint))
+            nasm_panic(0, "strange segment conditions in COFF driver");
+        else
+            s = coff_sects[coff_nsects - 1];
+    }
+    return s;
+}
+
 static void coff_out(int32_t segto, const void *data,
                      enum out_type type, uint64_t size,
                      int32_t segment, int32_t wrt)
 {
     struct coff_Section *s;
     uint8_t mydata[8], *p;
-    int i;
 
     if (wrt != NO_SEG && !win64) {
         wrt = NO_SEG;           /* continue to do _something_ */
@@ -571,20 +580,7 @@ static void coff_out(int32_t segto, const void *data,
         return;
     }
 
-    s = NULL;
-    for (i = 0; i < coff_nsects; i++) {
-        if (segto == coff_sects[i]->index) {
-            s = coff_sects[i];
-            break;
-        }
-    }
-    if (!s) {
-        int tempint;            /* ignored */
-        if (segto != coff_section_names(".text", 2, &tempint))
-            nasm_panic(0, "strange segment conditions in COFF driver");
-        else
-            s = coff_sects[coff_nsects - 1];
-    }
+    s = coff_out_section(segto);
 
     /* magically default to 'wrt ..imagebase' in .pdata and .xdata */
     if (win64 && wrt == NO_SEG) {
@@ -696,6 +692,33 @@ static void coff_out(int32_t segto, const void *data,
     }
 }
 
+static void coff_out_fill(int32_t segto, const void *data, size_t len,
+                          uint64_t count)
+{
+    struct coff_Section *s = coff_out_section(segto);
+    uint64_t size = len * count;
+
+    if (!s->data) {
+        nasm_error(ERR_WARNING, "attempt to initialize memory in"
+              " BSS section `%s': ignored", s->name);
+        s->len += size;
+        return;
+    }
+
+    if (dfmt && dfmt->debug_output) {
+        struct coff_DebugInfo dinfo;
+        dinfo.segto = segto;
+        dinfo.seg = NO_SEG;
+        dinfo.section = s;
+        dinfo.size = size;
+
+        dfmt->debug_output(OUT_RAWDATA, &dinfo);
+    }
+
+    saa_wfill(s->data, data, len, count);
+    s->len += size;
+}
+
 static void coff_sect_write(struct coff_Section *sect,
                             const uint8_t *data, uint32_t len)
 {
@@ -825,19 +848,10 @@ static int coff_directives(enum directives directive, char *value, int pass)
                 struct coff_Symbol *sym = saa_rstruct(coff_syms);
                 bool equals;
 
-                /*
-                 * sym->strpos is biased by 4, because symbol
-                 * table is prefixed with table length
-                 */
-                if (sym->strpos >=4) {
-                    char *name = nasm_malloc(sym->namlen+1);
-                    saa_fread(coff_strs, sym->strpos-4, name, sym->namlen);
-                    name[sym->namlen] = '\0';
-                    equals = !strcmp(value,name);
-                    nasm_free(name);
-                } else {
+                if (sym->strpos != -1)
+                    equals = !strcmp(value, strtab_string(&coff_strs, sym->strpos));
+                else
                     equals = !strcmp(value,sym->name);
-                }
 
                 if (equals) {
                     /*
@@ -886,6 +900,7 @@ static inline void coff_adjust_relocs(struct coff_Section *s)
 static void coff_write(void)
 {
     int32_t pos, sympos, vsize;
+    uint8_t *p;
     int i;
 
     /* fill in the .drectve section with -export's */
@@ -925,6 +940,14 @@ static void coff_write(void)
     }
     sympos = pos;
 
+    /*
+     * All the names are in by now, so the string table can be laid
+     * out; it starts with its own length.
+     */
+    strtab_finalize(&coff_strs);
+    p = (uint8_t *)coff_strs.data;
+    WRITELONG(p, coff_strs.len);
+
     /*
      * Output the COFF header.
      */
@@ -965,8 +988,7 @@ static void coff_write(void)
      * Output the symbol and string tables.
      */
     coff_write_symbols();
-    fwriteint32_t(strslen + 4, ofile);     /* length includes length count */
-    saa_fpwrite(coff_strs, ofile);
+    nasm_write(coff_strs.data, coff_strs.len, ofile);
 }
 
 static void coff_section_header(char *name, int32_t namepos, int32_t vsize,
@@ -974,19 +996,19 @@ static void coff_section_header(char *name, int32_t namepos, int32_t vsize,
                                 int32_t relpos, int nrelocs, int32_t flags)
 {
     char padname[8];
+    uint8_t shdr[40], *p = shdr;
 
     (void)vsize;
 
     if (namepos == -1) {
         strncpy(padname, name, 8);
-        nasm_write(padname, 8, ofile);
     } else {
         /*
          * If name is longer than 8 bytes, write '/' followed
          * by offset into the strings table represented as
          * decimal number.
          */
-        namepos = namepos % 100000000;
+        namepos = strtab_offset(&coff_strs, namepos) % 100000000;
         padname[0] = '/';
         padname[1] = '0' + (namepos / 1000000);
         namepos = namepos % 1000000;
@@ -1001,15 +1023,16 @@ static void coff_section_header(char *name, int32_t namepos, int32_t vsize,
         padname[6] = '0' + (namepos / 10);
         namepos = namepos % 10;
         padname[7] = '0' + (namepos);
-        nasm_write(padname, 8, ofile);
     }
+    memcpy(p, padname, 8);
+    p += 8;
 
-    fwriteint32_t(0,            ofile); /* Virtual size field - set to 0 or vsize */
-    fwriteint32_t(0L,           ofile); /* RVA/offset - we ignore */
-    fwriteint32_t(datalen,      ofile);
-    fwriteint32_t(datapos,      ofile);
-    fwriteint32_t(relpos,       ofile);
-    fwriteint32_t(0L,           ofile); /* no line numbers - we don't do 'em */
+    WRITELONG(p, 0);            /* Virtual size field - set to 0 or vsize */
+    WRITELONG(p, 0L);           /* RVA/offset - we ignore */
+    WRITELONG(p, datalen);
+    WRITELONG(p, datapos);
+    WRITELONG(p, relpos);
+    WRITELONG(p, 0L);           /* no line numbers - we don't do 'em */
 
     /*
      * a special case -- if there are too many relocs
@@ -1018,54 +1041,70 @@ static void coff_section_header(char *name, int32_t namepos, int32_t vsize,
      * relocation
      */
     if (flags & IMAGE_SCN_LNK_NRELOC_OVFL)
-        fwriteint16_t(IMAGE_SCN_MAX_RELOC, ofile);
+        WRITESHORT(p, IMAGE_SCN_MAX_RELOC);
     else
-        fwriteint16_t(nrelocs,  ofile);
+        WRITESHORT(p, nrelocs);
 
-    fwriteint16_t(0,            ofile); /* again, no line numbers */
-    fwriteint32_t(flags,        ofile);
+    WRITESHORT(p, 0);           /* again, no line numbers */
+    WRITELONG(p, flags);
+
+    nasm_write(shdr, p - shdr, ofile);
 }
 
 static void coff_write_relocs(struct coff_Section *s)
 {
-    struct coff_Reloc *r;
+    const struct coff_Reloc *r = s->relocs;
+    uint8_t buf[10 * 256], *p;
+    int n = s->nrelocs;
 
     /* a real number of relocations if needed */
     if (s->flags & IMAGE_SCN_LNK_NRELOC_OVFL) {
         fwriteint32_t(s->nrelocs, ofile);
         fwriteint32_t(0, ofile);
         fwriteint16_t(0, ofile);
+        n--;                    /* that entry isn't in relocs[] */
     }
 
-    for (r = s->head; r; r = r->next) {
-        fwriteint32_t(r->address, ofile);
-        fwriteint32_t(r->symbol + (r->symbase == REAL_SYMBOLS ? initsym :
-                                   r->symbase == ABS_SYMBOL   ? initsym - 1 :
-                                   r->symbase == SECT_SYMBOLS ? 2 : 0),
-                      ofile);
-        fwriteint16_t(r->type, ofile);
+    /* 10-byte entries, written out a buffer at a time */
+    p = buf;
+    for (; n; n--, r++) {
+        WRITELONG(p, r->address);
+        WRITELONG(p, r->symbol + (r->symbase == REAL_SYMBOLS ? initsym :
+                                  r->symbase == ABS_SYMBOL   ? initsym - 1 :
+                                  r->symbase == SECT_SYMBOLS ? 2 : 0));
+        WRITESHORT(p, r->type);
+        if (p == buf + sizeof(buf)) {
+            nasm_write(buf, sizeof(buf), ofile);
+            p = buf;
+        }
     }
+    if (p != buf)
+        nasm_write(buf, p - buf, ofile);
 }
 
 static void coff_symbol(char *name, int32_t strpos, int32_t value,
                         int section, int type, int storageclass, int aux)
 {
     char padname[8];
+    uint8_t entry[18], *p = entry;
 
     if (name) {
         strncpy(padname, name, 8);
-        nasm_write(padname, 8, ofile);
+        memcpy(p, padname, 8);
+        p += 8;
     } else {
-        fwriteint32_t(0, ofile);
-        fwriteint32_t(strpos, ofile);
+        WRITELONG(p, 0);
+        WRITELONG(p, strpos);
     }
 
-    fwriteint32_t(value,        ofile);
-    fwriteint16_t(section,      ofile);
-    fwriteint16_t(type,         ofile);
+    WRITELONG(p, value);
+    WRITESHORT(p, section);
+    WRITESHORT(p, type);
+
+    WRITECHAR(p, storageclass);
+    WRITECHAR(p, aux);
 
-    fputc(storageclass, ofile);
-    fputc(aux, ofile);
+    nasm_write(entry, p - entry, ofile);
 }
 
 static void coff_write_symbols(void)
@@ -1083,13 +1122,14 @@ static void coff_write_symbols(void)
     /*
      * The section records, with their auxiliaries.
      */
-    memset(filename, 0, 18);    /* useful zeroed buffer */
-
     for (i = 0; i < (uint32_t) coff_nsects; i++) {
+        uint8_t aux[18], *p = aux;
+
         coff_symbol(coff_sects[i]->name, 0L, 0L, i + 1, 0, 3, 1);
-        fwriteint32_t(coff_sects[i]->len,    ofile);
-        fwriteint16_t(coff_sects[i]->nrelocs,ofile);
-        nasm_write(filename, 12, ofile);
+        WRITELONG(p, coff_sects[i]->len);
+        WRITESHORT(p, coff_sects[i]->nrelocs);
+        memset(p, 0, 12);
+        nasm_write(aux, sizeof(aux), ofile);
     }
 
     /*
@@ -1104,7 +1144,9 @@ static void coff_write_symbols(void)
     for (i = 0; i < coff_nsyms; i++) {
         struct coff_Symbol *sym = saa_rstruct(coff_syms);
         coff_symbol(sym->strpos == -1 ? sym->name : NULL,
-                    sym->strpos, sym->value, sym->section,
+                    sym->strpos == -1 ? 0 :
+                    strtab_offset(&coff_strs, sym->strpos),
+                    sym->value, sym->section,
                     sym->type, sym->is_global ? 2 : 3, 0);
     }
 }
@@ -1115,12 +1157,9 @@ static void coff_sectalign(int32_t seg, unsigned int value)
     uint32_t align;
     int i;
 
-    for (i = 0; i < coff_nsects; i++) {
-        if (coff_sects[i]->index == seg) {
-            s = coff_sects[i];
-            break;
-        }
-    }
+    i = segmap_find(&sectmap, seg);
+    if (i >= 0)
+        s = coff_sects[i];
 
     if (!s || !is_power2(value))
         return;
@@ -1177,6 +1216,8 @@ const struct ofmt of_coff = {
     coff_std_init,
     coff_set_info,
     coff_out,
+    generic_output_block,
+    coff_out_fill,
     coff_deflabel,
     coff_section_names,
     coff_sectalign,
@@ -1205,6 +1246,8 @@ const struct ofmt of_win32 = {
     coff_win32_init,
     coff_set_info,
     coff_out,
+    generic_output_block,
+    coff_out_fill,
     coff_deflabel,
     coff_section_names,
     coff_sectalign,
@@ -1231,6 +1274,8 @@ const struct ofmt of_win64 = {
     coff_win64_init,
     coff_set_info,
     coff_out,
+    generic_output_block,
+    coff_out_fill,
     coff_deflabel,
     coff_section_names,
     coff_sectalign,
@@ -46,6 +46,7 @@
 #include "nasm.h"
 #include "nasmlib.h"
 #include "outform.h"
+#include "outlib.h"
 
 #ifdef OF_DBG
 
@@ -269,6 +270,8 @@ const struct ofmt of_dbg = {
     dbg_init,
     dbg_set_info,
     dbg_out,
+    generic_output_block,
+    generic_output_fill,
     dbg_deflabel,
     dbg_section_names,
     dbg_sectalign,
@@ -44,6 +44,7 @@
 #include "nasmlib.h"
 #include "saa.h"
 #include "raa.h"
+#include "hashtbl.h"
 #include "stdscan.h"
 #include "eval.h"
 #include "outform.h"
@@ -59,12 +60,26 @@
 #if defined(OF_ELF32) || defined(OF_ELF64) || defined(OF_ELFX32)
 
 #define SECT_DELTA 32
+#define RELOC_DELTA 64
 static struct elf_section **sects;
 static int nsects, sectlen;
+static struct segmap sectmap;
+static struct hash_table sectnames;
 
-#define SHSTR_DELTA 256
-static char *shstrtab;
-static int shstrtablen, shstrtabsize;
+static struct strtab shstrtab;
+static int32_t *shnames;        /* section names, in header order */
+static int nshnames, shnamessize, shnamenext;
+
+/*
+ * Section numbers of absolute and common symbols.  Real section
+ * numbers can run past SHN_LORESERVE, so these are kept out of their
+ * way until the symbol table is written.
+ */
+#define SYMSECT_ABS     (-1)
+#define SYMSECT_COMMON  (-2)
+
+/* Are there too many sections for a 16-bit section index? */
+static bool elf_xindex;
 
 static struct SAA *syms;
 static uint32_t nlocals, nglobs, ndebugs; /* Symbol counts */
@@ -73,8 +88,8 @@ static int32_t def_seg;
 
 static struct RAA *bsym;
 
-static struct SAA *strs;
-static uint32_t strslen;
+static struct strtab strs;
+static int32_t modulename;
 
 static struct elf_symbol *fwds;
 
@@ -99,8 +114,9 @@ static void elf_sect_writeaddr(struct elf_section *, int64_t, size_t);
 static void elf_section_header(int, int, uint64_t, void *, bool, uint64_t, int, int,
                                int, int);
 static void elf_write_sections(void);
-static struct SAA *elf_build_symtab(int32_t *, int32_t *);
-static struct SAA *elf_build_reltab(uint64_t *, struct elf_reloc *);
+static struct SAA *elf_build_symtab(int32_t *, int32_t *, struct SAA *);
+static void elf_build_reltab(struct elf_section *);
+static void elf_final_job(void *, int);
 static void add_sectname(char *, char *);
 
 struct erel {
@@ -317,13 +333,12 @@ static void elf_init(void)
     syms = saa_init((int32_t)sizeof(struct elf_symbol));
     nlocals = nglobs = ndebugs = 0;
     bsym = raa_init();
-    strs = saa_init(1L);
-    saa_wbytes(strs, "\0", 1L);
-    saa_wbytes(strs, elf_module, strlen(elf_module)+1);
-    strslen = 2 + strlen(elf_module);
-    shstrtab = NULL;
-    shstrtablen = shstrtabsize = 0;;
-    add_sectname("", "");
+    strtab_init(&strs, 1);
+    modulename = strtab_add(&strs, elf_module);
+    strtab_init(&shstrtab, 1);
+    shnames = NULL;
+    nshnames = shnamessize = shnamenext = 0;
+    hash_init(&sectnames, HASH_LARGE);
 
     fwds = NULL;
 
@@ -352,37 +367,42 @@ static void elf_init(void)
 
 static void elf_cleanup(void)
 {
-    struct elf_reloc *r;
     int i;
 
     elf_write();
     for (i = 0; i < nsects; i++) {
         if (sects[i]->type != SHT_NOBITS)
             saa_free(sects[i]->data);
-        if (sects[i]->head)
-            saa_free(sects[i]->rel);
-        while (sects[i]->head) {
-            r = sects[i]->head;
-            sects[i]->head = sects[i]->head->next;
-            nasm_free(r);
-        }
+        nasm_free(sects[i]->relocs);
     }
     nasm_free(sects);
+    segmap_free(&sectmap);
+    hash_free(&sectnames);
     saa_free(syms);
     raa_free(bsym);
-    saa_free(strs);
+    strtab_free(&strs);
+    strtab_free(&shstrtab);
+    nasm_free(shnames);
     dfmt->cleanup();
 }
 
 /* add entry to the elf .shstrtab section */
 static void add_sectname(char *firsthalf, char *secondhalf)
 {
-    int len = strlen(firsthalf) + strlen(secondhalf);
-    while (shstrtablen + len + 1 > shstrtabsize)
-        shstrtab = nasm_realloc(shstrtab, (shstrtabsize += SHSTR_DELTA));
-    strcpy(shstrtab + shstrtablen, firsthalf);
-    strcat(shstrtab + shstrtablen, secondhalf);
-    shstrtablen += len + 1;
+    char *name = nasm_strcat(firsthalf, secondhalf);
+
+    if (nshnames >= shnamessize) {
+        shnamessize = shnamessize ? shnamessize << 1 : SECT_DELTA;
+        shnames = nasm_realloc(shnames, shnamessize * sizeof(*shnames));
+    }
+    shnames[nshnames++] = strtab_add(&shstrtab, name);
+    nasm_free(name);
+}
+
+/* .shstrtab offset of the name of the next section header */
+static int elf_shname(void)
+{
+    return strtab_offset(&shstrtab, shnames[shnamenext++]);
 }
 
 static int elf_make_section(char *name, int type, int flags, int align)
@@ -393,7 +413,6 @@ static int elf_make_section(char *name, int type, int flags, int align)
 
     if (type != SHT_NOBITS)
         s->data = saa_init(1L);
-    s->tail = &s->head;
     if (!strcmp(name, ".text"))
         s->index = def_seg;
     else
@@ -405,8 +424,11 @@ static int elf_make_section(char *name, int type, int flags, int align)
     s->flags    = flags;
     s->align    = align;
 
-    if (nsects >= sectlen)
-        sects = nasm_realloc(sects, (sectlen += SECT_DELTA) * sizeof(*sects));
+    if (nsects >= sectlen) {
+        sectlen = sectlen ? sectlen << 1 : SECT_DELTA;
+        sects = nasm_realloc(sects, sectlen * sizeof(*sects));
+    }
+    segmap_add(&sectmap, s->index, nsects);
     sects[nsects++] = s;
 
     return nsects - 1;
@@ -414,6 +436,9 @@ static int elf_make_section(char *name, int type, int flags, int align)
 
 static int32_t elf_section_names(char *name, int pass, int *bits)
 {
+    struct elf_section *s;
+    struct hash_insert hi;
+    void **sp;
     char *p;
     uint32_t flags, flags_and, flags_or;
     uint64_t align;
@@ -440,10 +465,8 @@ static int32_t elf_section_names(char *name, int pass, int *bits)
         return NO_SEG;
     }
 
-    for (i = 0; i < nsects; i++)
-        if (!strcmp(name, sects[i]->name))
-            break;
-    if (i == nsects) {
+    sp = hash_find(&sectnames, name, &hi);
+    if (!sp) {
         const struct elf_known_section *ks = elf_known_sections;
 
         while (ks->name) {
@@ -457,21 +480,26 @@ static int32_t elf_section_names(char *name, int pass, int *bits)
         flags = (ks->flags & ~flags_and) | flags_or;
 
         i = elf_make_section(name, type, flags, align);
-    } else if (pass == 1) {
-          if ((type && sects[i]->type != type)
-              || (align && sects[i]->align != align)
-              || (flags_and && ((sects[i]->flags & flags_and) != flags_or)))
+        s = sects[i];
+        hash_add(&hi, s->name, s);
+    } else {
+        s = *sp;
+        if (pass == 1) {
+          if ((type && s->type != type)
+              || (align && s->align != align)
+              || (flags_and && ((s->flags & flags_and) != flags_or)))
             nasm_error(ERR_WARNING, "incompatible section attributes ignored on"
                   " redeclaration of section `%s'", name);
+        }
     }
 
-    return sects[i]->index;
+    return s->index;
 }
 
 static void elf_deflabel(char *name, int32_t segment, int64_t offset,
                          int is_global, char *special)
 {
-    int pos = strslen;
+    int32_t pos;
     struct elf_symbol *sym;
     bool special_used = false;
 
@@ -530,8 +558,7 @@ static void elf_deflabel(char *name, int32_t segment, int64_t offset,
         return;                 /* it wasn't an important one */
     }
 
-    saa_wbytes(strs, name, (int32_t)(1 + strlen(name)));
-    strslen += 1 + strlen(name);
+    pos = strtab_add(&strs, name);
 
     lastsym = sym = saa_wstruct(syms);
 
@@ -542,7 +569,7 @@ static void elf_deflabel(char *name, int32_t segment, int64_t offset,
     sym->other = STV_DEFAULT;
     sym->size = 0;
     if (segment == NO_SEG)
-        sym->section = SHN_ABS;
+        sym->section = SYMSECT_ABS;
     else {
         int i;
         sym->section = SHN_UNDEF;
@@ -552,18 +579,15 @@ static void elf_deflabel(char *name, int32_t segment, int64_t offset,
             if (segment != elf_section_names(".text", 2, &tempint))
                 nasm_panic(0, "strange segment conditions in ELF driver");
         }
-        for (i = 0; i < nsects; i++) {
-            if (segment == sects[i]->index) {
-                sym->section = i + 1;
-                break;
-            }
-        }
+        i = segmap_find(&sectmap, segment);
+        if (i >= 0)
+            sym->section = i + 1;
     }
 
     if (is_global == 2) {
         sym->size = offset;
         sym->symv.key = 0;
-        sym->section = SHN_COMMON;
+        sym->section = SYMSECT_COMMON;
         /*
          * We have a common variable. Check the special text to see
          * if it's a valid number and power of two; if so, store it
@@ -585,7 +609,7 @@ static void elf_deflabel(char *name, int32_t segment, int64_t offset,
 
     if (sym->type == SYM_GLOBAL) {
         /*
-         * If sym->section == SHN_ABS, then the first line of the
+         * If sym->section == SYMSECT_ABS, then the first line of the
          * else section would cause a core dump, because its a reference
          * beyond the end of the section array.
          * This behaviour is exhibited by this code:
@@ -594,9 +618,9 @@ static void elf_deflabel(char *name, int32_t segment, int64_t offset,
          * To avoid such a crash, such requests are silently discarded.
          * This may not be the best solution.
          */
-        if (sym->section == SHN_UNDEF || sym->section == SHN_COMMON) {
+        if (sym->section == SHN_UNDEF || sym->section == SYMSECT_COMMON) {
             bsym = raa_write(bsym, segment, nglobs);
-        } else if (sym->section != SHN_ABS) {
+        } else if (sym->section != SYMSECT_ABS) {
             /*
              * This is a global symbol; so we must add it to the rbtree
              * of global symbols in its section.
@@ -686,28 +710,39 @@ static void elf_deflabel(char *name, int32_t segment, int64_t offset,
         nasm_error(ERR_NONFATAL, "no special symbol features supported here");
 }
 
+/*
+ * Relocations are kept in a growable array per section, which
+ * elf_build_reltab() later turns into the file form in place.
+ */
+static struct elf_reloc *elf_new_reloc(struct elf_section *sect)
+{
+    if (sect->nrelocs >= sect->relsize) {
+        sect->relsize = sect->relsize ? sect->relsize << 1 : RELOC_DELTA;
+        sect->relocs = nasm_realloc(sect->relocs,
+                                    sect->relsize * sizeof(*sect->relocs));
+    }
+    return &sect->relocs[sect->nrelocs++];
+}
+
 static void elf_add_reloc(struct elf_section *sect, int32_t segment,
                           int64_t offset, int type)
 {
     struct elf_reloc *r;
 
-    r = *sect->tail = nasm_zalloc(sizeof(struct elf_reloc));
-    sect->tail = &r->next;
+    r = elf_new_reloc(sect);
 
     r->address = sect->len;
     r->offset = offset;
+    r->symbol = 0;
 
     if (segment != NO_SEG) {
-        int i;
-        for (i = 0; i < nsects; i++)
-            if (segment == sects[i]->index)
-                r->symbol = i + 2;
-        if (!r->symbol)
+        int i = segmap_find(&sectmap, segment);
+        if (i >= 0)
+            r->symbol = i + 2;
+        else
             r->symbol = GLOBAL_TEMP_BASE + raa_read(bsym, segment);
     }
     r->type = type;
-
-    sect->nrelocs++;
 }
 
 /*
@@ -749,12 +784,8 @@ static int64_t elf_add_gsym_reloc(struct elf_section *sect,
      * doing a normal elf_add_reloc after first sanity-checking
      * that the offset from the symbol is zero.
      */
-    s = NULL;
-    for (i = 0; i < nsects; i++)
-        if (segment == sects[i]->index) {
-            s = sects[i];
-            break;
-        }
+    i = segmap_find(&sectmap, segment);
+    s = i >= 0 ? sects[i] : NULL;
 
     if (!s) {
         if (exact && offset)
@@ -772,26 +803,25 @@ static int64_t elf_add_gsym_reloc(struct elf_section *sect,
     }
     sym = container_of(srb, struct elf_symbol, symv);
 
-    r = *sect->tail = nasm_malloc(sizeof(struct elf_reloc));
-    sect->tail = &r->next;
+    r = elf_new_reloc(sect);
 
-    r->next     = NULL;
     r->address  = sect->len;
     r->offset = offset - pcrel - sym->symv.key;
     r->symbol   = GLOBAL_TEMP_BASE + sym->globnum;
     r->type     = type;
 
-    sect->nrelocs++;
     return r->offset;
 }
 
-static void elf32_out(int32_t segto, const void *data,
-                      enum out_type type, uint64_t size,
-                      int32_t segment, int32_t wrt)
+/*
+ * The section output to segment segto goes into, or NULL if there is
+ * nothing more to do with it: when it's absolute, or when it's data
+ * for a BSS section, which is warned about and skipped.
+ */
+static struct elf_section *elf_out_section(int32_t segto, enum out_type type,
+                                           uint64_t size)
 {
     struct elf_section *s;
-    int64_t addr;
-    int reltype, bytes;
     int i;
     static struct symlininfo sinfo;
 
@@ -802,15 +832,11 @@ static void elf32_out(int32_t segto, const void *data,
         if (type != OUT_RESERVE)
             nasm_error(ERR_NONFATAL, "attempt to assemble code in [ABSOLUTE]"
                   " space");
-        return;
+        return NULL;
     }
 
-    s = NULL;
-    for (i = 0; i < nsects; i++)
-        if (segto == sects[i]->index) {
-            s = sects[i];
-            break;
-        }
+    i = segmap_find(&sectmap, segto);
+    s = i >= 0 ? sects[i] : NULL;
     if (!s) {
         int tempint;            /* ignored */
         if (segto != elf_section_names(".text", 2, &tempint))
@@ -833,9 +859,19 @@ static void elf32_out(int32_t segto, const void *data,
         nasm_error(ERR_WARNING, "attempt to initialize memory in"
               " BSS section `%s': ignored", s->name);
         s->len += realsize(type, size);
-        return;
+        return NULL;
     }
 
+    return s;
+}
+
+static void elf32_out_sect(struct elf_section *s, int32_t segto,
+                           const void *data, enum out_type type, uint64_t size,
+                           int32_t segment, int32_t wrt)
+{
+    int64_t addr;
+    int reltype, bytes;
+
     switch (type) {
     case OUT_RESERVE:
         if (s->type == SHT_PROGBITS) {
@@ -1001,56 +1037,12 @@ rel12adr:
         break;
     }
 }
-static void elf64_out(int32_t segto, const void *data,
-                      enum out_type type, uint64_t size,
-                      int32_t segment, int32_t wrt)
+static void elf64_out_sect(struct elf_section *s, int32_t segto,
+                           const void *data, enum out_type type, uint64_t size,
+                           int32_t segment, int32_t wrt)
 {
-    struct elf_section *s;
     int64_t addr;
     int reltype, bytes;
-    int i;
-    static struct symlininfo sinfo;
-
-    /*
-     * handle absolute-assembly (structure definitions)
-     */
-    if (segto == NO_SEG) {
-        if (type != OUT_RESERVE)
-            nasm_error(ERR_NONFATAL, "attempt to assemble code in [ABSOLUTE]"
-                  " space");
-        return;
-    }
-
-    s = NULL;
-    for (i = 0; i < nsects; i++)
-        if (segto == sects[i]->index) {
-            s = sects[i];
-            break;
-        }
-    if (!s) {
-        int tempint;            /* ignored */
-        if (segto != elf_section_names(".text", 2, &tempint))
-            nasm_panic(0, "strange segment conditions in ELF driver");
-        else {
-            s = sects[nsects - 1];
-            i = nsects - 1;
-        }
-    }
-
-    /* again some stabs debugging stuff */
-    sinfo.offset = s->len;
-    sinfo.section = i;
-    sinfo.segto = segto;
-    sinfo.name = s->name;
-    dfmt->debug_output(TY_DEBUGSYMLIN, &sinfo);
-    /* end of debugging stuff */
-
-    if (s->type == SHT_NOBITS && type != OUT_RESERVE) {
-        nasm_error(ERR_WARNING, "attempt to initialize memory in"
-              " BSS section `%s': ignored", s->name);
-        s->len += realsize(type, size);
-        return;
-    }
 
     switch (type) {
     case OUT_RESERVE:
@@ -1288,56 +1280,12 @@ rel12adr:
     }
 }
 
-static void elfx32_out(int32_t segto, const void *data,
-                       enum out_type type, uint64_t size,
-                       int32_t segment, int32_t wrt)
+static void elfx32_out_sect(struct elf_section *s, int32_t segto,
+                            const void *data, enum out_type type, uint64_t size,
+                            int32_t segment, int32_t wrt)
 {
-    struct elf_section *s;
     int64_t addr;
     int reltype, bytes;
-    int i;
-    static struct symlininfo sinfo;
-
-    /*
-     * handle absolute-assembly (structure definitions)
-     */
-    if (segto == NO_SEG) {
-        if (type != OUT_RESERVE)
-            nasm_error(ERR_NONFATAL, "attempt to assemble code in [ABSOLUTE]"
-                  " space");
-        return;
-    }
-
-    s = NULL;
-    for (i = 0; i < nsects; i++)
-        if (segto == sects[i]->index) {
-            s = sects[i];
-            break;
-        }
-    if (!s) {
-        int tempint;            /* ignored */
-        if (segto != elf_section_names(".text", 2, &tempint))
-            nasm_panic(0, "strange segment conditions in ELF driver");
-        else {
-            s = sects[nsects - 1];
-            i = nsects - 1;
-        }
-    }
-
-    /* again some stabs debugging stuff */
-    sinfo.offset = s->len;
-    sinfo.section = i;
-    sinfo.segto = segto;
-    sinfo.name = s->name;
-    dfmt->debug_output(TY_DEBUGSYMLIN, &sinfo);
-    /* end of debugging stuff */
-
-    if (s->type == SHT_NOBITS && type != OUT_RESERVE) {
-        nasm_error(ERR_WARNING, "attempt to initialize memory in"
-              " BSS section `%s': ignored", s->name);
-        s->len += realsize(type, size);
-        return;
-    }
 
     switch (type) {
     case OUT_RESERVE:
@@ -1537,14 +1485,108 @@ rel12adr:
     }
 }
 
+static void elf_out_sect(struct elf_section *s, int32_t segto,
+                         const void *data, enum out_type type,
+                         uint64_t size, int32_t segment, int32_t wrt)
+{
+    if (is_elf32())
+        elf32_out_sect(s, segto, data, type, size, segment, wrt);
+    else if (is_elfx32())
+        elfx32_out_sect(s, segto, data, type, size, segment, wrt);
+    else
+        elf64_out_sect(s, segto, data, type, size, segment, wrt);
+}
+
+static void elf_out(int32_t segto, const void *data,
+                    enum out_type type, uint64_t size,
+                    int32_t segment, int32_t wrt)
+{
+    struct elf_section *s = elf_out_section(segto, type, size);
+
+    if (s)
+        elf_out_sect(s, segto, data, type, size, segment, wrt);
+}
+
+/*
+ * A whole instruction: the section is looked up once, and the bytes
+ * between the relocated fields go straight into it.
+ */
+static void elf_output_block(int32_t segto, const uint8_t *data, size_t len,
+                             const struct out_field *fields, int nfields)
+{
+    struct elf_section *s = elf_out_section(segto, OUT_RAWDATA, len);
+    size_t pos = 0;
+    int i;
+
+    if (!s)
+        return;
+
+    for (i = 0; i < nfields; i++) {
+        const struct out_field *f = &fields[i];
+
+        if (f->pos > pos)
+            elf_sect_write(s, data + pos, f->pos - pos);
+        elf_out_sect(s, segto, &f->addr, f->type, f->size,
+                     f->segment, f->wrt);
+        pos = f->pos + out_field_len(f);
+    }
+    if (len > pos)
+        elf_sect_write(s, data + pos, len - pos);
+}
+
+static void elf_output_fill(int32_t segto, const void *data, size_t len,
+                            uint64_t count)
+{
+    struct elf_section *s = elf_out_section(segto, OUT_RAWDATA, len * count);
+
+    if (!s)
+        return;
+
+    saa_wfill(s->data, data, len, count);
+    s->len += len * count;
+}
+
+/*
+ * The work done between assembly and writing the file: the symbol
+ * table, the debug sections and one relocation table for each section
+ * which has relocations.  The jobs share no state that any of them
+ * changes, so they may run on several threads; each one's output is
+ * the same whichever order they run in.
+ */
+struct elf_final {
+    struct SAA *symtab, *xtab;
+    int32_t symtablen, symtablocal;
+    struct elf_section **relsects;
+    int nrelsects;
+};
+
+static void elf_final_job(void *arg, int i)
+{
+    struct elf_final *fin = arg;
+
+    if (i == 0) {
+        fin->symtab = elf_build_symtab(&fin->symtablen, &fin->symtablocal,
+                                       fin->xtab);
+    } else if (i == 1) {
+        if (dfmt == &df_stabs)
+            stabs_generate();
+        else if (dfmt == &df_dwarf && dwarf_fsect)
+            dwarf_generate();
+    } else {
+        elf_build_reltab(fin->relsects[i - 2]);
+    }
+}
+
 static void elf_write(void)
 {
     int align;
-    char *p;
     int i;
+    uint8_t header[0x40], *hp;
 
+    struct elf_final fin;
     struct SAA *symtab;
     int32_t symtablen, symtablocal;
+    struct SAA *xtab;
 
     /*
      * Work out how many sections we will have. We have SHN_UNDEF,
@@ -1558,15 +1600,30 @@ static void elf_write(void)
     else if (dfmt == &df_dwarf)
         nsections += 10;
 
+    for (i = 0; i < nsects; i++) {
+        nsections++;            /* for the section itself */
+        if (sects[i]->nrelocs)
+            nsections++;        /* for its relocations */
+    }
+
+    /*
+     * With SHN_LORESERVE sections or more, section indices no longer
+     * fit in the 16-bit header and symbol fields.  The real numbers
+     * then go into section 0 and a `.symtab_shndx' section after
+     * `.strtab'.
+     */
+    elf_xindex = nsections >= SHN_LORESERVE;
+    if (elf_xindex)
+        nsections++;
+
     add_sectname("", ".shstrtab");
     add_sectname("", ".symtab");
     add_sectname("", ".strtab");
+    if (elf_xindex)
+        add_sectname("", ".symtab_shndx");
     for (i = 0; i < nsects; i++) {
-        nsections++;            /* for the section itself */
-        if (sects[i]->head) {
-            nsections++;        /* for its relocations */
+        if (sects[i]->nrelocs)
             add_sectname(is_elf32() ? ".rel" : ".rela", sects[i]->name);
-        }
     }
 
     if (dfmt == &df_stabs) {
@@ -1595,59 +1652,82 @@ static void elf_write(void)
     }
 
     /*
-     * Output the ELF header.
+     * Output the ELF header.  It is built in memory, 0x40 bytes in
+     * both classes, and written in one go.
      */
+    memset(header, 0, sizeof(header));
+    hp = header;
     if (is_elf32() || is_elfx32()) {
-        nasm_write("\177ELF\1\1\1", 7,                  ofile);
-        fputc(elf_osabi,                                ofile);
-        fputc(elf_abiver,                               ofile);
-        fwritezero(7,                                   ofile);
-        fwriteint16_t(ET_REL,                           ofile); /* relocatable file */
-        fwriteint16_t(is_elf32() ? EM_386 : EM_X86_64,  ofile); /* processor ID */
-        fwriteint32_t(1L,                               ofile); /* EV_CURRENT file format version */
-        fwriteint32_t(0L,                               ofile); /* no entry point */
-        fwriteint32_t(0L,                               ofile); /* no program header table */
-        fwriteint32_t(0x40L,                            ofile); /* section headers straight after ELF header plus alignment */
-        fwriteint32_t(0L,                               ofile); /* no special flags */
-        fwriteint16_t(0x34,                             ofile); /* size of ELF header */
-        fwriteint16_t(0,                                ofile); /* no program header table, again */
-        fwriteint16_t(0,                                ofile); /* still no program header table */
-        fwriteint16_t(sizeof(Elf32_Shdr),               ofile); /* size of section header */
-        fwriteint16_t(nsections,                        ofile); /* number of sections */
-        fwriteint16_t(sec_shstrtab,                     ofile); /* string table section index for section header table */
-
-        fwriteint32_t(0L,                               ofile); /* align to 0x40 bytes */
-        fwriteint32_t(0L,                               ofile);
-        fwriteint32_t(0L,                               ofile);
+        memcpy(hp, "\177ELF\1\1\1", 7);
+        hp += 7;
+        WRITECHAR(hp, elf_osabi);
+        WRITECHAR(hp, elf_abiver);
+        hp += 7;
+        WRITESHORT(hp, ET_REL);                         /* relocatable file */
+        WRITESHORT(hp, is_elf32() ? EM_386 : EM_X86_64); /* processor ID */
+        WRITELONG(hp, 1L);                              /* EV_CURRENT file format version */
+        WRITELONG(hp, 0L);                              /* no entry point */
+        WRITELONG(hp, 0L);                              /* no program header table */
+        WRITELONG(hp, 0x40L);                           /* section headers straight after ELF header plus alignment */
+        WRITELONG(hp, 0L);                              /* no special flags */
+        WRITESHORT(hp, 0x34);                           /* size of ELF header */
+        WRITESHORT(hp, 0);                              /* no program header table, again */
+        WRITESHORT(hp, 0);                              /* still no program header table */
+        WRITESHORT(hp, sizeof(Elf32_Shdr));             /* size of section header */
+        WRITESHORT(hp, elf_xindex ? 0 : nsections);     /* number of sections */
+        WRITESHORT(hp, elf_xindex && sec_shstrtab >= SHN_LORESERVE ?
+                   SHN_XINDEX : sec_shstrtab);          /* string table section index for section header table */
+        /* the rest is padding to 0x40 bytes */
     } else {
         nasm_assert(is_elf64());
-        nasm_write("\177ELF\2\1\1", 7,                  ofile);
-        fputc(elf_osabi,                                ofile);
-        fputc(elf_abiver,                               ofile);
-        fwritezero(7,                                   ofile);
-        fwriteint16_t(ET_REL,                           ofile); /* relocatable file */
-        fwriteint16_t(EM_X86_64,                        ofile); /* processor ID */
-        fwriteint32_t(1L,                               ofile); /* EV_CURRENT file format version */
-        fwriteint64_t(0L,                               ofile); /* no entry point */
-        fwriteint64_t(0L,                               ofile); /* no program header table */
-        fwriteint64_t(0x40L,                            ofile); /* section headers straight after ELF header plus alignment */
-        fwriteint32_t(0L,                               ofile); /* no special flags */
-        fwriteint16_t(0x40,                             ofile); /* size of ELF header */
-        fwriteint16_t(0,                                ofile); /* no program header table, again */
-        fwriteint16_t(0,                                ofile); /* still no program header table */
-        fwriteint16_t(sizeof(Elf64_Shdr),               ofile); /* size of section header */
-        fwriteint16_t(nsections,                        ofile); /* number of sections */
-        fwriteint16_t(sec_shstrtab,                     ofile); /* string table section index for section header table */
+        memcpy(hp, "\177ELF\2\1\1", 7);
+        hp += 7;
+        WRITECHAR(hp, elf_osabi);
+        WRITECHAR(hp, elf_abiver);
+        hp += 7;
+        WRITESHORT(hp, ET_REL);                         /* relocatable file */
+        WRITESHORT(hp, EM_X86_64);                      /* processor ID */
+        WRITELONG(hp, 1L);                              /* EV_CURRENT file format version */
+        WRITEDLONG(hp, 0L);                             /* no entry point */
+        WRITEDLONG(hp, 0L);                             /* no program header table */
+        WRITEDLONG(hp, 0x40L);                          /* section headers straight after ELF header plus alignment */
+        WRITELONG(hp, 0L);                              /* no special flags */
+        WRITESHORT(hp, 0x40);                           /* size of ELF header */
+        WRITESHORT(hp, 0);                              /* no program header table, again */
+        WRITESHORT(hp, 0);                              /* still no program header table */
+        WRITESHORT(hp, sizeof(Elf64_Shdr));             /* size of section header */
+        WRITESHORT(hp, elf_xindex ? 0 : nsections);     /* number of sections */
+        WRITESHORT(hp, elf_xindex && sec_shstrtab >= SHN_LORESERVE ?
+                   SHN_XINDEX : sec_shstrtab);          /* string table section index for section header table */
     }
+    nasm_write(header, sizeof(header), ofile);
 
     /*
-     * Build the symbol table and relocation tables.
+     * Build the symbol table, the debug sections and the relocation
+     * tables, on up to nasm_jobs threads.  The debug sections refer
+     * to the three symbols following the local ones, so their indices
+     * are settled first.
      */
-    symtab = elf_build_symtab(&symtablen, &symtablocal);
+    strtab_finalize(&strs);
+    if (dfmt == &df_dwarf) {
+        dwarf_infosym   = nsects + nlocals + 2;
+        dwarf_abbrevsym = dwarf_infosym + 1;
+        dwarf_linesym   = dwarf_infosym + 2;
+    }
+
+    fin.xtab = elf_xindex ? saa_init(4L) : NULL;
+    fin.relsects = nsects ? nasm_malloc(nsects * sizeof(*fin.relsects)) : NULL;
+    fin.nrelsects = 0;
     for (i = 0; i < nsects; i++)
-        if (sects[i]->head)
-            sects[i]->rel = elf_build_reltab(&sects[i]->rellen,
-                                             sects[i]->head);
+        if (sects[i]->nrelocs)
+            fin.relsects[fin.nrelsects++] = sects[i];
+    nasm_parallel(elf_final_job, &fin, fin.nrelsects + 2, nasm_jobs);
+    nasm_free(fin.relsects);
+
+    symtab = fin.symtab;
+    symtablen = fin.symtablen;
+    symtablocal = fin.symtablocal;
+    xtab = fin.xtab;
 
     /*
      * Now output the section header table.
@@ -1658,63 +1738,67 @@ static void elf_write(void)
     elf_foffs += align;
     elf_nsect = 0;
     elf_sects = nasm_malloc(sizeof(*elf_sects) * nsections);
+    strtab_finalize(&shstrtab);
 
-    /* SHN_UNDEF */
-    elf_section_header(0, SHT_NULL, 0, NULL, false, 0, SHN_UNDEF, 0, 0, 0);
-    p = shstrtab + 1;
+    /* SHN_UNDEF, holding the real counts with extended numbering */
+    if (elf_xindex)
+        elf_section_header(0, SHT_NULL, 0, NULL, false, nsections,
+                           sec_shstrtab >= SHN_LORESERVE ? sec_shstrtab : 0,
+                           0, 0, 0);
+    else
+        elf_section_header(0, SHT_NULL, 0, NULL, false, 0, SHN_UNDEF, 0, 0, 0);
 
     /* The normal sections */
     for (i = 0; i < nsects; i++) {
-        elf_section_header(p - shstrtab, sects[i]->type, sects[i]->flags,
+        elf_section_header(elf_shname(), sects[i]->type, sects[i]->flags,
                            (sects[i]->type == SHT_PROGBITS ?
                             sects[i]->data : NULL), true,
                            sects[i]->len, 0, 0, sects[i]->align, 0);
-        p += strlen(p) + 1;
     }
 
     /* .shstrtab */
-    elf_section_header(p - shstrtab, SHT_STRTAB, 0, shstrtab, false,
-                       shstrtablen, 0, 0, 1, 0);
-    p += strlen(p) + 1;
+    elf_section_header(elf_shname(), SHT_STRTAB, 0, shstrtab.data, false,
+                       shstrtab.len, 0, 0, 1, 0);
 
     /* .symtab */
     if (is_elf64())
-        elf_section_header(p - shstrtab, SHT_SYMTAB, 0, symtab, true,
+        elf_section_header(elf_shname(), SHT_SYMTAB, 0, symtab, true,
                            symtablen, sec_strtab, symtablocal, 8, 24);
     else
-        elf_section_header(p - shstrtab, SHT_SYMTAB, 0, symtab, true,
+        elf_section_header(elf_shname(), SHT_SYMTAB, 0, symtab, true,
                            symtablen, sec_strtab, symtablocal, 4, 16);
-    p += strlen(p) + 1;
 
     /* .strtab */
-    elf_section_header(p - shstrtab, SHT_STRTAB, 0, strs, true,
-                       strslen, 0, 0, 1, 0);
-    p += strlen(p) + 1;
+    elf_section_header(elf_shname(), SHT_STRTAB, 0, strs.data, false,
+                       strs.len, 0, 0, 1, 0);
+
+    /* .symtab_shndx */
+    if (elf_xindex) {
+        elf_section_header(elf_shname(), SHT_SYMTAB_SHNDX, 0, xtab, true,
+                           xtab->datalen, sec_symtab, 0, 4, 4);
+    }
 
     /* The relocation sections */
     if (is_elf32()) {
         for (i = 0; i < nsects; i++) {
-            if (sects[i]->head) {
-                elf_section_header(p - shstrtab, SHT_REL, 0, sects[i]->rel, true,
+            if (sects[i]->nrelocs) {
+                elf_section_header(elf_shname(), SHT_REL, 0, sects[i]->relocs, false,
                                    sects[i]->rellen, sec_symtab, i + 1, 4, 8);
-                p += strlen(p) + 1;
             }
         }
     } else if (is_elfx32()) {
         for (i = 0; i < nsects; i++) {
-            if (sects[i]->head) {
-                elf_section_header(p - shstrtab, SHT_RELA, 0, sects[i]->rel, true,
+            if (sects[i]->nrelocs) {
+                elf_section_header(elf_shname(), SHT_RELA, 0, sects[i]->relocs, false,
                                    sects[i]->rellen, sec_symtab, i + 1, 4, 12);
-                p += strlen(p) + 1;
             }
         }
     } else {
         nasm_assert(is_elf64());
         for (i = 0; i < nsects; i++) {
-            if (sects[i]->head) {
-                elf_section_header(p - shstrtab, SHT_RELA, 0, sects[i]->rel, true,
+            if (sects[i]->nrelocs) {
+                elf_section_header(elf_shname(), SHT_RELA, 0, sects[i]->relocs, false,
                                    sects[i]->rellen, sec_symtab, i + 1, 8, 24);
-                p += strlen(p) + 1;
             }
         }
     }
@@ -1723,75 +1807,55 @@ static void elf_write(void)
         /* for debugging information, create the last three sections
            which are the .stab , .stabstr and .rel.stab sections respectively */
 
-        /* this function call creates the stab sections in memory */
-        stabs_generate();
-
         if (stabbuf && stabstrbuf && stabrelbuf) {
-            elf_section_header(p - shstrtab, SHT_PROGBITS, 0, stabbuf, false,
+            elf_section_header(elf_shname(), SHT_PROGBITS, 0, stabbuf, false,
                                 stablen, sec_stabstr, 0, 4, 12);
-            p += strlen(p) + 1;
 
-            elf_section_header(p - shstrtab, SHT_STRTAB, 0, stabstrbuf, false,
+            elf_section_header(elf_shname(), SHT_STRTAB, 0, stabstrbuf, false,
                                stabstrlen, 0, 0, 4, 0);
-            p += strlen(p) + 1;
 
             /* link -> symtable  info -> section to refer to */
-            elf_section_header(p - shstrtab, SHT_REL, 0, stabrelbuf, false,
+            elf_section_header(elf_shname(), SHT_REL, 0, stabrelbuf, false,
                                stabrellen, sec_symtab, sec_stab, 4, is_elf64() ? 16 : 8);
-            p += strlen(p) + 1;
         }
     } else if (dfmt == &df_dwarf) {
             /* for dwarf debugging information, create the ten dwarf sections */
 
-            /* this function call creates the dwarf sections in memory */
-            if (dwarf_fsect)
-                dwarf_generate();
-
-            elf_section_header(p - shstrtab, SHT_PROGBITS, 0, arangesbuf, false,
+            elf_section_header(elf_shname(), SHT_PROGBITS, 0, arangesbuf, false,
                                arangeslen, 0, 0, 1, 0);
-            p += strlen(p) + 1;
 
-            elf_section_header(p - shstrtab, SHT_RELA, 0, arangesrelbuf, false,
+            elf_section_header(elf_shname(), SHT_RELA, 0, arangesrelbuf, false,
                                arangesrellen, sec_symtab,
                                is_elf64() ? debug_aranges : sec_debug_aranges,
                                1, is_elf64() ? 24 : 12);
-            p += strlen(p) + 1;
 
-            elf_section_header(p - shstrtab, SHT_PROGBITS, 0, pubnamesbuf,
+            elf_section_header(elf_shname(), SHT_PROGBITS, 0, pubnamesbuf,
                                false, pubnameslen, 0, 0, 1, 0);
-            p += strlen(p) + 1;
 
-            elf_section_header(p - shstrtab, SHT_PROGBITS, 0, infobuf, false,
+            elf_section_header(elf_shname(), SHT_PROGBITS, 0, infobuf, false,
                                infolen, 0, 0, 1, 0);
-            p += strlen(p) + 1;
 
-            elf_section_header(p - shstrtab, SHT_RELA, 0, inforelbuf, false,
+            elf_section_header(elf_shname(), SHT_RELA, 0, inforelbuf, false,
                                inforellen, sec_symtab,
                                is_elf64() ? debug_info : sec_debug_info,
                                1, is_elf64() ? 24 : 12);
-            p += strlen(p) + 1;
 
-            elf_section_header(p - shstrtab, SHT_PROGBITS, 0, abbrevbuf, false,
+            elf_section_header(elf_shname(), SHT_PROGBITS, 0, abbrevbuf, false,
                                abbrevlen, 0, 0, 1, 0);
-            p += strlen(p) + 1;
 
-            elf_section_header(p - shstrtab, SHT_PROGBITS, 0, linebuf, false,
+            elf_section_header(elf_shname(), SHT_PROGBITS, 0, linebuf, false,
                                linelen, 0, 0, 1, 0);
-            p += strlen(p) + 1;
 
-            elf_section_header(p - shstrtab, SHT_RELA, 0, linerelbuf, false,
+            elf_section_header(elf_shname(), SHT_RELA, 0, linerelbuf, false,
                                linerellen, sec_symtab,
                                is_elf64() ? debug_line : sec_debug_line,
                                1, is_elf64() ? 24 : 12);
-            p += strlen(p) + 1;
 
-            elf_section_header(p - shstrtab, SHT_PROGBITS, 0, framebuf, false,
+            elf_section_header(elf_shname(), SHT_PROGBITS, 0, framebuf, false,
                                framelen, 0, 0, 8, 0);
-            p += strlen(p) + 1;
 
-            elf_section_header(p - shstrtab, SHT_PROGBITS, 0, locbuf, false,
+            elf_section_header(elf_shname(), SHT_PROGBITS, 0, locbuf, false,
                                loclen, 0, 0, 1, 0);
-            p += strlen(p) + 1;
     }
     fwritezero(align, ofile);
 
@@ -1802,9 +1866,38 @@ static void elf_write(void)
 
     nasm_free(elf_sects);
     saa_free(symtab);
+    if (xtab)
+        saa_free(xtab);
 }
 
-static struct SAA *elf_build_symtab(int32_t *len, int32_t *local)
+/*
+ * The st_shndx field of a symbol in the given section.  With extended
+ * section numbering, every symbol also gets an entry in xtab, which
+ * holds the real index when the field says SHN_XINDEX.
+ */
+static uint16_t elf_sym_shndx(struct SAA *xtab, int32_t section)
+{
+    uint32_t xindex = 0;
+    uint16_t shndx;
+
+    if (section == SYMSECT_ABS) {
+        shndx = SHN_ABS;
+    } else if (section == SYMSECT_COMMON) {
+        shndx = SHN_COMMON;
+    } else if (section >= SHN_LORESERVE) {
+        shndx = SHN_XINDEX;
+        xindex = section;
+    } else {
+        shndx = section;
+    }
+
+    if (xtab)
+        saa_write32(xtab, xindex);
+    return shndx;
+}
+
+static struct SAA *elf_build_symtab(int32_t *len, int32_t *local,
+                                    struct SAA *xtab)
 {
     struct SAA *s = saa_init(1L);
     struct elf_symbol *sym;
@@ -1819,26 +1912,28 @@ static struct SAA *elf_build_symtab(int32_t *len, int32_t *local)
     saa_wbytes(s, NULL, is_elf64() ? 24L : 16L);   /* null symbol table entry */
     *len += is_elf64() ? 24L : 16L;
     (*local)++;
+    if (xtab)
+        saa_write32(xtab, 0);
 
     /*
      * Next, an entry for the file name.
      */
     p = entry;
     if (is_elf64()) {
-        WRITELONG(p, 1);            /* we know it's 1st entry in strtab */
+        WRITELONG(p, strtab_offset(&strs, modulename));
         WRITESHORT(p, STT_FILE);    /* type FILE */
-        WRITESHORT(p, SHN_ABS);
+        WRITESHORT(p, elf_sym_shndx(xtab, SYMSECT_ABS));
         WRITEDLONG(p, (uint64_t) 0);  /* no value */
         WRITEDLONG(p, (uint64_t) 0);  /* no size either */
         saa_wbytes(s, entry, 24L);
         *len += 24;
         (*local)++;
     } else {
-        WRITELONG(p, 1);            /* we know it's 1st entry in strtab */
+        WRITELONG(p, strtab_offset(&strs, modulename));
         WRITELONG(p, 0);            /* no value */
         WRITELONG(p, 0);            /* no size either */
         WRITESHORT(p, STT_FILE);    /* type FILE */
-        WRITESHORT(p, SHN_ABS);
+        WRITESHORT(p, elf_sym_shndx(xtab, SYMSECT_ABS));
         saa_wbytes(s, entry, 16L);
         *len += 16;
         (*local)++;
@@ -1853,7 +1948,7 @@ static struct SAA *elf_build_symtab(int32_t *len, int32_t *local)
             p = entry;
             WRITELONG(p, 0);        /* no symbol name */
             WRITESHORT(p, STT_SECTION);       /* type, binding, and visibility */
-            WRITESHORT(p, i);       /* section id */
+            WRITESHORT(p, elf_sym_shndx(xtab, i)); /* section id */
             WRITEDLONG(p, (uint64_t) 0);        /* offset zero */
             WRITEDLONG(p, (uint64_t) 0);        /* size zero */
             saa_wbytes(s, entry, 24L);
@@ -1867,7 +1962,7 @@ static struct SAA *elf_build_symtab(int32_t *len, int32_t *local)
             WRITELONG(p, 0);        /* offset zero */
             WRITELONG(p, 0);        /* size zero */
             WRITESHORT(p, STT_SECTION);       /* type, binding, and visibility */
-            WRITESHORT(p, i);       /* section id */
+            WRITESHORT(p, elf_sym_shndx(xtab, i)); /* section id */
             saa_wbytes(s, entry, 16L);
             *len += 16;
             (*local)++;
@@ -1883,10 +1978,10 @@ static struct SAA *elf_build_symtab(int32_t *len, int32_t *local)
             if (sym->type & SYM_GLOBAL)
                 continue;
             p = entry;
-            WRITELONG(p, sym->strpos);      /* index into symbol string table */
+            WRITELONG(p, strtab_offset(&strs, sym->strpos));      /* index into symbol string table */
             WRITECHAR(p, sym->type);        /* type and binding */
             WRITECHAR(p, sym->other);       /* visibility */
-            WRITESHORT(p, sym->section);    /* index into section header table */
+            WRITESHORT(p, elf_sym_shndx(xtab, sym->section));    /* index into section header table */
             WRITEDLONG(p, (int64_t)sym->symv.key); /* value of symbol */
             WRITEDLONG(p, (int64_t)sym->size);  /* size of symbol */
             saa_wbytes(s, entry, 24L);
@@ -1898,31 +1993,28 @@ static struct SAA *elf_build_symtab(int32_t *len, int32_t *local)
          * which are relocation targets.
          */
         if (dfmt == &df_dwarf) {
-            dwarf_infosym = *local;
             p = entry;
             WRITELONG(p, 0);        /* no symbol name */
             WRITESHORT(p, STT_SECTION);       /* type, binding, and visibility */
-            WRITESHORT(p, debug_info);       /* section id */
+            WRITESHORT(p, elf_sym_shndx(xtab, debug_info));       /* section id */
             WRITEDLONG(p, (uint64_t) 0);        /* offset zero */
             WRITEDLONG(p, (uint64_t) 0);        /* size zero */
             saa_wbytes(s, entry, 24L);
             *len += 24;
             (*local)++;
-            dwarf_abbrevsym = *local;
             p = entry;
             WRITELONG(p, 0);        /* no symbol name */
             WRITESHORT(p, STT_SECTION);       /* type, binding, and visibility */
-            WRITESHORT(p, debug_abbrev);       /* section id */
+            WRITESHORT(p, elf_sym_shndx(xtab, debug_abbrev));       /* section id */
             WRITEDLONG(p, (uint64_t) 0);        /* offset zero */
             WRITEDLONG(p, (uint64_t) 0);        /* size zero */
             saa_wbytes(s, entry, 24L);
             *len += 24;
             (*local)++;
-            dwarf_linesym = *local;
             p = entry;
             WRITELONG(p, 0);        /* no symbol name */
             WRITESHORT(p, STT_SECTION);       /* type, binding, and visibility */
-            WRITESHORT(p, debug_line);       /* section id */
+            WRITESHORT(p, elf_sym_shndx(xtab, debug_line));       /* section id */
             WRITEDLONG(p, (uint64_t) 0);        /* offset zero */
             WRITEDLONG(p, (uint64_t) 0);        /* size zero */
             saa_wbytes(s, entry, 24L);
@@ -1934,12 +2026,12 @@ static struct SAA *elf_build_symtab(int32_t *len, int32_t *local)
             if (sym->type & SYM_GLOBAL)
                 continue;
             p = entry;
-            WRITELONG(p, sym->strpos);
+            WRITELONG(p, strtab_offset(&strs, sym->strpos));
             WRITELONG(p, sym->symv.key);
             WRITELONG(p, sym->size);
             WRITECHAR(p, sym->type);        /* type and binding */
             WRITECHAR(p, sym->other);       /* visibility */
-            WRITESHORT(p, sym->section);
+            WRITESHORT(p, elf_sym_shndx(xtab, sym->section));
             saa_wbytes(s, entry, 16L);
             *len += 16;
             (*local)++;
@@ -1949,33 +2041,30 @@ static struct SAA *elf_build_symtab(int32_t *len, int32_t *local)
          * which are relocation targets.
          */
         if (dfmt == &df_dwarf) {
-            dwarf_infosym = *local;
             p = entry;
             WRITELONG(p, 0);        /* no symbol name */
             WRITELONG(p, (uint32_t) 0);         /* offset zero */
             WRITELONG(p, (uint32_t) 0);         /* size zero */
             WRITESHORT(p, STT_SECTION);         /* type, binding, and visibility */
-            WRITESHORT(p, sec_debug_info);      /* section id */
+            WRITESHORT(p, elf_sym_shndx(xtab, sec_debug_info));      /* section id */
             saa_wbytes(s, entry, 16L);
             *len += 16;
             (*local)++;
-            dwarf_abbrevsym = *local;
             p = entry;
             WRITELONG(p, 0);        /* no symbol name */
             WRITELONG(p, (uint32_t) 0);         /* offset zero */
             WRITELONG(p, (uint32_t) 0);         /* size zero */
             WRITESHORT(p, STT_SECTION);         /* type, binding, and visibility */
-            WRITESHORT(p, sec_debug_abbrev);    /* section id */
+            WRITESHORT(p, elf_sym_shndx(xtab, sec_debug_abbrev));    /* section id */
             saa_wbytes(s, entry, 16L);
             *len += 16;
             (*local)++;
-            dwarf_linesym = *local;
             p = entry;
             WRITELONG(p, 0);        /* no symbol name */
             WRITELONG(p, (uint32_t) 0);         /* offset zero */
             WRITELONG(p, (uint32_t) 0);         /* size zero */
             WRITESHORT(p, STT_SECTION);         /* type, binding, and visibility */
-            WRITESHORT(p, sec_debug_line);      /* section id */
+            WRITESHORT(p, elf_sym_shndx(xtab, sec_debug_line));      /* section id */
             saa_wbytes(s, entry, 16L);
             *len += 16;
             (*local)++;
@@ -1991,10 +2080,10 @@ static struct SAA *elf_build_symtab(int32_t *len, int32_t *local)
             if (!(sym->type & SYM_GLOBAL))
                 continue;
             p = entry;
-            WRITELONG(p, sym->strpos);
+            WRITELONG(p, strtab_offset(&strs, sym->strpos));
             WRITECHAR(p, sym->type);        /* type and binding */
             WRITECHAR(p, sym->other);       /* visibility */
-            WRITESHORT(p, sym->section);
+            WRITESHORT(p, elf_sym_shndx(xtab, sym->section));
             WRITEDLONG(p, (int64_t)sym->symv.key);
             WRITEDLONG(p, (int64_t)sym->size);
             saa_wbytes(s, entry, 24L);
@@ -2005,12 +2094,12 @@ static struct SAA *elf_build_symtab(int32_t *len, int32_t *local)
             if (!(sym->type & SYM_GLOBAL))
                 continue;
             p = entry;
-            WRITELONG(p, sym->strpos);
+            WRITELONG(p, strtab_offset(&strs, sym->strpos));
             WRITELONG(p, sym->symv.key);
             WRITELONG(p, sym->size);
             WRITECHAR(p, sym->type);        /* type and binding */
             WRITECHAR(p, sym->other);       /* visibility */
-            WRITESHORT(p, sym->section);
+            WRITESHORT(p, elf_sym_shndx(xtab, sym->section));
             saa_wbytes(s, entry, 16L);
             *len += 16;
         }
@@ -2019,17 +2108,19 @@ static struct SAA *elf_build_symtab(int32_t *len, int32_t *local)
     return s;
 }
 
-static struct SAA *elf_build_reltab(uint64_t *len, struct elf_reloc *r)
+/*
+ * Convert a section's relocations into the file form.  Each entry is
+ * no larger than a struct elf_reloc, and is only written after the
+ * relocation it comes from has been read, so the conversion is done
+ * in place; relocs[] then holds rellen bytes of file data.
+ */
+static void elf_build_reltab(struct elf_section *s)
 {
-    struct SAA *s;
+    const struct elf_reloc *r = s->relocs;
+    uint8_t *q = (uint8_t *)s->relocs;
     uint8_t *p, entry[24];
     int32_t global_offset;
-
-    if (!r)
-        return NULL;
-
-    s = saa_init(1L);
-    *len = 0;
+    uint64_t n;
 
     /*
      * How to onvert from a global placeholder to a real symbol index;
@@ -2038,110 +2129,77 @@ static struct SAA *elf_build_reltab(uint64_t *len, struct elf_reloc *r)
      */
     global_offset = -GLOBAL_TEMP_BASE + nsects + nlocals + ndebugs + 2;
 
-    if (is_elf32()) {
-        while (r) {
-            int32_t sym = r->symbol;
-
-            if (sym >= GLOBAL_TEMP_BASE)
-                sym += global_offset;
-
-            p = entry;
-            WRITELONG(p, r->address);
-            WRITELONG(p, (sym << 8) + r->type);
-            saa_wbytes(s, entry, 8L);
-            *len += 8;
-
-            r = r->next;
-        }
-    } else if (is_elfx32()) {
-        while (r) {
-            int32_t sym = r->symbol;
-
-            if (sym >= GLOBAL_TEMP_BASE)
-                sym += global_offset;
+    for (n = s->nrelocs; n; n--, r++) {
+        int64_t address = r->address;
+        int64_t offset = r->offset;
+        int type = r->type;
+        int32_t sym = r->symbol;
 
-            p = entry;
-            WRITELONG(p, r->address);
-            WRITELONG(p, (sym << 8) + r->type);
-            WRITELONG(p, r->offset);
-            saa_wbytes(s, entry, 12L);
-            *len += 12;
+        if (sym >= GLOBAL_TEMP_BASE)
+            sym += global_offset;
 
-            r = r->next;
-        }
-    } else {
-        nasm_assert(is_elf64());
-        while (r) {
-            int32_t sym = r->symbol;
-
-            if (sym >= GLOBAL_TEMP_BASE)
-                sym += global_offset;
-
-            p = entry;
-            WRITEDLONG(p, r->address);
-            WRITELONG(p, r->type);
+        p = entry;
+        if (is_elf32()) {
+            WRITELONG(p, address);
+            WRITELONG(p, (sym << 8) + type);
+        } else if (is_elfx32()) {
+            WRITELONG(p, address);
+            WRITELONG(p, (sym << 8) + type);
+            WRITELONG(p, offset);
+        } else {
+            nasm_assert(is_elf64());
+            WRITEDLONG(p, address);
+            WRITELONG(p, type);
             WRITELONG(p, sym);
-            WRITEDLONG(p, r->offset);
-            saa_wbytes(s, entry, 24L);
-            *len += 24;
-
-            r = r->next;
+            WRITEDLONG(p, offset);
         }
+        memcpy(q, entry, p - entry);
+        q += p - entry;
     }
 
-    return s;
+    s->rellen = q - (uint8_t *)s->relocs;
 }
 
 static void elf_section_header(int name, int type, uint64_t flags,
                                void *data, bool is_saa, uint64_t datalen,
                                int link, int info, int align, int eltsize)
 {
+    uint8_t shdr[sizeof(Elf64_Shdr)], *p = shdr;
+
     elf_sects[elf_nsect].data = data;
     elf_sects[elf_nsect].len = datalen;
     elf_sects[elf_nsect].is_saa = is_saa;
     elf_nsect++;
 
-    if (is_elf32()) {
-        fwriteint32_t((int32_t)name, ofile);
-        fwriteint32_t((int32_t)type, ofile);
-        fwriteint32_t((int32_t)flags, ofile);
-        fwriteint32_t(0L, ofile);      /* no address, ever, in object files */
-        fwriteint32_t(type == 0 ? 0L : elf_foffs, ofile);
-        fwriteint32_t(datalen, ofile);
-        if (data)
-            elf_foffs += ALIGN(datalen, SEC_FILEALIGN);
-        fwriteint32_t((int32_t)link, ofile);
-        fwriteint32_t((int32_t)info, ofile);
-        fwriteint32_t((int32_t)align, ofile);
-        fwriteint32_t((int32_t)eltsize, ofile);
-    } else if (is_elfx32()) {
-        fwriteint32_t((int32_t)name, ofile);
-        fwriteint32_t((int32_t)type, ofile);
-        fwriteint32_t((int32_t)flags, ofile);
-        fwriteint32_t(0L, ofile);      /* no address, ever, in object files */
-        fwriteint32_t(type == 0 ? 0L : elf_foffs, ofile);
-        fwriteint32_t(datalen, ofile);
+    if (is_elf32() || is_elfx32()) {
+        WRITELONG(p, (int32_t)name);
+        WRITELONG(p, (int32_t)type);
+        WRITELONG(p, (int32_t)flags);
+        WRITELONG(p, 0L);      /* no address, ever, in object files */
+        WRITELONG(p, type == 0 ? 0L : elf_foffs);
+        WRITELONG(p, datalen);
         if (data)
             elf_foffs += ALIGN(datalen, SEC_FILEALIGN);
-        fwriteint32_t((int32_t)link, ofile);
-        fwriteint32_t((int32_t)info, ofile);
-        fwriteint32_t((int32_t)align, ofile);
-        fwriteint32_t((int32_t)eltsize, ofile);
+        WRITELONG(p, (int32_t)link);
+        WRITELONG(p, (int32_t)info);
+        WRITELONG(p, (int32_t)align);
+        WRITELONG(p, (int32_t)eltsize);
     } else {
         nasm_assert(is_elf64());
-        fwriteint32_t((int32_t)name, ofile);
-        fwriteint32_t((int32_t)type, ofile);
-        fwriteint64_t((int64_t)flags, ofile);
-        fwriteint64_t(0L, ofile);      /* no address, ever, in object files */
-        fwriteint64_t(type == 0 ? 0L : elf_foffs, ofile);
-        fwriteint64_t(datalen, ofile);
+        WRITELONG(p, (int32_t)name);
+        WRITELONG(p, (int32_t)type);
+        WRITEDLONG(p, (int64_t)flags);
+        WRITEDLONG(p, 0L);     /* no address, ever, in object files */
+        WRITEDLONG(p, type == 0 ? 0L : elf_foffs);
+        WRITEDLONG(p, datalen);
         if (data)
             elf_foffs += ALIGN(datalen, SEC_FILEALIGN);
-        fwriteint32_t((int32_t)link, ofile);
-        fwriteint32_t((int32_t)info, ofile);
-        fwriteint64_t((int64_t)align, ofile);
-        fwriteint64_t((int64_t)eltsize, ofile);
+        WRITELONG(p, (int32_t)link);
+        WRITELONG(p, (int32_t)info);
+        WRITEDLONG(p, (int64_t)align);
+        WRITEDLONG(p, (int64_t)eltsize);
     }
+    nasm_write(shdr, p - shdr, ofile);
 }
 
 static void elf_write_sections(void)
@@ -2177,12 +2235,9 @@ static void elf_sectalign(int32_t seg, unsigned int value)
     struct elf_section *s = NULL;
     int i;
 
-    for (i = 0; i < nsects; i++) {
-        if (sects[i]->index == seg) {
-            s = sects[i];
-            break;
-        }
-    }
+    i = segmap_find(&sectmap, seg);
+    if (i >= 0)
+        s = sects[i];
     if (!s || !is_power2(value))
         return;
 
@@ -2247,7 +2302,9 @@ const struct ofmt of_elf32 = {
     elf_stdmac,
     elf_init,
     elf_set_info,
-    elf32_out,
+    elf_out,
+    elf_output_block,
+    elf_output_fill,
     elf_deflabel,
     elf_section_names,
     elf_sectalign,
@@ -2294,7 +2351,9 @@ const struct ofmt of_elf64 = {
     elf_stdmac,
     elf_init,
     elf_set_info,
-    elf64_out,
+    elf_out,
+    elf_output_block,
+    elf_output_fill,
     elf_deflabel,
     elf_section_names,
     elf_sectalign,
@@ -2341,7 +2400,9 @@ const struct ofmt of_elfx32 = {
     elf_stdmac,
     elf_init,
     elf_set_info,
-    elfx32_out,
+    elf_out,
+    elf_output_block,
+    elf_output_fill,
     elf_deflabel,
     elf_section_names,
     elf_sectalign,
@@ -70,6 +70,9 @@ extern const struct elf_known_section elf_known_sections[];
 #define sec_strtab              (nsects + 3)
 #define sec_numspecial          3
 
+/* Only present with SHN_LORESERVE sections or more */
+#define sec_symtab_shndx        (nsects + 4)
+
 /*
  * Debugging ELF sections (last in the file)
  */
@@ -118,7 +121,6 @@ void elf_section_attrib(char *name, char *attr, int pass,
     } while (0)
 
 struct elf_reloc {
-    struct elf_reloc    *next;
     int64_t             address;        /* relative to _start_ of section */
     int64_t             symbol;         /* symbol index */
     int64_t             offset;         /* symbol addend */
@@ -127,7 +129,7 @@ struct elf_reloc {
 
 struct elf_symbol {
     struct rbtree       symv;           /* symbol value and symbol rbtree */
-    int32_t             strpos;         /* string table position of name */
+    int32_t             strpos;         /* string table handle of name */
     int32_t             section;        /* section ID of the symbol */
     int                 type;           /* symbol type */
     int                 other;          /* symbol visibility */
@@ -141,16 +143,15 @@ struct elf_section {
     struct SAA          *data;
     uint64_t            len;
     uint64_t            size;
-    uint64_t            nrelocs;
+    uint64_t            nrelocs;        /* relocations in relocs[] */
+    uint64_t            relsize;        /* allocated size of relocs[] */
     int32_t             index;
     int                 type;           /* SHT_PROGBITS or SHT_NOBITS */
     uint64_t            align;          /* alignment: power of two */
     uint64_t            flags;          /* section flags */
     char                *name;
-    struct SAA          *rel;
-    uint64_t             rellen;
-    struct elf_reloc    *head;
-    struct elf_reloc    **tail;
+    struct elf_reloc    *relocs;
+    uint64_t            rellen;         /* file size of relocs[] once built */
     struct rbtree       *gsyms;         /* global symbols in section */
 };
 
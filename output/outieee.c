@@ -1523,6 +1523,8 @@ const struct ofmt of_ieee = {
     ieee_init,
     ieee_set_info,
     ieee_out,
+    generic_output_block,
+    generic_output_fill,
     ieee_deflabel,
     ieee_segment,
     ieee_sectalign,
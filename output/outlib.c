@@ -38,6 +38,10 @@
  */
 
 #include "compiler.h"
+
+#include <stdlib.h>
+#include <string.h>
+
 #include "nasm.h"
 #include "outlib.h"
 
@@ -56,3 +60,238 @@ uint64_t realsize(enum out_type type, uint64_t size)
 	return size;
     }
 }
+
+/*
+ * The number of bytes a relocated field takes up in a block
+ */
+uint64_t out_field_len(const struct out_field *f)
+{
+    if (f->type == OUT_ADDRESS)
+        return abs((int)f->size);
+    return realsize(f->type, f->size);
+}
+
+void generic_output_block(int32_t segto, const uint8_t *data, size_t len,
+                          const struct out_field *fields, int nfields)
+{
+    size_t pos = 0;
+    int i;
+
+    for (i = 0; i < nfields; i++) {
+        const struct out_field *f = &fields[i];
+
+        if (f->pos > pos)
+            ofmt->output(segto, data + pos, OUT_RAWDATA, f->pos - pos,
+                         NO_SEG, NO_SEG);
+        ofmt->output(segto, &f->addr, f->type, f->size, f->segment, f->wrt);
+        pos = f->pos + out_field_len(f);
+    }
+    if (len > pos)
+        ofmt->output(segto, data + pos, OUT_RAWDATA, len - pos,
+                     NO_SEG, NO_SEG);
+}
+
+void generic_output_fill(int32_t segto, const void *data, size_t len,
+                         uint64_t count)
+{
+    uint8_t buf[4096];
+    uint64_t per;
+    size_t i;
+
+    if (len > sizeof(buf)) {
+        while (count--)
+            ofmt->output(segto, data, OUT_RAWDATA, len, NO_SEG, NO_SEG);
+        return;
+    }
+
+    per = sizeof(buf) / len;
+    if (per > count)
+        per = count;
+    for (i = 0; i < per; i++)
+        memcpy(buf + i * len, data, len);
+
+    while (count) {
+        uint64_t n = count < per ? count : per;
+
+        ofmt->output(segto, buf, OUT_RAWDATA, n * len, NO_SEG, NO_SEG);
+        count -= n;
+    }
+}
+
+/*
+ * seg_alloc() only hands out even numbers, the odd ones being the
+ * segment bases, so the table is indexed by segment / 2.
+ */
+void segmap_add(struct segmap *map, int32_t segment, int32_t index)
+{
+    size_t n = (uint32_t)segment >> 1;
+
+    if (n >= map->size) {
+        size_t oldsize = map->size;
+        size_t newsize = oldsize ? oldsize : 64;
+
+        while (newsize <= n)
+            newsize <<= 1;
+        map->index = nasm_realloc(map->index, newsize * sizeof(*map->index));
+        while (oldsize < newsize)
+            map->index[oldsize++] = -1;
+        map->size = newsize;
+    }
+    map->index[n] = index;
+}
+
+int32_t segmap_find(const struct segmap *map, int32_t segment)
+{
+    size_t n = (uint32_t)segment >> 1;
+
+    if (segment < 0 || (segment & 1) || n >= map->size)
+        return -1;
+    return map->index[n];
+}
+
+void segmap_free(struct segmap *map)
+{
+    nasm_free(map->index);
+    map->index = NULL;
+    map->size = 0;
+}
+
+struct strtab_entry {
+    struct strtab_entry *host;  /* string holding our bytes */
+    int32_t handle;
+    uint32_t offset;
+    uint32_t len;
+    char str[1];
+};
+
+void strtab_init(struct strtab *t, uint32_t base)
+{
+    hash_init(&t->hash, HASH_LARGE);
+    memset(&t->strings, 0, sizeof(t->strings));
+    t->ents = NULL;
+    t->nents = t->size = 0;
+    t->base = base;
+    t->data = NULL;
+    t->len = base;
+}
+
+int32_t strtab_add(struct strtab *t, const char *str)
+{
+    struct hash_insert hi;
+    struct strtab_entry *e;
+    void **ep;
+    size_t len;
+
+    nasm_assert(!t->data);
+
+    ep = hash_find(&t->hash, str, &hi);
+    if (ep) {
+        e = *ep;
+        return e->handle;
+    }
+
+    len = strlen(str);
+    e = arena_alloc(&t->strings, sizeof(*e) + len);
+    memcpy(e->str, str, len + 1);
+    e->len = len;
+    e->host = e;
+    e->handle = t->nents;
+    e->offset = 0;
+
+    if (t->nents >= t->size) {
+        t->size = t->size ? t->size << 1 : 256;
+        t->ents = nasm_realloc(t->ents, t->size * sizeof(*t->ents));
+    }
+    t->ents[t->nents] = e;
+    hash_add(&hi, e->str, e);
+
+    return t->nents++;
+}
+
+const char *strtab_string(const struct strtab *t, int32_t handle)
+{
+    return t->ents[handle]->str;
+}
+
+/*
+ * Order strings by their reversed text, so that a string comes
+ * right before the ones it is the tail of.
+ */
+static int strtab_tail_cmp(const void *a, const void *b)
+{
+    const struct strtab_entry *x = *(const struct strtab_entry * const *)a;
+    const struct strtab_entry *y = *(const struct strtab_entry * const *)b;
+    const unsigned char *p = (const unsigned char *)x->str + x->len;
+    const unsigned char *q = (const unsigned char *)y->str + y->len;
+
+    while (p > (const unsigned char *)x->str &&
+           q > (const unsigned char *)y->str) {
+        p--, q--;
+        if (*p != *q)
+            return *p - *q;
+    }
+    return (x->len > y->len) - (x->len < y->len);
+}
+
+void strtab_finalize(struct strtab *t)
+{
+    struct strtab_entry **sorted, *e, *next;
+    uint32_t offset;
+    int32_t i;
+
+    nasm_assert(!t->data);
+
+    /*
+     * Find, for each string, the longest string it is the tail of.
+     */
+    sorted = nasm_malloc((t->nents + 1) * sizeof(*sorted)); /* never 0 */
+    memcpy(sorted, t->ents, t->nents * sizeof(*sorted));
+    qsort(sorted, t->nents, sizeof(*sorted), strtab_tail_cmp);
+    for (i = t->nents - 2; i >= 0; i--) {
+        e = sorted[i];
+        next = sorted[i + 1];
+        if (next->len >= e->len &&
+            !memcmp(next->str + next->len - e->len, e->str, e->len))
+            e->host = next->host;
+    }
+    nasm_free(sorted);
+
+    /*
+     * Lay out the rest in the order they were added.
+     */
+    offset = t->base;
+    for (i = 0; i < t->nents; i++) {
+        e = t->ents[i];
+        if (e->host == e) {
+            e->offset = offset;
+            offset += e->len + 1;
+        }
+    }
+    t->len = offset;
+
+    t->data = nasm_zalloc(t->len ? t->len : 1);
+    for (i = 0; i < t->nents; i++) {
+        e = t->ents[i];
+        if (e->host == e)
+            memcpy(t->data + e->offset, e->str, e->len + 1);
+        else
+            e->offset = e->host->offset + e->host->len - e->len;
+    }
+}
+
+uint32_t strtab_offset(const struct strtab *t, int32_t handle)
+{
+    nasm_assert(t->data);
+    return t->ents[handle]->offset;
+}
+
+void strtab_free(struct strtab *t)
+{
+    hash_free(&t->hash);
+    arena_free(&t->strings);
+    nasm_free(t->ents);
+    nasm_free(t->data);
+    t->ents = NULL;
+    t->data = NULL;
+    t->nents = t->size = 0;
+}
@@ -35,8 +35,62 @@
 #define NASM_OUTLIB_H
 
 #include "nasm.h"
+#include "hashtbl.h"
+#include "arena.h"
 
 uint64_t realsize(enum out_type type, uint64_t size);
+uint64_t out_field_len(const struct out_field *f);
+
+/* output_block() in terms of the format's output() routine */
+void generic_output_block(int32_t segto, const uint8_t *data, size_t len,
+                          const struct out_field *fields, int nfields);
+
+/* output_fill() likewise, a buffer full of copies at a time */
+void generic_output_fill(int32_t segto, const void *data, size_t len,
+                         uint64_t count);
+
+/*
+ * Map from the segment numbers handed out by seg_alloc() to a
+ * backend's own section numbers, so that looking up the section a
+ * label or relocation refers to doesn't depend on how many sections
+ * there are.  A zero-initialized struct segmap is empty.
+ */
+struct segmap {
+    int32_t *index;             /* section number for segment 2*n, or -1 */
+    size_t size;
+};
+
+void segmap_add(struct segmap *map, int32_t segment, int32_t index);
+int32_t segmap_find(const struct segmap *map, int32_t segment);
+void segmap_free(struct segmap *map);
+
+/*
+ * String table builder for the symbol and section name tables of the
+ * object formats.  Each distinct string is stored once, and a string
+ * which is the tail of another one shares its bytes, the way ld does
+ * it.  strtab_add() hands out a handle; the offsets are only known
+ * after strtab_finalize(), which also builds the table contents.  The
+ * first "base" bytes of the table are zero, for the format to fill in
+ * as it likes.
+ */
+struct strtab_entry;
+
+struct strtab {
+    struct hash_table hash;     /* string -> struct strtab_entry */
+    struct arena strings;       /* holds the entries */
+    struct strtab_entry **ents; /* entries by handle */
+    int32_t nents, size;
+    uint32_t base;              /* offset of the first string */
+    char *data;                 /* table contents, once finalized */
+    uint32_t len;               /* ... and their length */
+};
+
+void strtab_init(struct strtab *t, uint32_t base);
+int32_t strtab_add(struct strtab *t, const char *str);
+const char *strtab_string(const struct strtab *t, int32_t handle);
+void strtab_finalize(struct strtab *t);
+uint32_t strtab_offset(const struct strtab *t, int32_t handle);
+void strtab_free(struct strtab *t);
 
 /* Do-nothing versions of some output routines */
 int null_setinfo(enum geninfo type, char **string);
@@ -146,7 +146,8 @@ struct section {
     struct SAA *data;
     int32_t index;
     int32_t fileindex;
-    struct reloc *relocs;
+    struct reloc *relocs;	/* nreloc used, relsize allocated */
+    uint32_t relsize;
     struct rbtree *gsyms;	/* Global symbols in section */
     int align;
     bool by_name;		/* This section was specified by full MachO name */
@@ -195,9 +196,6 @@ static const struct sectmap {
 };
 
 struct reloc {
-    /* nasm internal data */
-    struct reloc *next;
-
     /* data that goes into the file */
     int32_t addr;		/* op's offset in section */
     uint32_t snum:24,		/* contains symbol index if
@@ -223,7 +221,7 @@ struct symbol {
     int32_t snum;		/* true snum for reloc */
 
     /* data that goes into the file */
-    uint32_t strx;              /* string table index */
+    uint32_t strx;              /* string table handle */
     uint8_t type;		/* symbol type */
     uint8_t sect;		/* NO_SECT or section number */
     uint16_t desc;		/* for stab debugging, 0 for us */
@@ -246,6 +244,7 @@ struct symbol {
 #define MAX_SECT	255     /* maximum number of sections */
 
 static struct section *sects, **sectstail, **sectstab;
+static struct segmap segfileidx;
 static struct symbol *syms, **symstail;
 static uint32_t nsyms;
 
@@ -273,7 +272,7 @@ static struct symbol **extdefsyms = NULL;
 static struct symbol **undefsyms = NULL;
 
 static struct RAA *extsyms;
-static struct SAA *strs;
+static struct strtab strs;
 static uint32_t strslen;
 
 /* Global file information. This should be cleaned up into either
@@ -313,13 +312,9 @@ static struct section *get_section_by_name(const char *segname,
 
 static struct section *get_section_by_index(const int32_t index)
 {
-    struct section *s;
-
-    for (s = sects; s != NULL; s = s->next)
-        if (index == s->index)
-            break;
+    int32_t fi = segmap_find(&segfileidx, index);
 
-    return s;
+    return fi > 0 ? sectstab[fi] : NULL;
 }
 
 /*
@@ -346,10 +341,8 @@ static void macho_init(void)
     nundefsym = 0;
 
     extsyms = raa_init();
-    strs = saa_init(1L);
-
     /* string table starts with a zero byte so index 0 is an empty string */
-    saa_wbytes(strs, zero_buffer, 1);
+    strtab_init(&strs, 1);
     strslen = 1;
 
     /* add special symbol for TLVP */
@@ -385,6 +378,20 @@ static struct symbol *macho_find_gsym(struct section *s,
     return container_of(srb, struct symbol, symv);
 }
 
+/*
+ * Return the slot for the next relocation in a section; it is only
+ * taken by incrementing sect->nreloc once the relocation is made.
+ */
+static struct reloc *next_reloc(struct section *sect)
+{
+    if (sect->nreloc >= sect->relsize) {
+	sect->relsize = sect->relsize ? sect->relsize << 1 : 64;
+	sect->relocs = nasm_realloc(sect->relocs,
+				    sect->relsize * sizeof(*sect->relocs));
+    }
+    return &sect->relocs[sect->nreloc];
+}
+
 static int64_t add_reloc(struct section *sect, int32_t section,
 			 int64_t offset,
 			 enum reltype reltype, int bytes)
@@ -401,7 +408,7 @@ static int64_t add_reloc(struct section *sect, int32_t section,
      ** now, might have to be fixed by macho_fixup_relocs() later on. make
      ** sure we don't make the symbol scattered by setting the highest
      ** bit by accident */
-    r = nasm_malloc(sizeof(struct reloc));
+    r = next_reloc(sect);
     r->addr = sect->size & ~R_SCATTERED;
     r->ext = 1;
     adjust = bytes;
@@ -508,11 +515,6 @@ static int64_t add_reloc(struct section *sect, int32_t section,
 	break;
     }
 
-    /* NeXT as puts relocs in reversed order (address-wise) into the
-     ** files, so we do the same, doesn't seem to make much of a
-     ** difference either way */
-    r->next = sect->relocs;
-    sect->relocs = r;
     if (r->ext)
 	sect->extreloc = 1;
     ++sect->nreloc;
@@ -520,7 +522,6 @@ static int64_t add_reloc(struct section *sect, int32_t section,
     return adjust;
 
  bail:
-    nasm_free(r);
     return 0;
 }
 
@@ -787,6 +788,13 @@ static int32_t macho_section(char *name, int pass, int *bits)
 	s->data = saa_init(1L);
 	s->index = seg_alloc();
 	s->fileindex = ++seg_nsects;
+
+	/* sectstab is indexed by file index, with NO_SECT as entry 0 */
+	sectstab = nasm_realloc(sectstab,
+				(seg_nsects + 1) * sizeof(*sectstab));
+	sectstab[NO_SECT] = &absolute_sect;
+	sectstab[s->fileindex] = s;
+	segmap_add(&segfileidx, s->index, s->fileindex);
 	s->align = -1;
 	s->pad = -1;
 	s->offset = -1;
@@ -899,7 +907,6 @@ static void macho_symdef(char *name, int32_t section, int64_t offset,
     symstail = &sym->next;
 
     sym->name = name;
-    sym->strx = strslen;
     sym->type = 0;
     sym->desc = 0;
     sym->symv.key = offset;
@@ -1012,7 +1019,6 @@ static void macho_layout_symbols (uint32_t *numsyms,
     uint32_t i,j;
 
     *numsyms = 0;
-    *strtabsize = sizeof (char);
 
     symp = &syms;
 
@@ -1036,9 +1042,7 @@ static void macho_layout_symbols (uint32_t *numsyms,
 	    /* If we handle debug info we'll want
 	       to check for it here instead of just
 	       adding the symbol to the string table.  */
-	    sym->strx = *strtabsize;
-	    saa_wbytes (strs, sym->name, (int32_t)(strlen(sym->name) + 1));
-	    *strtabsize += strlen(sym->name) + 1;
+	    sym->strx = strtab_add(&strs, sym->name);
 	}
 	symp = &(sym->next);
     }
@@ -1062,9 +1066,7 @@ static void macho_layout_symbols (uint32_t *numsyms,
     while ((sym = *symp)) {
 
 	if((sym->type & N_EXT) == 0) {
-	    sym->strx = *strtabsize;
-	    saa_wbytes (strs, sym->name, (int32_t)(strlen (sym->name) + 1));
-	    *strtabsize += strlen(sym->name) + 1;
+	    sym->strx = strtab_add(&strs, sym->name);
 	}
 	else {
 		if((sym->type & N_TYPE) != N_UNDF) {
@@ -1076,6 +1078,9 @@ static void macho_layout_symbols (uint32_t *numsyms,
 	symp = &(sym->next);
     }
 
+    strtab_finalize(&strs);
+    *strtabsize = strs.len;
+
     qsort(extdefsyms, nextdefsym, sizeof(struct symbol *),
 	  (int (*)(const void *, const void *))layout_compare);
     qsort(undefsyms, nundefsym, sizeof(struct symbol *),
@@ -1096,7 +1101,6 @@ static void macho_layout_symbols (uint32_t *numsyms,
 static void macho_calculate_sizes (void)
 {
     struct section *s;
-    int fi;
 
     /* count sections and calculate in-memory and in-file offsets */
     for (s = sects; s != NULL; s = s->next) {
@@ -1143,12 +1147,6 @@ static void macho_calculate_sizes (void)
 	nasm_fatal(0, "MachO output is limited to %d sections\n",
 		   MAX_SECT);
     }
-
-    /* Create a table of sections by file index to avoid linear search */
-    sectstab = nasm_malloc((seg_nsects + 1) * sizeof(*sectstab));
-    sectstab[NO_SECT] = &absolute_sect;
-    for (s = sects, fi = 1; s != NULL; s = s->next, fi++)
-	sectstab[fi] = s;
 }
 
 /* Write out the header information for the file.  */
@@ -1249,24 +1247,34 @@ static uint32_t macho_write_segment (uint64_t offset)
     return offset;
 }
 
-/* For a given chain of relocs r, write out the entire relocation
-   chain to the object file.  */
+/* Write out the relocation entries of a section.  NeXT as puts
+   relocs in reversed order (address-wise) into the files, so we do
+   the same, doesn't seem to make much of a difference either way.  */
 
-static void macho_write_relocs (struct reloc *r)
+static void macho_write_relocs (const struct section *s)
 {
-    while (r) {
+    const struct reloc *r = s->relocs + s->nreloc;
+    uint8_t buf[MACHO_RELINFO_SIZE * 256], *p = buf;
+
+    while (r-- > s->relocs) {
 	uint32_t word2;
 
-	fwriteint32_t(r->addr, ofile); /* reloc offset */
+	WRITELONG(p, r->addr); /* reloc offset */
 
 	word2 = r->snum;
 	word2 |= r->pcrel << 24;
 	word2 |= r->length << 25;
 	word2 |= r->ext << 27;
 	word2 |= r->type << 28;
-	fwriteint32_t(word2, ofile); /* reloc data */
-	r = r->next;
+	WRITELONG(p, word2); /* reloc data */
+
+	if (p == buf + sizeof(buf)) {
+	    nasm_write(buf, sizeof(buf), ofile);
+	    p = buf;
+	}
     }
+    if (p != buf)
+	nasm_write(buf, p - buf, ofile);
 }
 
 /* Write out the section data.  */
@@ -1291,7 +1299,7 @@ static void macho_write_section (void)
 	 * start of the _text_ section, in the _file_. See outaout.c
 	 * for more information. */
 	saa_rewind(s->data);
-	for (r = s->relocs; r != NULL; r = r->next) {
+	for (r = s->relocs + s->nreloc; r-- > s->relocs;) {
 	    len = (uint32_t)1 << r->length;
 	    if (len > 4)	/* Can this ever be an issue?! */
 		len = 8;
@@ -1342,7 +1350,27 @@ static void macho_write_section (void)
 
     /* emit relocation entries */
     for (s = sects; s != NULL; s = s->next)
-	macho_write_relocs (s->relocs);
+	macho_write_relocs (s);
+}
+
+/* Write out one symbol table entry, fixing up the symbol value now
+   that we know the final section sizes.  */
+static void macho_write_nlist (struct symbol *sym)
+{
+    uint8_t entry[16], *p = entry;
+
+    WRITELONG(p, strtab_offset(&strs, sym->strx)); /* string table entry number */
+    WRITECHAR(p, sym->type);		/* symbol type */
+    WRITECHAR(p, sym->sect);		/* section */
+    WRITESHORT(p, sym->desc);		/* description */
+
+    if (((sym->type & N_TYPE) == N_SECT) && (sym->sect != NO_SECT)) {
+	nasm_assert(sym->sect <= seg_nsects);
+	sym->symv.key += sectstab[sym->sect]->addr;
+    }
+
+    WRITEADDR(p, sym->symv.key, fmt.ptrsize);	/* value (i.e. offset) */
+    nasm_write(entry, p - entry, ofile);
 }
 
 /* Write out the symbol table. We should already have sorted this
@@ -1355,75 +1383,30 @@ static void macho_write_symtab (void)
     /* we don't need to pad here since MACHO_RELINFO_SIZE == 8 */
 
     for (sym = syms; sym != NULL; sym = sym->next) {
-	if ((sym->type & N_EXT) == 0) {
-	    fwriteint32_t(sym->strx, ofile);		/* string table entry number */
-	    nasm_write(&sym->type, 1, ofile);		/* symbol type */
-	    nasm_write(&sym->sect, 1, ofile);		/* section */
-	    fwriteint16_t(sym->desc, ofile);		/* description */
-
-	    /* Fix up the symbol value now that we know the final section
-	       sizes.  */
-	    if (((sym->type & N_TYPE) == N_SECT) && (sym->sect != NO_SECT)) {
-		nasm_assert(sym->sect <= seg_nsects);
-		sym->symv.key += sectstab[sym->sect]->addr;
-	    }
-
-	    fwriteptr(sym->symv.key, ofile);	/* value (i.e. offset) */
-	}
-    }
-
-    for (i = 0; i < nextdefsym; i++) {
-	sym = extdefsyms[i];
-	fwriteint32_t(sym->strx, ofile);
-	nasm_write(&sym->type, 1, ofile);	/* symbol type */
-	nasm_write(&sym->sect, 1, ofile);	/* section */
-	fwriteint16_t(sym->desc, ofile);	/* description */
-
-	/* Fix up the symbol value now that we know the final section
-	   sizes.  */
-	if (((sym->type & N_TYPE) == N_SECT) && (sym->sect != NO_SECT)) {
-	    nasm_assert(sym->sect <= seg_nsects);
-	    sym->symv.key += sectstab[sym->sect]->addr;
-	}
-
-	fwriteptr(sym->symv.key, ofile); /* value (i.e. offset) */
+	if ((sym->type & N_EXT) == 0)
+	    macho_write_nlist(sym);
     }
 
-     for (i = 0; i < nundefsym; i++) {
-	 sym = undefsyms[i];
-	 fwriteint32_t(sym->strx, ofile);
-	 nasm_write(&sym->type, 1, ofile);	/* symbol type */
-	 nasm_write(&sym->sect, 1, ofile);	/* section */
-	 fwriteint16_t(sym->desc, ofile);	/* description */
-
-	/* Fix up the symbol value now that we know the final section
-	   sizes.  */
-	 if (((sym->type & N_TYPE) == N_SECT) && (sym->sect != NO_SECT)) {
-	    nasm_assert(sym->sect <= seg_nsects);
-	    sym->symv.key += sectstab[sym->sect]->addr;
-	 }
-
-	 fwriteptr(sym->symv.key, ofile); /* value (i.e. offset) */
-     }
+    for (i = 0; i < nextdefsym; i++)
+	macho_write_nlist(extdefsyms[i]);
 
+    for (i = 0; i < nundefsym; i++)
+	macho_write_nlist(undefsyms[i]);
 }
 
 /* Fixup the snum in the relocation entries, we should be
-   doing this only for externally referenced symbols. */
-static void macho_fixup_relocs (struct reloc *r)
+   doing this only for externally referenced symbols.  snums maps
+   the initial symbol numbers, of which there are nsnums, to the
+   final ones. */
+static void macho_fixup_relocs (struct section *s,
+				const uint32_t *snums, uint32_t nsnums)
 {
-    struct symbol *sym;
+    struct reloc *r;
+    uint32_t i;
 
-    while (r != NULL) {
-	if (r->ext) {
-	    for (sym = syms; sym != NULL; sym = sym->next) {
-		if (sym->initial_snum == r->snum) {
-		    r->snum = sym->snum;
-		    break;
-		}
-	    }
-	}
-	r = r->next;
+    for (i = 0, r = s->relocs; i < s->nreloc; i++, r++) {
+	if (r->ext && r->snum < nsnums)
+	    r->snum = snums[r->snum];
     }
 }
 
@@ -1540,7 +1523,7 @@ static void macho_write (void)
     /* we don't need to pad here, we are already aligned */
 
     /* emit string table */
-    saa_fpwrite(strs, ofile);
+    nasm_write(strs.data, strs.len, ofile);
 }
 /* We do quite a bit here, starting with finalizing all of the data
    for the object file, writing, and then freeing all of the data from
@@ -1549,16 +1532,24 @@ static void macho_write (void)
 static void macho_cleanup(void)
 {
     struct section *s;
-    struct reloc *r;
     struct symbol *sym;
+    uint32_t *snums, nsnums, i;
 
     /* Sort all symbols.  */
+    nsnums = nsyms;
     macho_layout_symbols (&nsyms, &strslen);
 
     /* Fixup relocation entries */
+    snums = nasm_malloc(nsnums * sizeof(*snums));
+    for (i = 0; i < nsnums; i++)
+	snums[i] = i;
+    for (sym = syms; sym != NULL; sym = sym->next)
+	if (sym->initial_snum >= 0 && (uint32_t)sym->initial_snum < nsnums)
+	    snums[sym->initial_snum] = sym->snum;
     for (s = sects; s != NULL; s = s->next) {
-	macho_fixup_relocs (s->relocs);
+	macho_fixup_relocs (s, snums, nsnums);
     }
+    nasm_free(snums);
 
     /* First calculate and finalize needed values.  */
     macho_calculate_sizes();
@@ -1570,16 +1561,12 @@ static void macho_cleanup(void)
         sects = sects->next;
 
         saa_free(s->data);
-        while (s->relocs != NULL) {
-            r = s->relocs;
-            s->relocs = s->relocs->next;
-            nasm_free(r);
-        }
+        nasm_free(s->relocs);
 
         nasm_free(s);
     }
 
-    saa_free(strs);
+    strtab_free(&strs);
     raa_free(extsyms);
 
     while (syms) {
@@ -1591,6 +1578,7 @@ static void macho_cleanup(void)
     nasm_free(extdefsyms);
     nasm_free(undefsyms);
     nasm_free(sectstab);
+    segmap_free(&segfileidx);
 }
 
 #ifdef OF_MACHO32
@@ -1628,6 +1616,8 @@ const struct ofmt of_macho32 = {
     macho32_init,
     null_setinfo,
     macho_output,
+    generic_output_block,
+    generic_output_fill,
     macho_symdef,
     macho_section,
     macho_sectalign,
@@ -1675,6 +1665,8 @@ const struct ofmt of_macho64 = {
     macho64_init,
     null_setinfo,
     macho_output,
+    generic_output_block,
+    generic_output_fill,
     macho_symdef,
     macho_section,
     macho_sectalign,
@@ -2668,6 +2668,8 @@ const struct ofmt of_obj = {
     obj_init,
     obj_set_info,
     obj_out,
+    generic_output_block,
+    generic_output_fill,
     obj_deflabel,
     obj_segment,
     obj_sectalign,
@@ -783,6 +783,8 @@ const struct ofmt of_rdf2 = {
     rdf2_init,
     rdf2_set_info,
     rdf2_out,
+    generic_output_block,
+    generic_output_fill,
     rdf2_deflabel,
     rdf2_section_names,
     null_sectalign,
@@ -479,15 +479,15 @@ struct coff_Section {
     uint32_t len;
     int nrelocs;
     int32_t index;
-    struct coff_Reloc *head, **tail;
+    struct coff_Reloc *relocs;
+    int relsize;                /* allocated size of relocs[] */
     uint32_t flags;             /* section flags */
     char *name;
-    int32_t namepos;            /* Offset of name into the strings table */
+    int32_t namepos;            /* Strings table handle of name, or -1 */
     int32_t pos, relpos;
 };
 
 struct coff_Reloc {
-    struct coff_Reloc *next;
     int32_t address;            /* relative to _start_ of section */
     int32_t symbol;             /* symbol number */
     enum {
@@ -500,13 +500,12 @@ struct coff_Reloc {
 
 struct coff_Symbol {
     char name[9];
-    int32_t strpos;             /* string table position of name */
+    int32_t strpos;             /* string table handle of name, or -1 */
     int32_t value;              /* address, or COMMON variable size */
     int section;                /* section number where it's defined
                                  * - in COFF codes, not NASM codes */
     bool is_global;             /* is it a global symbol or not? */
     int16_t type;               /* 0 - notype, 0x20 - function */
-    int32_t namlen;             /* full name length */
 };
 
 struct coff_DebugInfo {
@@ -520,13 +519,14 @@ extern struct coff_Section **coff_sects;
 extern int coff_nsects;
 extern struct SAA *coff_syms;
 extern uint32_t coff_nsyms;
-extern struct SAA *coff_strs;
+extern struct strtab coff_strs;
 extern bool win32, win64;
 
 extern char coff_infile[FILENAME_MAX];
 extern char coff_outfile[FILENAME_MAX];
 
 extern int coff_make_section(char *name, uint32_t flags);
+extern struct coff_Reloc *coff_new_reloc(struct coff_Section *sect);
 
 
 #endif /* PECOFF_H */
@@ -47,7 +47,7 @@
  * or bss segments, therefore for 16 bit programs whose code, data or BSS
  * segment exceeds 64K in size, it will not work. This program probably
  * won't work if compiled by a 16 bit compiler. Try DJGPP if you're running
- * under DOS. '#define STINGY_MEMORY' may help a little.
+ * under DOS.
  */
 
 #include "compiler.h"
@@ -67,16 +67,22 @@
 
 #define LDRDF_VERSION "1.08"
 
-/* #define STINGY_MEMORY */
-
 /* =======================================================================
  * Types & macros that are private to this program
  */
 
+/* a 32-bit relocation, to be added in when the module is written out */
+struct fixup {
+    int32_t pos;                /* within the module's segment */
+    int32_t value;
+};
+
 struct segment_infonode {
     int dest_seg;               /* output segment to be placed into, -1 to
                                    skip linking this segment */
     int32_t reloc;                 /* segment's relocation factor */
+    struct fixup *fixups;       /* relocations yet to be applied */
+    int nfixups, maxfixups;
 };
 
 struct modulenode {
@@ -155,6 +161,7 @@ struct ldrdfoptions {
     int stderr_redir;
     int objpath;
     int libpath;
+    int jobs;
 } options;
 
 int errorcount = 0;             /* determines main program exit status */
@@ -243,7 +250,6 @@ void processmodule(const char *filename, struct modulenode *mod)
 {
     struct segconfig sconf;
     int seg, outseg;
-    void *header;
     rdfheaderrec *hr;
     int32_t bssamount = 0;
     int bss_was_referenced = 0;
@@ -251,6 +257,10 @@ void processmodule(const char *filename, struct modulenode *mod)
     memset(&sconf, 0, sizeof sconf);
 
     for (seg = 0; seg < mod->f.nsegs; seg++) {
+        mod->seginfo[seg].fixups = NULL;
+        mod->seginfo[seg].nfixups = 0;
+        mod->seginfo[seg].maxfixups = 0;
+
         /*
          * get the segment configuration for this type from the segment
          * table. getsegconfig() is a macro, defined in ldsegs.h.
@@ -325,12 +335,7 @@ void processmodule(const char *filename, struct modulenode *mod)
      * extract symbols from the header, and dump them into the
      * symbol table
      */
-    header = malloc(mod->f.header_len);
-    if (!header) {
-        fprintf(stderr, "ldrdf: not enough memory\n");
-        exit(1);
-    }
-    if (rdfloadseg(&mod->f, RDOFF_HEADER, header)) {
+    if (rdfmapseg(&mod->f, RDOFF_HEADER)) {
         rdfperror("ldrdf", filename);
         exit(1);
     }
@@ -413,32 +418,6 @@ void processmodule(const char *filename, struct modulenode *mod)
         }
         bss_length += bssamount;
     }
-#ifdef STINGY_MEMORY
-    /*
-     * we free the header buffer here, to save memory later.
-     * this isn't efficient, but probably halves the memory usage
-     * of this program...
-     */
-    mod->f.header_loc = NULL;
-    free(header);
-
-#endif
-
-}
-
-/*
- * Return 1 if a given module is in the list, 0 otherwise.
- */
-static int lookformodule(const char *name)
-{
-    struct modulenode *curr = modules;
-
-    while (curr) {
-        if (!strcmp(name, curr->name))
-            return 1;
-        curr = curr->next;
-    }
-    return 0;
 }
 
 /*
@@ -605,13 +584,12 @@ static void add_library(const char *name)
 static int search_libraries(void)
 {
     struct librarynode *cur;
+    struct rdl_module *mod;
     rdffile f;
-    int i;
-    void *header;
+    int i, j;
     int segment;
     int32_t offset;
     int doneanything = 0, pass = 1, keepfile;
-    rdfheaderrec *hr;
 
     cur = libraries;
 
@@ -619,36 +597,33 @@ static int search_libraries(void)
         if (options.verbose > 2)
             printf("scanning library `%s', pass %d...\n", cur->name, pass);
 
-        for (i = 0; rdl_openmodule(cur, i, &f) == 0; i++) {
-            if (pass == 2 && lookformodule(f.name))
+        /*
+         * The index lists each module's exports, so deciding whether
+         * a module is wanted takes a symbol table lookup per export,
+         * without reading the module itself.
+         */
+        if (rdl_index(cur, 1)) {
+            rdl_perror("ldrdf", cur->name);
+            errorcount++;
+            return 0;
+        }
+
+        for (i = 0; i < cur->nmodules; i++) {
+            mod = &cur->modules[i];
+            if (mod->included)
                 continue;
 
             if (options.verbose > 3)
-                printf("  looking in module `%s'\n", f.name);
-
-            header = malloc(f.header_len);
-            if (!header) {
-                fprintf(stderr, "ldrdf: not enough memory\n");
-                exit(1);
-            }
-            if (rdfloadseg(&f, RDOFF_HEADER, header)) {
-                rdfperror("ldrdf", f.name);
-                errorcount++;
-                return 0;
-            }
+                printf("  looking in module `%s'\n", mod->name);
 
             keepfile = 0;
 
-            while ((hr = rdfgetheaderrec(&f))) {
-                /* We're only interested in exports, so skip others */
-                if (hr->type != RDFREC_GLOBAL)
-                    continue;
-
+            for (j = 0; j < mod->nsyms; j++) {
                 /*
                  * If the symbol is marked as SYM_GLOBAL, somebody will be
                  * definitely interested in it..
                  */
-                if ((hr->e.flags & SYM_GLOBAL) == 0) {
+                if ((mod->syms[j].flags & SYM_GLOBAL) == 0) {
                     /*
                      * otherwise the symbol is just public. Find it in
                      * the symbol table. If the symbol isn't defined, we
@@ -658,39 +633,41 @@ static int search_libraries(void)
                      * module into the list of modules to use, and go
                      * immediately on to the next module...
                      */
-                    if (!symtab_get(hr->e.label, &segment, &offset)
+                    if (!symtab_get(mod->syms[j].name, &segment, &offset)
                         || segment != -1)
                         continue;
                 }
 
-                doneanything = 1;
                 keepfile = 1;
-
-                /*
-                 * as there are undefined symbols, we can assume that
-                 * there are modules on the module list by the time
-                 * we get here.
-                 */
-                lastmodule->next = malloc(sizeof(*lastmodule->next));
-                if (!lastmodule->next) {
-                    fprintf(stderr, "ldrdf: not enough memory\n");
-                    exit(1);
-                }
-                lastmodule = lastmodule->next;
-                memcpy(&lastmodule->f, &f, sizeof(f));
-                lastmodule->name = strdup(f.name);
-                lastmodule->next = NULL;
-                processmodule(f.name, lastmodule);
                 break;
             }
-            if (!keepfile) {
-                free(f.name);
-                f.name = NULL;
-                f.fp = NULL;
+            if (!keepfile)
+                continue;
+
+            if (rdl_openmodule(cur, i, &f)) {
+                rdl_perror("ldrdf", mod->name);
+                errorcount++;
+                return 0;
             }
+            doneanything = 1;
+            mod->included = 1;
+
+            /*
+             * as there are undefined symbols, we can assume that
+             * there are modules on the module list by the time
+             * we get here.
+             */
+            lastmodule->next = malloc(sizeof(*lastmodule->next));
+            if (!lastmodule->next) {
+                fprintf(stderr, "ldrdf: not enough memory\n");
+                exit(1);
+            }
+            lastmodule = lastmodule->next;
+            memcpy(&lastmodule->f, &f, sizeof(f));
+            lastmodule->name = strdup(f.name);
+            lastmodule->next = NULL;
+            processmodule(f.name, lastmodule);
         }
-        if (rdl_error != 0 && rdl_error != RDL_ENOTFOUND)
-            rdl_perror("ldrdf", cur->name);
 
         cur = cur->next;
         if (cur == NULL && pass == 1) {
@@ -702,6 +679,44 @@ static int search_libraries(void)
     return doneanything;
 }
 
+/*
+ * add_fixup()
+ *
+ * queue a 32-bit relocation of a module's segment
+ */
+static void add_fixup(struct segment_infonode *si, int32_t pos,
+                      int32_t value)
+{
+    if (si->nfixups >= si->maxfixups) {
+        si->maxfixups = si->maxfixups ? si->maxfixups << 1 : 64;
+        si->fixups = realloc(si->fixups,
+                             si->maxfixups * sizeof(*si->fixups));
+        if (!si->fixups) {
+            fprintf(stderr, "ldrdf: out of memory\n");
+            exit(1);
+        }
+    }
+    si->fixups[si->nfixups].pos = pos;
+    si->fixups[si->nfixups].value = value;
+    si->nfixups++;
+}
+
+/*
+ * apply_fixups()
+ *
+ * apply the queued relocations of one module's segment; no two module
+ * segments overlap in the output, so these can run in parallel
+ */
+static void apply_fixups(void *arg, int i)
+{
+    struct segment_infonode *si = ((struct segment_infonode **)arg)[i];
+    uint8_t *data = outputseg[si->dest_seg].data + si->reloc;
+    int j;
+
+    for (j = 0; j < si->nfixups; j++)
+        *(int32_t *)(data + si->fixups[j].pos) += si->fixups[j].value;
+}
+
 /*
  * write_output()
  *
@@ -715,12 +730,13 @@ static void write_output(const char *filename)
     rdf_headerbuf *rdfheader;
     struct modulenode *cur;
     int i, n, availableseg, seg, localseg, isrelative;
-    void *header;
     rdfheaderrec *hr, newrec;
     symtabEnt *se;
     segtab segs;
     int32_t offset;
     uint8_t *data;
+    struct segment_infonode **batches;
+    int nbatches;
 
     if ((f = fopen(filename, "wb")) == NULL) {
         fprintf(stderr, "ldrdf: couldn't open %s for output\n", filename);
@@ -841,18 +857,7 @@ static void write_output(const char *filename)
          * Perform fixups, and add new header records where required
          */
 
-        header = malloc(cur->f.header_len);
-        if (!header) {
-            fprintf(stderr, "ldrdf: out of memory\n");
-            exit(1);
-        }
-
-        if (cur->f.header_loc)
-            rdfheaderrewind(&cur->f);
-        else if (rdfloadseg(&cur->f, RDOFF_HEADER, header)) {
-            rdfperror("ldrdf", cur->name);
-            exit(1);
-        }
+        rdfheaderrewind(&cur->f);
 
         /*
          * we need to create a local segment number -> location
@@ -916,6 +921,22 @@ static void write_output(const char *filename)
                     break;
                 }
 
+                if (cur->seginfo[localseg].dest_seg == -1) {
+                    fprintf(stderr, "%s: reloc from ignored segment (%d)\n",
+                            cur->name, hr->r.segment);
+                    errorcount++;
+                    break;
+                }
+
+                if (hr->r.offset < 0 || hr->r.offset >
+                    cur->f.seg[localseg].length - hr->r.length) {
+                    fprintf(stderr, "%s: reloc outside segment "
+                            "(%02x:%08"PRIx32")\n", cur->name,
+                            (int)hr->r.segment, hr->r.offset);
+                    errorcount++;
+                    break;
+                }
+
                 /*
                  * okay, now the relocation is in the segment pointed to by
                  * cur->seginfo[localseg], and we know everything else is
@@ -956,8 +977,13 @@ static void write_output(const char *filename)
                     *(int16_t *)data = (int16_t)offset;
                     break;
                 case 4:
-                    *(int32_t *)data += offset;
-                    /* we can't easily detect overflow on this one */
+                    /*
+                     * we can't easily detect overflow on this one, so
+                     * there's nothing to report, and it is applied
+                     * later on along with all the others
+                     */
+                    add_fixup(&cur->seginfo[localseg], hr->r.offset,
+                              offset);
                     break;
                 }
 
@@ -1125,11 +1151,38 @@ static void write_output(const char *filename)
             }
         }
 
-        free(header);
         done_seglocations(&segs);
 
     }
 
+    /*
+     * Apply the 32-bit relocations, each module's segment as a job
+     */
+    nbatches = 0;
+    for (cur = modules; cur; cur = cur->next)
+        for (i = 0; i < cur->f.nsegs; i++)
+            if (cur->seginfo[i].nfixups)
+                nbatches++;
+    batches = malloc((nbatches ? nbatches : 1) * sizeof(*batches));
+    if (!batches) {
+        fprintf(stderr, "ldrdf: out of memory\n");
+        exit(1);
+    }
+    nbatches = 0;
+    for (cur = modules; cur; cur = cur->next)
+        for (i = 0; i < cur->f.nsegs; i++)
+            if (cur->seginfo[i].nfixups)
+                batches[nbatches++] = &cur->seginfo[i];
+
+    nasm_parallel(apply_fixups, batches, nbatches, options.jobs);
+
+    for (i = 0; i < nbatches; i++) {
+        free(batches[i]->fixups);
+        batches[i]->fixups = NULL;
+        batches[i]->nfixups = batches[i]->maxfixups = 0;
+    }
+    free(batches);
+
     /*
      * combined BSS reservation for the entire results
      */
@@ -1193,6 +1246,7 @@ static void usage(void)
            "   -o name         write output in file 'name'\n"
            "   -j path         specify objects search path\n"
            "   -L path         specify libraries search path\n"
+           "   -J n            apply relocations on n threads\n"
            "   -g file         embed 'file' as a first header record with type 'generic'\n"
            "   -mn name        add module name record at the beginning of output file\n");
     exit(0);
@@ -1208,6 +1262,7 @@ int main(int argc, char **argv)
     options.align = 16;
     options.dynalink = 0;
     options.strip = 0;
+    options.jobs = 1;
 
     error_file = stderr;
 
@@ -1242,6 +1297,15 @@ int main(int argc, char **argv)
             }
             argv++, argc--;
             break;
+        case 'J':
+            options.jobs = argv[1] ? atoi(argv[1]) : 0;
+            if (options.jobs <= 0) {
+                fprintf(stderr,
+                        "ldrdf: -J expects a positive number argument\n");
+                exit(1);
+            }
+            argv++, argc--;
+            break;
         case 's':
             options.strip = 1;
             break;
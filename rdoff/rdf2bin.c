@@ -52,6 +52,7 @@ static uint32_t origin = 0;
 static bool origin_def = false;
 static uint32_t align = 16;
 static bool align_def = false;
+static int jobs = 1;
 
 struct output_format {
     const char *name;
@@ -281,6 +282,7 @@ static void usage(void)
 	    "    -o origin       Specify the relocation origin\n"
 	    "    -p alignment    Specify minimum segment alignment\n"
 	    "    -f format       Select format (bin, com, ith, srec)\n"
+	    "    -j jobs         Relocate on this many threads\n"
 	    "    -q              Run quiet\n"
 	    "    -v              Run verbose\n",
 	    progname);
@@ -332,6 +334,15 @@ int main(int argc, char **argv)
 		argv++, argc--;
 		format = *argv;
 		break;
+	    case 'j':
+		argv++, argc--;
+		jobs = readnum(*argv, &err);
+		if (err || jobs < 1) {
+		    fprintf(stderr, "%s: invalid parameter: %s\n",
+			    progname, *argv);
+		    return 1;
+		}
+		break;
 	    case 'q':
 		quiet = true;
 		break;
@@ -404,7 +415,7 @@ int main(int argc, char **argv)
 	printf("code: %08"PRIx32"\ndata: %08"PRIx32"\nbss:  %08"PRIx32"\n",
 	       m->textrel, m->datarel, m->bssrel);
 
-    rdf_relocate(m);
+    rdf_relocate(m, jobs);
 
     argv++;
 
@@ -315,18 +315,20 @@ int main(int argc, char **argv)
             printf("  Length = %"PRId32" bytes\n", l);
             segmentcontentlength += l;
 
+            if (!verbose) {
+                fseek(infile, l, SEEK_CUR);     /* no need to read it */
+                continue;
+            }
+
             offset = 0;
             while (l--) {
                 fread(id, 1, 1, infile);
-                if (verbose) {
-                    if (offset % 16 == 0)
-                        printf("\n%08"PRIx32" ", offset);
-                    printf(" %02x", (int)(uint8_t)id[0]);
-                    offset++;
-                }
+                if (offset % 16 == 0)
+                    printf("\n%08"PRIx32" ", offset);
+                printf(" %02x", (int)(uint8_t)id[0]);
+                offset++;
             }
-            if (verbose)
-                printf("\n");
+            printf("\n");
         } while (!feof(infile));
         if (!foundnullsegment)
             printf("\nWarning: unexpected end of file - "
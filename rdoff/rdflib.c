@@ -47,8 +47,10 @@
  * There may be an optional directory placed on the end of the file.
  * The format of the directory will be 'RDLDD' followed by a version
  * number, followed by the length of the directory, and then the
- * directory, the format of which has not yet been designed.
- * The module name of the directory must be '.dir'.
+ * directory, which indexes the global symbols of the modules (see
+ * rdlib.h).  The module name of the directory must be '.dir'.  It is
+ * made by the 'i' command, and dropped by 'r' and 'd'; the linker
+ * ignores a directory which isn't the last module in the library.
  *
  * All module names beginning with '.' are reserved for possible future
  * extensions. The linker ignores all such modules, assuming they have
@@ -64,6 +66,11 @@
 #include <string.h>
 #include <time.h>
 
+#define RDOFF_UTILS
+
+#include "rdoff.h"
+#include "rdlib.h"
+
 /* functions supported:
  *   create a library	(no extra operands required)
  *   add a module from a library (requires filename and name to give mod.)
@@ -71,6 +78,7 @@
  *   delete a module from a library (requires given name)
  *   extract a module from the library (requires given name and filename)
  *   list modules
+ *   index the global symbols of the modules
  */
 
 const char *usage =
@@ -81,7 +89,8 @@ const char *usage =
     "    a - add module (operands = filename module-name)\n"
     "    x - extract               (module-name filename)\n"
     "    r - replace               (module-name filename)\n"
-    "    d - delete                (module-name)\n" "    t - list\n";
+    "    d - delete                (module-name)\n" "    t - list\n"
+    "    i - index global symbols\n";
 
 /* Library signature */
 const char *rdl_signature = "RDLIB2", *sig_modname = ".sig";
@@ -151,14 +160,45 @@ static int32_t copyint32_t(FILE * fp, FILE * fp2)
     return l;
 }
 
+/*
+ * Read a module name into buf; false at the end of the library
+ */
+static bool readname(FILE * fp, char *buf)
+{
+    char *p = buf;
+
+    while ((*(p++) = (char)fgetc(fp)))
+        if (feof(fp))
+            break;
+
+    return !feof(fp);
+}
+
+/*
+ * Copy the module whose name has just been read from fp to fp2, name
+ * and all, unless it is the directory, which won't match the library
+ * any more and is stepped over
+ */
+static void copymodule(FILE * fp, FILE * fp2, const char *name)
+{
+    if (!strcmp(name, RDL_DIR_NAME))
+        fp2 = NULL;
+
+    if (fp2)
+        fwrite(name, 1, strlen(name) + 1, fp2);
+    if (copybytes(fp, fp2, 6) >= '2' || name[0] == '.')
+        copybytes(fp, fp2, copyint32_t(fp, fp2));
+}
+
 int main(int argc, char **argv)
 {
     FILE *fp, *fp2 = NULL, *fptmp;
     char *p, buf[256], c;
-    int i;
+    int i, j;
     int32_t l;
     time_t t;
     char rdbuf[10];
+    struct librarynode lib;
 
     _argv = argv;
 
@@ -353,29 +393,15 @@ int main(int argc, char **argv)
         rewind(fptmp);
         freopen(argv[2], "wb", fp);
 
-        while (!feof(fptmp)) {
-            /* read name */
-            p = buf;
-            while ((*(p++) = (char)fgetc(fptmp)))
-                if (feof(fptmp))
-                    break;
-
-            if (feof(fptmp))
-                break;
-
+        while (readname(fptmp, buf)) {
             /* check against desired name */
             if (!strcmp(buf, argv[3])) {
                 fread(p = rdbuf, 1, sizeof(rdbuf), fptmp);
                 l = *(int32_t *)(p + 6);
                 fseek(fptmp, l, SEEK_CUR);
                 break;
-            } else {
-                fwrite(buf, 1, strlen(buf) + 1, fp);    /* module name */
-                if ((c = copybytes(fptmp, fp, 6)) >= '2') {
-                    l = copyint32_t(fptmp, fp);    /* version 2 or above */
-                    copybytes(fptmp, fp, l);    /* entire object */
-                }
             }
+            copymodule(fptmp, fp, buf);
         }
 
         if (argv[1][0] == 'r') {
@@ -401,21 +427,85 @@ int main(int argc, char **argv)
             fclose(fp2);
         }
 
-        /* copy rest of library if any */
-        while (!feof(fptmp)) {
-            i = fgetc(fptmp);
-            if (i == EOF) {
-                break;
-            }
+        /* copy rest of library, but for the directory */
+        while (readname(fptmp, buf))
+            copymodule(fptmp, fp, buf);
 
-            if (fputc(i, fp) == EOF) {
-                fprintf(stderr, "rdflib: write error\n");
-                exit(1);
-            }
+        fclose(fp);
+        fclose(fptmp);
+        break;
+
+    case 'i':                  /* index global symbols */
+        fp = fopen(argv[2], "rb");
+        if (!fp) {
+            fprintf(stderr, "rdflib: could not open '%s'\n", argv[2]);
+            perror("rdflib");
+            exit(1);
         }
 
-        fclose(fp);
+        fptmp = tmpfile();
+        if (!fptmp) {
+            fprintf(stderr, "rdflib: could not open temporary file\n");
+            perror("rdflib");
+            exit(1);
+        }
+
+        /* copy library into temporary file */
+        fseek(fp, 0, SEEK_END);
+        l = ftell(fp);
+        fseek(fp, 0, SEEK_SET);
+        copybytes(fp, fptmp, l);
+        rewind(fptmp);
+        freopen(argv[2], "wb", fp);
+
+        /* write it back without any old directory */
+        while (readname(fptmp, buf))
+            copymodule(fptmp, fp, buf);
         fclose(fptmp);
+        fclose(fp);
+
+        if (rdl_open(&lib, argv[2]) || rdl_index(&lib, 0)) {
+            rdl_perror("rdflib", argv[2]);
+            exit(1);
+        }
+
+        /* and append the new one */
+        l = 4;
+        for (i = 0; i < lib.nmodules; i++) {
+            l += 20;
+            for (j = 0; j < lib.modules[i].nsyms; j++)
+                l += 4 + strlen(lib.modules[i].syms[j].name) + 1;
+        }
+
+        fp = fopen(argv[2], "ab");
+        if (!fp) {
+            fprintf(stderr, "rdflib: could not open '%s'\n", argv[2]);
+            perror("rdflib");
+            exit(1);
+        }
+        fwrite(RDL_DIR_NAME, 1, strlen(RDL_DIR_NAME) + 1, fp);
+        fwrite(RDL_DIR_SIGNATURE, 1, strlen(RDL_DIR_SIGNATURE), fp);
+        fwrite(&l, sizeof(l), 1, fp);
+        l = lib.nmodules;
+        fwrite(&l, sizeof(l), 1, fp);
+        for (i = 0; i < lib.nmodules; i++) {
+            struct rdl_module *mod = &lib.modules[i];
+
+            fwrite(&mod->offset, sizeof(mod->offset), 1, fp);
+            fwrite(&mod->length, sizeof(mod->length), 1, fp);
+            fwrite(&mod->sum, sizeof(mod->sum), 1, fp);
+            l = mod->nsyms;
+            fwrite(&l, sizeof(l), 1, fp);
+            for (j = 0; j < mod->nsyms; j++) {
+                fwrite(&mod->syms[j].flags, sizeof(mod->syms[j].flags), 1, fp);
+                fwrite(mod->syms[j].name, 1, strlen(mod->syms[j].name) + 1,
+                       fp);
+            }
+        }
+        if (fclose(fp)) {
+            fprintf(stderr, "rdflib: write error\n");
+            exit(1);
+        }
         break;
 
     default:
@@ -51,6 +51,7 @@
 #include "rdfload.h"
 #include "symtab.h"
 #include "collectn.h"
+#include "nasmlib.h"
 
 extern int rdf_errno;
 
@@ -58,7 +59,6 @@ rdfmodule *rdfload(const char *filename)
 {
     rdfmodule *f;
     int32_t bsslength = 0;
-    char *hdr;
     rdfheaderrec *r;
 
     f = malloc(sizeof(rdfmodule));
@@ -80,13 +80,15 @@ rdfmodule *rdfload(const char *filename)
         return NULL;
     }
 
-    /* read in text and data segments, and header */
+    /*
+     * read in text and data segments, which get relocated; the header
+     * is only read, so it is used where it is, and the file stays open
+     */
 
     f->t = malloc(f->f.seg[0].length);
     f->d = malloc(f->f.seg[1].length);  /* BSS seg allocated later */
-    hdr = malloc(f->f.header_len);
 
-    if (!f->t || !f->d || !hdr) {
+    if (!f->t || !f->d) {
         rdf_errno = RDF_ERR_NOMEM;
         rdfclose(&f->f);
         if (f->t)
@@ -94,23 +96,19 @@ rdfmodule *rdfload(const char *filename)
         if (f->d)
             free(f->d);
         free(f);
-        free(hdr);
         return NULL;
     }
 
-    if (rdfloadseg(&f->f, RDOFF_HEADER, hdr) ||
+    if (rdfmapseg(&f->f, RDOFF_HEADER) ||
         rdfloadseg(&f->f, RDOFF_CODE, f->t) ||
         rdfloadseg(&f->f, RDOFF_DATA, f->d)) {
         rdfclose(&f->f);
         free(f->t);
         free(f->d);
         free(f);
-        free(hdr);
         return NULL;
     }
 
-    rdfclose(&f->f);
-
     /* Allocate BSS segment; step through header and count BSS records */
 
     while ((r = rdfgetheaderrec(&f->f))) {
@@ -120,10 +118,10 @@ rdfmodule *rdfload(const char *filename)
 
     f->b = malloc(bsslength);
     if (bsslength && (!f->b)) {
+        rdfclose(&f->f);
         free(f->t);
         free(f->d);
         free(f);
-        free(hdr);
         rdf_errno = RDF_ERR_NOMEM;
         return NULL;
     }
@@ -137,18 +135,84 @@ rdfmodule *rdfload(const char *filename)
     return f;
 }
 
-int rdf_relocate(rdfmodule * m)
+/*
+ * Relocations are collected per segment while the header is read, and
+ * the two segments are then patched independently of each other.
+ */
+struct rdf_fixup {
+    int32_t offset;
+    int32_t rel;
+    int length;
+};
+
+struct rdf_fixups {
+    uint8_t *seg;
+    struct rdf_fixup *fixups;
+    int n, size;
+};
+
+static int rdf_addfixup(struct rdf_fixups *fx, int32_t offset, int length,
+                        int32_t rel)
+{
+    if (fx->n >= fx->size) {
+        struct rdf_fixup *p;
+
+        fx->size = fx->size ? fx->size << 1 : 64;
+        p = realloc(fx->fixups, fx->size * sizeof(*p));
+        if (!p)
+            return 1;
+        fx->fixups = p;
+    }
+    fx->fixups[fx->n].offset = offset;
+    fx->fixups[fx->n].rel = rel;
+    fx->fixups[fx->n].length = length;
+    fx->n++;
+    return 0;
+}
+
+static void rdf_applyfixups(void *arg, int i)
+{
+    const struct rdf_fixups *fx = (const struct rdf_fixups *)arg + i;
+    uint8_t *seg = fx->seg;
+    int j;
+
+    for (j = 0; j < fx->n; j++) {
+        const struct rdf_fixup *f = &fx->fixups[j];
+
+        /* it doesn't matter in this case that the code is non-portable,
+           as the entire concept of executing a module like this is
+           non-portable */
+        switch (f->length) {
+        case 1:
+            seg[f->offset] += (char)f->rel;
+            break;
+        case 2:
+            *(uint16_t *) (seg + f->offset) += (uint16_t) f->rel;
+            break;
+        case 4:
+            *(int32_t *)(seg + f->offset) += f->rel;
+            break;
+        }
+    }
+}
+
+int rdf_relocate(rdfmodule * m, int jobs)
 {
     rdfheaderrec *r;
     Collection imports;
     symtabEnt e;
     int32_t rel;
-    uint8_t *seg;
+    struct rdf_fixups fx[2];
+    int i, err = 0;
 
     rdfheaderrewind(&m->f);
     collection_init(&imports);
 
-    while ((r = rdfgetheaderrec(&m->f))) {
+    memset(fx, 0, sizeof(fx));
+    fx[0].seg = m->t;
+    fx[1].seg = m->d;
+
+    while (!err && (r = rdfgetheaderrec(&m->f))) {
         switch (r->type) {
         case 1:                /* Relocation record */
 
@@ -160,33 +224,18 @@ int rdf_relocate(rdfmodule * m)
                 rel = m->datarel;
             else if (r->r.refseg == 2)
                 rel = m->bssrel;
-            else
+            else {
                 /* We currently do not support load-time linkage.
                    This should be added some time soon... */
 
-                return 1;       /* return error code */
-
-            if ((r->r.segment & 63) == 0)
-                seg = m->t;
-            else if ((r->r.segment & 63) == 1)
-                seg = m->d;
-            else
-                continue;       /* relocation not in a loaded segment */
-
-            /* it doesn't matter in this case that the code is non-portable,
-               as the entire concept of executing a module like this is
-               non-portable */
-            switch (r->r.length) {
-            case 1:
-                seg[r->r.offset] += (char)rel;
-                break;
-            case 2:
-                *(uint16_t *) (seg + r->r.offset) += (uint16_t) rel;
-                break;
-            case 4:
-                *(int32_t *)(seg + r->r.offset) += rel;
+                err = 1;        /* return error code */
                 break;
             }
+
+            if ((r->r.segment & 63) == 0 || (r->r.segment & 63) == 1)
+                err = rdf_addfixup(&fx[r->r.segment & 63], r->r.offset,
+                                   r->r.length, rel);
+            /* else relocation not in a loaded segment */
             break;
 
         case 3:                /* export record - add to symtab */
@@ -196,8 +245,10 @@ int rdf_relocate(rdfmodule * m)
                                       m->bssrel);       /* 2 -> bss  */
             e.flags = 0;
             e.name = malloc(strlen(r->e.label) + 1);
-            if (!e.name)
-                return 1;
+            if (!e.name) {
+                err = 1;
+                break;
+            }
 
             strcpy(e.name, r->e.label);
             symtabInsert(m->symtab, &e);
@@ -206,8 +257,14 @@ int rdf_relocate(rdfmodule * m)
         case 6:                /* segment relocation */
             fprintf(stderr, "%s: segment relocation not supported by this "
                     "loader\n", m->f.name);
-            return 1;
+            err = 1;
+            break;
         }
     }
-    return 0;
+
+    /* even after an error, what came before it gets relocated */
+    nasm_parallel(rdf_applyfixups, fx, 2, jobs);
+    for (i = 0; i < 2; i++)
+        free(fx[i].fixups);
+    return err;
 }
@@ -26,6 +26,6 @@ typedef struct RDFModuleStruct {
 } rdfmodule;
 
 rdfmodule *rdfload(const char *filename);
-int rdf_relocate(rdfmodule * m);
+int rdf_relocate(rdfmodule * m, int jobs);
 
 #endif
@@ -46,6 +46,8 @@
 #include "rdoff.h"
 #include "rdlib.h"
 #include "rdlar.h"
+#include "nasmlib.h"
+#include "hashtbl.h"
 
 /* See Texinfo documentation about new RDOFF libraries format */
 
@@ -123,6 +125,9 @@ int rdl_open(struct librarynode *lib, const char *name)
     lib->name = strdup(name);
     lib->referenced = 0;
     lib->next = NULL;
+    lib->nmodules = 0;
+    lib->modules = NULL;
+    lib->map = NULL;
     return 0;
 }
 
@@ -213,73 +218,248 @@ int rdl_searchlib(struct librarynode *lib, const char *label, rdffile * f)
 
 int rdl_openmodule(struct librarynode *lib, int moduleno, rdffile * f)
 {
-    char buf[512];
-    int i, cmod, t;
-    int32_t length;
+    struct rdl_module *mod;
 
-    lib->referenced++;
+    if (rdl_index(lib, 1))
+        return rdl_error;
 
-    if (!lib->fp) {
-        lib->fp = fopen(lib->name, "rb");
-        if (!lib->fp) {
-            lib->referenced--;
-            return (rdl_error = 1);
-        }
-    } else
-        rewind(lib->fp);
+    if (moduleno < 0 || moduleno >= lib->nmodules)
+        return rdl_error = 4;   /* module not found */
 
-    cmod = -1;
-    while (!feof(lib->fp)) {
-        strcpy(buf, lib->name);
-        i = strlen(buf);
-        buf[i++] = '.';
-        t = i;
-        while (fread(buf + i, 1, 1, lib->fp) == 1 && i < 512 && buf[i])
-            i++;
-        buf[i] = 0;
-        if (feof(lib->fp))
-            break;
+    mod = &lib->modules[moduleno];
+    return rdl_error = 16 * rdfopenmem(f, lib->map->data + mod->offset,
+                                       lib->map->size - mod->offset,
+                                       &lib->referenced, mod->name);
+}
 
-        if (buf[t] != '.')      /* special module - not counted in the numbering */
-            cmod++;             /* of RDOFF modules - must be referred to by name */
+/*
+ * The checksum of a module's header records, which is where its
+ * exports are.  p is the module's signature, and avail the number of
+ * bytes of it there are after the content length.
+ */
+static uint64_t rdl_headersum(const char *p, int32_t avail)
+{
+    int32_t hlen = 0;
 
-        if (cmod == moduleno) {
-            rdl_error = 16 *
-                rdfopenhere(f, lib->fp, &lib->referenced, buf);
-            lib->referenced--;
-            if (!lib->referenced) {
-                fclose(lib->fp);
-                lib->fp = NULL;
-            }
-            return rdl_error;
+    if (avail >= 4) {
+        memcpy(&hlen, p + 10, 4);
+        if (hlen < 0 || hlen > avail - 4)
+            hlen = avail - 4;
+        hlen += 4;
+    }
+    return crc64b(CRC64_INIT, p + 10, hlen);
+}
+
+/*
+ * Read the index from the ".dir" module, if it is up to date.
+ * Returns 0 if it was not.
+ */
+static int rdl_readdir(struct librarynode *lib, const char *dir,
+                       int32_t dirlen)
+{
+    const char *p = dir, *end = dir + dirlen, *q;
+    int32_t n;
+    uint64_t sum;
+    int i, j;
+
+#define DIRREAD(v) do {                         \
+        if (end - p < (ptrdiff_t)sizeof(v))     \
+            goto stale;                         \
+        memcpy(&(v), p, sizeof(v));             \
+        p += sizeof(v);                         \
+    } while (0)
+
+    DIRREAD(n);
+    if (n != lib->nmodules)
+        goto stale;
+    for (i = 0; i < lib->nmodules; i++) {
+        struct rdl_module *mod = &lib->modules[i];
+
+        DIRREAD(n);
+        if (n != mod->offset)
+            goto stale;
+        DIRREAD(n);
+        if (n != mod->length)
+            goto stale;
+        DIRREAD(sum);
+        if (sum != mod->sum)
+            goto stale;
+        DIRREAD(n);
+        if (n < 0 || n > (end - p) / 5)
+            goto stale;
+        mod->nsyms = n;
+        mod->syms = malloc((n ? n : 1) * sizeof(*mod->syms));
+        if (!mod->syms) {
+            fprintf(stderr, "rdlib: out of memory\n");
+            exit(1);
+        }
+        for (j = 0; j < n; j++) {
+            DIRREAD(mod->syms[j].flags);
+            q = memchr(p, 0, end - p);
+            if (!q)
+                goto stale;
+            mod->syms[j].name = strdup(p);
+            p = q + 1;
         }
+    }
+#undef DIRREAD
+
+    return 1;
+
+stale:
+    for (i = 0; i < lib->nmodules; i++) {
+        struct rdl_module *mod = &lib->modules[i];
+        for (j = 0; j < mod->nsyms; j++)
+            free(mod->syms[j].name);
+        free(mod->syms);
+        mod->syms = NULL;
+        mod->nsyms = 0;
+    }
+    return 0;
+}
+
+/*
+ * Build the library index: where each RDOFF module is, and what it
+ * exports.  The exports come from the ".dir" module if usedir is set
+ * and the directory matches the library, else from the module headers.
+ * The library stays mapped in memory for rdl_openmodule() to use.
+ */
+int rdl_index(struct librarynode *lib, int usedir)
+{
+    FILE *fp;
+    const char *data, *end;
+    char buf[512];
+    int i, t, size = 0;
+    int32_t len, length, pos, dirpos = -1, dirlen = 0;
+    struct rdl_module *mod;
+    rdffile f;
+    rdfheaderrec *hr;
+
+    if (lib->modules)
+        return 0;
+
+    rdl_error = 0;
+    fp = fopen(lib->name, "rb");
+    if (!fp)
+        return rdl_error = 1;
+    lib->map = malloc(sizeof(*lib->map));
+    if (!lib->map) {
+        fprintf(stderr, "rdlib: out of memory\n");
+        exit(1);
+    }
+    if (!nasm_map_file(lib->map, fp)) {
+        fclose(fp);
+        free(lib->map);
+        lib->map = NULL;
+        return rdl_error = 1;
+    }
+    fclose(fp);
+    if (lib->map->size > INT32_MAX) {
+        nasm_unmap_file(lib->map);
+        free(lib->map);
+        lib->map = NULL;
+        return rdl_error = 2;
+    }
+    data = lib->map->data;
+    len = (int32_t)lib->map->size;
+
+    /*
+     * Walk the module list; this only looks at the module names and
+     * lengths.
+     */
+    strcpy(buf, lib->name);
+    t = strlen(buf);
+    buf[t++] = '.';
+    pos = 0;
+    while (pos < len) {
+        end = memchr(data + pos, 0, len - pos);
+        if (!end)
+            break;
+        i = end - (data + pos);
+        if (i > 511 - t)
+            i = 511 - t;
+        memcpy(buf + t, data + pos, i);
+        buf[t + i] = 0;
+        pos = end - data + 1;
+
+        if (len - pos < 10)
+            break;
+        memcpy(&length, data + pos + 6, 4);
 
-        fread(buf, 6, 1, lib->fp);
-        buf[6] = 0;
         if (buf[t] == '.') {
-            /* do nothing */
-        } else if (strncmp(buf, "RDOFF", 5)) {
-            if (!--lib->referenced) {
-                fclose(lib->fp);
-                lib->fp = NULL;
+            if (!strcmp(buf + t, RDL_DIR_NAME) &&
+                !memcmp(data + pos, RDL_DIR_SIGNATURE, 6)) {
+                dirpos = pos + 10;
+                dirlen = length;
             }
-            return rdl_error = 2;
-        } else if (buf[5] != '2') {
-            if (!--lib->referenced) {
-                fclose(lib->fp);
-                lib->fp = NULL;
+        } else {
+            if (lib->nmodules >= size) {
+                size = size ? size << 1 : 64;
+                lib->modules = realloc(lib->modules,
+                                       size * sizeof(*lib->modules));
+                if (!lib->modules) {
+                    fprintf(stderr, "rdlib: out of memory\n");
+                    exit(1);
+                }
             }
-            return rdl_error = 3;
+            mod = &lib->modules[lib->nmodules++];
+            mod->name = strdup(buf);
+            mod->offset = pos;
+            mod->length = length;
+            mod->sum = rdl_headersum(data + pos,
+                                     length < len - pos - 10 ?
+                                     length : len - pos - 10);
+            mod->nsyms = 0;
+            mod->syms = NULL;
+            mod->included = 0;
+            dirpos = -1;        /* a directory must come last */
         }
+        if (length < 0 || length > len - pos - 10)
+            break;
+        pos += 10 + length;
+    }
 
-        fread(&length, 4, 1, lib->fp);
-        fseek(lib->fp, length, SEEK_CUR);       /* skip over the module */
+    if (!lib->modules) {
+        /* make an empty library look indexed, too */
+        lib->modules = malloc(sizeof(*lib->modules));
+        if (!lib->modules) {
+            fprintf(stderr, "rdlib: out of memory\n");
+            exit(1);
+        }
     }
-    if (!--lib->referenced) {
-        fclose(lib->fp);
-        lib->fp = NULL;
+
+    if (usedir && dirpos >= 0 && dirlen >= 0 && dirlen <= len - dirpos &&
+        rdl_readdir(lib, data + dirpos, dirlen))
+        return 0;
+
+    /*
+     * No usable directory, so read the exports from each module's
+     * header, where it lies.
+     */
+    for (i = 0; i < lib->nmodules; i++) {
+        mod = &lib->modules[i];
+        if (rdfopenmem(&f, data + mod->offset, len - mod->offset, NULL,
+                       mod->name) || rdfmapseg(&f, RDOFF_HEADER))
+            return rdl_error = 16 * rdf_errno;
+        size = 0;
+        while ((hr = rdfgetheaderrec(&f))) {
+            if (hr->type != RDFREC_GLOBAL)
+                continue;
+            if (mod->nsyms >= size) {
+                size = size ? size << 1 : 16;
+                mod->syms = realloc(mod->syms, size * sizeof(*mod->syms));
+                if (!mod->syms) {
+                    fprintf(stderr, "rdlib: out of memory\n");
+                    exit(1);
+                }
+            }
+            mod->syms[mod->nsyms].name = strdup(hr->e.label);
+            mod->syms[mod->nsyms].flags = hr->e.flags;
+            mod->nsyms++;
+        }
+        rdfclose(&f);
     }
-    return rdl_error = 4;       /* module not found */
+    return 0;
 }
 
 void rdl_perror(const char *apname, const char *filename)
@@ -38,13 +38,44 @@
 #ifndef RDOFF_RDLIB_H
 #define RDOFF_RDLIB_H 1
 
+/* An exported symbol of a library module */
+struct rdl_symbol {
+    char *name;
+    int32_t flags;
+};
+
+/* A library module, as listed by rdl_index() */
+struct rdl_module {
+    char *name;                 /* library name, '.' and module name */
+    int32_t offset;             /* of the RDOFF object in the library */
+    int32_t length;             /* of its content */
+    uint64_t sum;               /* crc64 of its header records */
+    int nsyms;
+    struct rdl_symbol *syms;    /* its RDFREC_GLOBAL records */
+    int included;               /* for the linker's use */
+};
+
 struct librarynode {
     char *name;
     FILE *fp;                   /* initialised to NULL - always check */
     int referenced;             /* & open if required. Close afterwards */
     struct librarynode *next;   /* if ! referenced. */
+    int nmodules;               /* index, once rdl_index() has */
+    struct rdl_module *modules; /* read it; NULL before */
+    struct nasm_filemap *map;   /* the library file, once indexed */
 };
 
+/*
+ * The global symbol index, made by `rdflib i', is a special module
+ * named ".dir" at the end of the library.  Its content is the number
+ * of RDOFF modules, then for each module its offset, content length,
+ * the crc64 of its header records and number of exports, and for each
+ * export its flags and NUL-terminated name.  It is only used if every
+ * module still has the offset, length and checksum it lists.
+ */
+#define RDL_DIR_NAME      ".dir"
+#define RDL_DIR_SIGNATURE "RDLDD2"
+
 extern int rdl_error;
 
 #define RDL_EOPEN     1
@@ -56,6 +87,7 @@ int rdl_verify(const char *filename);
 int rdl_open(struct librarynode *lib, const char *filename);
 int rdl_searchlib(struct librarynode *lib, const char *label, rdffile * f);
 int rdl_openmodule(struct librarynode *lib, int module, rdffile * f);
+int rdl_index(struct librarynode *lib, int usedir);
 
 void rdl_perror(const char *apname, const char *filename);
 
@@ -50,6 +50,7 @@
 #define RDOFF_UTILS
 
 #include "rdoff.h"
+#include "nasmlib.h"
 
 #define newstr(str) strcpy(malloc(strlen(str) + 1),str)
 #define newstrcat(s1,s2) strcat(strcpy(malloc(strlen(s1) + strlen(s2) + 1), \
@@ -237,15 +238,136 @@ int rdf_errno = 0;
    The library functions
    ======================================================================== */
 
+static void rdfcheckendian(void)
+{
+    if (translateint32_t(0x01020304) != 0x01020304) {
+        /* fix this to be portable! */
+        fputs("*** this program requires a little endian machine\n",
+              stderr);
+        fprintf(stderr, "01020304h = %08"PRIx32"h\n", translateint32_t(0x01020304));
+        exit(3);
+    }
+}
+
+/*
+ * Open a file, mapping it into memory: the header and segments can
+ * then be used in place with rdfmapseg().  The mapping goes away on
+ * rdfclose().
+ */
 int rdfopen(rdffile * f, const char *name)
 {
     FILE *fp;
+    struct nasm_filemap *map;
 
     fp = fopen(name, "rb");
     if (!fp)
         return rdf_errno = RDF_ERR_OPEN;
 
-    return rdfopenhere(f, fp, NULL, name);
+    map = malloc(sizeof(*map));
+    if (!map) {
+        fclose(fp);
+        return rdf_errno = RDF_ERR_NOMEM;
+    }
+    if (!nasm_map_file(map, fp)) {
+        free(map);
+        fclose(fp);
+        return rdf_errno = RDF_ERR_READ;
+    }
+    fclose(fp);
+
+    if (map->size > INT32_MAX) {
+        nasm_unmap_file(map);
+        free(map);
+        return rdf_errno = RDF_ERR_FORMAT;
+    }
+    if (rdfopenmem(f, map->data, (int32_t)map->size, NULL, name)) {
+        nasm_unmap_file(map);
+        free(map);
+        return rdf_errno;
+    }
+    f->map = map;
+    return RDF_OK;
+}
+
+/*
+ * Open a module held in memory, such as one inside a mapped library.
+ * The memory must stay valid until the module is closed.
+ */
+int rdfopenmem(rdffile * f, const void *data, int32_t len, int *refcount,
+               const char *name)
+{
+    const uint8_t *p = data;
+    struct SegmentHeaderRec *seg;
+    int32_t pos, l;
+    uint16_t s;
+
+    rdfcheckendian();
+
+    if (len < 6 || memcmp(p, RDOFFId, 6)) {
+        if (len >= 6 && !memcmp(p, "RDOFF1", 6))
+            return rdf_errno = RDF_ERR_VER;
+        return rdf_errno = RDF_ERR_FORMAT;
+    }
+
+    if (len < 14)
+        return rdf_errno = RDF_ERR_READ;
+    memcpy(&l, p + 6, 4);
+    memcpy(&f->header_len, p + 10, 4);
+
+    f->header_ofs = 14;
+    f->eof_offset = f->header_ofs + translateint32_t(l) - 4;
+
+    if (f->header_len < 0)
+        return rdf_errno = RDF_ERR_FORMAT;
+    if (f->header_len > len - f->header_ofs)
+        return rdf_errno = RDF_ERR_READ;
+    pos = f->header_ofs + f->header_len;
+
+    f->nsegs = 0;
+    for (;;) {
+        if (len - pos < 2)
+            return rdf_errno = RDF_ERR_READ;
+        memcpy(&s, p + pos, 2);
+        pos += 2;
+        if (s == 0)
+            break;
+
+        if (f->nsegs >= RDF_MAXSEGS)
+            return rdf_errno = RDF_ERR_FORMAT;
+        if (len - pos < 8)
+            return rdf_errno = RDF_ERR_READ;
+        seg = &f->seg[f->nsegs];
+        seg->type = s;
+        memcpy(&seg->number, p + pos, 2);
+        memcpy(&seg->reserved, p + pos + 2, 2);
+        memcpy(&seg->length, p + pos + 4, 4);
+        pos += 8;
+
+        seg->offset = pos;
+        if (seg->length < 0)
+            return rdf_errno = RDF_ERR_FORMAT;
+        if (seg->length > len - pos)
+            return rdf_errno = RDF_ERR_READ;
+        pos += seg->length;
+        f->nsegs++;
+    }
+
+    if (f->eof_offset != pos + 8) {     /* +8 = skip null segment header */
+        fprintf(stderr, "warning: eof_offset [%"PRId32"] and actual eof offset "
+                "[%ld] don't match\n", f->eof_offset, (long)pos + 8);
+    }
+
+    f->fp = NULL;
+    f->mem = p;
+    f->mem_len = len;
+    f->map = NULL;
+    f->header_loc = NULL;
+
+    f->name = newstr(name);
+    f->refcount = refcount;
+    if (refcount)
+        (*refcount)++;
+    return RDF_OK;
 }
 
 int rdfopenhere(rdffile * f, FILE * fp, int *refcount, const char *name)
@@ -255,15 +377,11 @@ int rdfopenhere(rdffile * f, FILE * fp, int *refcount, const char *name)
     int32_t l;
     uint16_t s;
 
-    if (translateint32_t(0x01020304) != 0x01020304) {
-        /* fix this to be portable! */
-        fputs("*** this program requires a little endian machine\n",
-              stderr);
-        fprintf(stderr, "01020304h = %08"PRIx32"h\n", translateint32_t(0x01020304));
-        exit(3);
-    }
+    rdfcheckendian();
 
     f->fp = fp;
+    f->mem = NULL;
+    f->map = NULL;
     initpos = ftell(fp);
 
     fread(buf, 6, 1, f->fp);    /* read header */
@@ -336,9 +454,15 @@ int rdfopenhere(rdffile * f, FILE * fp, int *refcount, const char *name)
 int rdfclose(rdffile * f)
 {
     if (!f->refcount || !--(*f->refcount)) {
-        fclose(f->fp);
+        if (f->fp)
+            fclose(f->fp);
         f->fp = NULL;
     }
+    if (f->map) {
+        nasm_unmap_file(f->map);
+        free(f->map);
+        f->map = NULL;
+    }
     free(f->name);
 
     return 0;
@@ -393,6 +517,11 @@ int rdfloadseg(rdffile * f, int segment, void *buffer)
         }
     }
 
+    if (f->mem) {
+        memcpy(buffer, f->mem + fpos, slen);
+        return RDF_OK;
+    }
+
     if (fseek(f->fp, fpos, SEEK_SET))
         return rdf_errno = RDF_ERR_UNKNOWN;
 
@@ -402,6 +531,35 @@ int rdfloadseg(rdffile * f, int segment, void *buffer)
     return RDF_OK;
 }
 
+/*
+ * Use the header or a segment where it is, without loading a copy.
+ * Only for a module held in memory; the data must not be written to.
+ */
+int rdfmapseg(rdffile * f, int segment)
+{
+    uint8_t *data;
+
+    if (!f->mem)
+        return rdf_errno = RDF_ERR_UNKNOWN;
+
+    switch (segment) {
+    case RDOFF_HEADER:
+        data = (uint8_t *)f->mem + f->header_ofs;
+        f->header_loc = data;
+        f->header_fp = 0;
+        break;
+    default:
+        if (segment < f->nsegs) {
+            data = (uint8_t *)f->mem + f->seg[segment].offset;
+            f->seg[segment].data = data;
+        } else {
+            return rdf_errno = RDF_ERR_SEGMENT;
+        }
+    }
+
+    return RDF_OK;
+}
+
 /* Macros for reading integers from header in memory */
 
 #define RI8(v) v = f->header_loc[f->header_fp++]
@@ -515,6 +673,7 @@ rdf_headerbuf *rdfnewheader(void)
         return NULL;
 
     hb->buf = newmembuf();
+    hb->last = hb->buf;
     hb->nsegments = 0;
     hb->seglength = 0;
 
@@ -526,45 +685,50 @@ int rdfaddheader(rdf_headerbuf * h, rdfheaderrec * r)
 #ifndef STRICT_ERRORS
     int i;
 #endif
-    membufwrite(h->buf, &r->type, 1);
-    membufwrite(h->buf, &r->g.reclen, 1);
+
+    /* don't walk the whole chain of blocks for every record */
+    while (h->last->next)
+        h->last = h->last->next;
+
+    membufwrite(h->last, &r->type, 1);
+    membufwrite(h->last, &r->g.reclen, 1);
 
     switch (r->type) {
     case RDFREC_GENERIC:       /* generic */
-        membufwrite(h->buf, &r->g.data, r->g.reclen);
+        membufwrite(h->last, &r->g.data, r->g.reclen);
         break;
     case RDFREC_RELOC:
     case RDFREC_SEGRELOC:
-        membufwrite(h->buf, &r->r.segment, 1);
-        membufwrite(h->buf, &r->r.offset, -4);
-        membufwrite(h->buf, &r->r.length, 1);
-        membufwrite(h->buf, &r->r.refseg, -2);  /* 9 bytes written */
+        membufwrite(h->last, &r->r.segment, 1);
+        membufwrite(h->last, &r->r.offset, -4);
+        membufwrite(h->last, &r->r.length, 1);
+        membufwrite(h->last, &r->r.refseg, -2);  /* 9 bytes written */
         break;
 
     case RDFREC_IMPORT:        /* import */
     case RDFREC_FARIMPORT:
-        membufwrite(h->buf, &r->i.flags, 1);
-        membufwrite(h->buf, &r->i.segment, -2);
-        membufwrite(h->buf, &r->i.label, strlen(r->i.label) + 1);
+        membufwrite(h->last, &r->i.flags, 1);
+        membufwrite(h->last, &r->i.segment, -2);
+        membufwrite(h->last, &r->i.label, strlen(r->i.label) + 1);
         break;
 
     case RDFREC_GLOBAL:        /* export */
-        membufwrite(h->buf, &r->e.flags, 1);
-        membufwrite(h->buf, &r->e.segment, 1);
-        membufwrite(h->buf, &r->e.offset, -4);
-        membufwrite(h->buf, &r->e.label, strlen(r->e.label) + 1);
+        membufwrite(h->last, &r->e.flags, 1);
+        membufwrite(h->last, &r->e.segment, 1);
+        membufwrite(h->last, &r->e.offset, -4);
+        membufwrite(h->last, &r->e.label, strlen(r->e.label) + 1);
         break;
 
     case RDFREC_DLL:           /* DLL */
-        membufwrite(h->buf, &r->d.libname, strlen(r->d.libname) + 1);
+        membufwrite(h->last, &r->d.libname, strlen(r->d.libname) + 1);
         break;
 
     case RDFREC_BSS:           /* BSS */
-        membufwrite(h->buf, &r->b.amount, -4);
+        membufwrite(h->last, &r->b.amount, -4);
         break;
 
     case RDFREC_MODNAME:       /* Module name */
-        membufwrite(h->buf, &r->m.modname, strlen(r->m.modname) + 1);
+        membufwrite(h->last, &r->m.modname, strlen(r->m.modname) + 1);
         break;
 
     default:
@@ -572,7 +736,7 @@ int rdfaddheader(rdf_headerbuf * h, rdfheaderrec * r)
         return rdf_errno = RDF_ERR_RECTYPE;
 #else
         for (i = 0; i < r->g.reclen; i++)
-            membufwrite(h->buf, r->g.data[i], 1);
+            membufwrite(h->last, r->g.data[i], 1);
 #endif
     }
     return 0;
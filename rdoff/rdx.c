@@ -69,7 +69,7 @@ int main(int argc, char **argv)
         exit(255);
     }
 
-    rdf_relocate(m);            /* in this instance, the default relocation
+    rdf_relocate(m, 1);         /* in this instance, the default relocation
                                    values will work fine, but they may need changing
                                    in other cases... */
 
@@ -46,31 +46,54 @@
 #include "symtab.h"
 #include "hash.h"
 
+/*
+ * Buckets start at SYMTABSIZE and double whenever there are more
+ * symbols than buckets, so chains stay short however many symbols
+ * a link has.
+ */
 #define SYMTABSIZE 64
-#define slotnum(x) (hash((x)) % SYMTABSIZE)
 
 /* ------------------------------------- */
 /* Private data types */
 
 typedef struct tagSymtabNode {
     struct tagSymtabNode *next;
+    uint32_t hash;
     symtabEnt ent;
 } symtabNode;
 
-typedef symtabNode *(symtabTab[SYMTABSIZE]);
+typedef struct {
+    symtabNode **buckets;
+    uint32_t size;              /* always a power of 2 */
+    uint32_t count;
+} symtabTab;
 
 typedef symtabTab *symtab;
 
+static symtabNode **symtabBuckets(uint32_t size)
+{
+    symtabNode **buckets = calloc(size, sizeof(symtabNode *));
+
+    if (buckets == NULL) {
+        fprintf(stderr, "symtab: out of memory\n");
+        exit(3);
+    }
+    return buckets;
+}
+
 /* ------------------------------------- */
 void *symtabNew(void)
 {
     symtab mytab;
 
-    mytab = (symtabTab *) calloc(SYMTABSIZE, sizeof(symtabNode *));
+    mytab = (symtabTab *) malloc(sizeof(symtabTab));
     if (mytab == NULL) {
         fprintf(stderr, "symtab: out of memory\n");
         exit(3);
     }
+    mytab->buckets = symtabBuckets(SYMTABSIZE);
+    mytab->size = SYMTABSIZE;
+    mytab->count = 0;
 
     return mytab;
 }
@@ -79,18 +102,50 @@ void *symtabNew(void)
 void symtabDone(void *stab)
 {
     symtab mytab = (symtab) stab;
-    int i;
+    uint32_t i;
     symtabNode *this, *next;
 
-    for (i = 0; i < SYMTABSIZE; ++i) {
+    for (i = 0; i < mytab->size; ++i) {
 
-        for (this = (*mytab)[i]; this; this = next) {
+        for (this = mytab->buckets[i]; this; this = next) {
             next = this->next;
             free(this);
         }
 
     }
-    free(*mytab);
+    free(mytab->buckets);
+    free(mytab);
+}
+
+/* ------------------------------------- */
+static void symtabGrow(symtab mytab)
+{
+    uint32_t newsize = mytab->size << 1;
+    symtabNode **buckets = symtabBuckets(newsize);
+    symtabNode *this, *next, *rev;
+    uint32_t i;
+
+    /*
+     * Each chain splits into two.  Reverse it first, so that pushing
+     * the nodes onto the new chains keeps them newest first and a
+     * repeated name still finds its latest entry.
+     */
+    for (i = 0; i < mytab->size; ++i) {
+        rev = NULL;
+        for (this = mytab->buckets[i]; this; this = next) {
+            next = this->next;
+            this->next = rev;
+            rev = this;
+        }
+        for (this = rev; this; this = next) {
+            next = this->next;
+            this->next = buckets[this->hash & (newsize - 1)];
+            buckets[this->hash & (newsize - 1)] = this;
+        }
+    }
+    free(mytab->buckets);
+    mytab->buckets = buckets;
+    mytab->size = newsize;
 }
 
 /* ------------------------------------- */
@@ -98,7 +153,7 @@ void symtabInsert(void *stab, symtabEnt * ent)
 {
     symtab mytab = (symtab) stab;
     symtabNode *node;
-    int slot;
+    uint32_t slot;
 
     node = malloc(sizeof(symtabNode));
     if (node == NULL) {
@@ -106,22 +161,26 @@ void symtabInsert(void *stab, symtabEnt * ent)
         exit(3);
     }
 
-    slot = slotnum(ent->name);
+    if (++mytab->count > mytab->size)
+        symtabGrow(mytab);
+
+    node->hash = hash(ent->name);
+    slot = node->hash & (mytab->size - 1);
 
     node->ent = *ent;
-    node->next = (*mytab)[slot];
-    (*mytab)[slot] = node;
+    node->next = mytab->buckets[slot];
+    mytab->buckets[slot] = node;
 }
 
 /* ------------------------------------- */
 symtabEnt *symtabFind(void *stab, const char *name)
 {
     symtab mytab = (symtab) stab;
-    int slot = slotnum(name);
-    symtabNode *node = (*mytab)[slot];
+    uint32_t h = hash(name);
+    symtabNode *node = mytab->buckets[h & (mytab->size - 1)];
 
     while (node) {
-        if (!strcmp(node->ent.name, name)) {
+        if (node->hash == h && !strcmp(node->ent.name, name)) {
             return &(node->ent);
         }
         node = node->next;
@@ -134,15 +193,15 @@ symtabEnt *symtabFind(void *stab, const char *name)
 void symtabDump(void *stab, FILE * of)
 {
     symtab mytab = (symtab) stab;
-    int i;
+    uint32_t i;
     char *SegNames[3] = { "code", "data", "bss" };
 
     fprintf(of, "Symbol table is ...\n");
-    for (i = 0; i < SYMTABSIZE; ++i) {
-        symtabNode *l = (symtabNode *) (*mytab)[i];
+    for (i = 0; i < mytab->size; ++i) {
+        symtabNode *l = mytab->buckets[i];
 
         if (l) {
-            fprintf(of, " ... slot %d ...\n", i);
+            fprintf(of, " ... slot %"PRIu32" ...\n", i);
         }
         while (l) {
             if ((l->ent.segment) == -1) {
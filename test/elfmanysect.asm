@@ -0,0 +1,30 @@
+;Testname=elf32; Arguments=-felf32 -oelfmanysect.o; Files=stdout stderr elfmanysect.o
+;Testname=elf64; Arguments=-felf64 -oelfmanysect.o; Files=stdout stderr elfmanysect.o
+
+;
+; More sections than fit in the 16-bit section index of an ELF symbol
+; (SHN_LORESERVE is 0xff00): the count goes in the first section
+; header and the symbols' indices in .symtab_shndx.  Symbols of each
+; kind are defined both below and above the limit.
+;
+
+	global	first, last, absval
+	extern	ext
+	common	comm 4
+
+absval	equ	1234
+
+%assign i 0
+%rep 65300
+	section s %+ i
+%if i == 0
+first:
+	dd	ext, comm, absval
+%elif i == 65299
+last:
+	dd	ext, comm, first
+%endif
+local %+ i:
+	db	i & 0xff
+%assign i i + 1
+%endrep
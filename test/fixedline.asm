@@ -0,0 +1,48 @@
+;Testname=optimized; Arguments=-Ox -fbin -ofixedline.bin; Files=stdout stderr fixedline.bin
+;Testname=unoptimized; Arguments=-O0 -fbin -ofixedline.bin; Files=stdout stderr fixedline.bin
+
+;
+; Lines with no label and no symbol, $ or $$ in them keep their size
+; from the first pass, and the later passes step over them.  The
+; jumps here only settle after a few passes, and the lines around
+; them have to stay where they were put.  A directive which turns up
+; only on a later pass (the DEFAULT BND here) changes the size of
+; lines whose text is the same, so those can't be stepped over.
+;
+
+	bits 32
+
+start:
+	jmp	far1
+	mov	eax, 12345678h
+	times 40 db 90h
+	add	eax, 7fh
+	add	eax, 80h
+	jmp	near2
+	times 60 nop
+	bits 16
+	mov	ax, 1
+	bits 32
+	mov	ax, 1
+far1:
+	jmp	start
+	times 100 db 0cch
+	pad	equ	10
+	times pad db 1
+	times 130 - ($ - far1) db 2
+near2:
+	ret
+
+	bits 64
+start64:
+	jmp	fwd64
+	times 130 nop
+here64:
+%if here64 - start64 > 133
+	default bnd
+%endif
+	ret
+	ret
+	ret
+fwd64:
+	dq	fwd64
@@ -0,0 +1,25 @@
+;Testname=bin; Arguments=-fbin -oincbin.bin; Files=stdout stderr incbin.bin
+;Testname=elf32; Arguments=-felf32 -oincbin.o; Files=stdout stderr incbin.o
+;Testname=eof; Arguments=-fbin -DEOF -oincbin.bin; Files=stdout stderr
+
+;
+; The file is mapped in once and used on every pass, and each INCBIN
+; of it takes the part it asks for.  The jump over it is relaxed on
+; the later passes, so its size has to come out the same each time.
+; An offset past the end of the file, or a negative one, includes
+; nothing and is an error (with -DEOF).
+;
+
+	bits 32
+
+	jmp	done
+	incbin	"incbin.asm"
+	incbin	"incbin.asm", 4
+	incbin	"incbin.asm", 4, 16
+	times 3	incbin "incbin.asm", 0, 5
+done:
+	ret
+%ifdef EOF
+	incbin	"incbin.asm", 100000
+	incbin	"incbin.asm", -1
+%endif
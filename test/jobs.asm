@@ -0,0 +1,42 @@
+;Testname=elf64; Arguments=-felf64 -j4 -ojobs.o; Files=stdout stderr jobs.o
+;Testname=bin; Arguments=-fbin -j4 -ojobs.bin; Files=stdout stderr jobs.bin
+
+;
+; With -j the final pass is encoded on several threads and handed to
+; the output format in source order.  The output has to be the same
+; as without it, across section switches, jumps that only settle
+; after a few passes, lines in macros and warnings on batched lines.
+;
+
+	bits 64
+
+%macro	twice	1
+	%1
+	%1
+%endmacro
+
+	section .text
+start:
+	jmp	far1
+%assign i 0
+%rep 600
+	mov	eax, i
+	add	rbx, i * 3
+	lea	rcx, [rdx + i * 8]
+%assign i i + 1
+%endrep
+	twice	{xor eax, eax}
+far1:
+	jmp	start
+
+	section .data
+	db	300
+%rep 300
+	dw	1, 2, 3
+	dd	1.5
+	db	"abc", 0
+%endrep
+
+	section .text
+	times 100 nop
+	ret
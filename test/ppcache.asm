@@ -0,0 +1,30 @@
+;Testname=optimized; Arguments=-Ox -fbin -oppcache.bin; Files=stdout stderr ppcache.bin
+;Testname=unoptimized; Arguments=-O0 -fbin -oppcache.bin; Files=stdout stderr ppcache.bin
+
+;
+; The preprocessed line stream is recorded on the first pass and
+; replayed on the optimization passes.  A preprocessor expression
+; which refers to labels may evaluate differently on each pass, so
+; it must force the preprocessor to run again.
+;
+
+	bits 32
+
+%macro	fwd 1
+	jmp	%1
+	times 3 nop
+%endmacro
+
+start:
+%rep 8
+	fwd	mid
+%endrep
+mid:
+
+%assign gap mid - start
+%if gap < 64
+	db	'short', 0
+%else
+	db	'near', 0
+%endif
+	dd	gap
@@ -0,0 +1,44 @@
+;Testname=main; Arguments=-frdf -ordfjobs.rdf; Files=stdout stderr rdfjobs.rdf
+;Testname=lib; Arguments=-frdf -DLIB -ordfjobs.rdf; Files=stdout stderr rdfjobs.rdf
+
+;
+; Two modules, from this file with and without -DLIB, for the
+; jobstest target in the Makefile: each segment of each module has
+; relocations, so ldrdf -J and rdf2bin -j have several to share out.
+;
+
+%ifdef LIB
+	global	lfunc, ldata
+
+	section .text
+lfunc:
+%rep 500
+	mov	eax, [ldata]
+	mov	ebx, lfunc
+%endrep
+	ret
+
+	section .data
+ldata:
+%rep 500
+	dd	lfunc, ldata
+%endrep
+%else
+	extern	lfunc, ldata
+	global	start
+
+	section .text
+start:
+%rep 2000
+	call	lfunc
+	mov	eax, [ldata]
+	mov	ebx, tdata
+%endrep
+	ret
+
+	section .data
+tdata:
+%rep 2000
+	dd	start, tdata, ldata, lfunc
+%endrep
+%endif
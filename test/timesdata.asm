@@ -0,0 +1,31 @@
+;Testname=bin; Arguments=-fbin -otimesdata.bin; Files=stdout stderr timesdata.bin
+;Testname=elf64; Arguments=-felf64 -otimesdata.o; Files=stdout stderr timesdata.o
+
+;
+; Constant data directives are output as a single block, and the
+; repeats of a TIMES'd one are handed to the output format all at
+; once; anything which needs relocating still goes piece by piece.
+; Data in a nobits section, or RESx in a progbits one, is warned about
+; once per line however many times it is repeated.
+;
+
+	section .text
+
+start:
+	times 4096 db 0
+	times 1000 db 'abc', 1, 2
+	times 333 dw 'xyz', -1
+	times 17 dd 1.5, 0x12345678
+	times 5 dq 'abcdefghij'
+	db 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16
+	times 3 dd start, 7
+	times 0 db 1
+	times 2 db ''
+	times 5 resb 3
+
+	section .bss
+
+buf:
+	times 100 resb 3
+	times 10 resq 2
+	times 7 db 1
@@ -43,6 +43,10 @@ require 'x86/insns-iflags.pl';
 # LONGER PREFIXES FIRST!
 @disasm_prefixes = qw(0F24 0F25 0F38 0F3A 0F7A 0FA6 0FA7 0F);
 
+# Number of ways long template lists are split up for the
+# disassembler, DISASM_SEL_SIZE in insns.h
+$dissel_size = 8*6;
+
 # This should match MAX_OPERANDS from nasm.h
 $MAX_OPERANDS = 5;
 
@@ -85,6 +89,7 @@ die if (scalar(@args) != 2);	# input output
 open (F, $fname) || die "unable to open $fname";
 
 %dinstables = ();
+%dinsel = ();
 @bytecode_list = ();
 
 $line = 0;
@@ -157,8 +162,10 @@ while (<F>) {
             foreach $i (@sseq) {
                 if (!defined($dinstables{$i})) {
                     $dinstables{$i} = [];
+                    $dinsel{$i} = [];
                 }
                 push(@{$dinstables{$i}}, $#big);
+                push(@{$dinsel{$i}}, dissel($fields[2], $fields[4], $i));
             }
         }
     }
@@ -258,6 +265,39 @@ if ( $output eq 'a' ) {
     }
     print A "};\n";
 
+    # Templates for each opcode bucketed by operand count, each with
+    # the operand class signature used by find_match() to skip
+    # templates which cannot possibly match
+    foreach $i (@opcodes, @opcodes_cc) {
+        $aname = "aa_$i";
+        @sels = ();
+        for ($n = 0; $n <= $MAX_OPERANDS; $n++) {
+            $k = 0;
+            @sel = ();
+            foreach $j (@$aname) {
+                $j =~ /^\{I_\w+, (\d+), \{([^\}]*)\}/;
+                push(@sel, "{instrux_${i}+$k, ITSEL_SIG($2)}") if ($1 == $n);
+                $k++;
+            }
+            if (scalar(@sel)) {
+                print A "static const struct itemplate_sel itsel_${i}_${n}[] = {\n";
+                foreach $j (@sel) {
+                    print A "    $j,\n";
+                }
+                print A "    {NULL, 0}\n};\n\n";
+                push(@sels, "itsel_${i}_${n}");
+            } else {
+                push(@sels, "NULL");
+            }
+        }
+        $sels{$i} = join(', ', @sels);
+    }
+    print A "const struct itemplate_sel * const nasm_insn_select[][MAX_OPERANDS+1] = {\n";
+    foreach $i (@opcodes, @opcodes_cc) {
+        print A "    { $sels{$i} },\n";
+    }
+    print A "};\n";
+
     close A;
 }
 
@@ -281,7 +321,42 @@ if ( $output eq 'd' ) {
 
     foreach $h (sort(keys(%dinstables))) {
         next if ($h eq ''); # Skip pseudo-instructions
-            print D "\nstatic const struct itemplate * const itable_${h}[] = {\n";
+        if (dissplit($h)) {
+            # Split up by ModRM reg field and SSE prefix, see insns.h
+            my %sublists = ();
+            my @sel = ();
+            my $k = 0;
+            for ($j = 0; $j < $dissel_size; $j++) {
+                my @sub = ();
+                for ($n = 0; $n < scalar(@{$dinstables{$h}}); $n++) {
+                    push(@sub, $dinstables{$h}[$n])
+                        if ($dinsel{$h}[$n] & (1 << $j));
+                }
+                my $key = join(',', @sub);
+                if (!scalar(@sub)) {
+                    push(@sel, '{ NULL, 0 }');
+                    next;
+                }
+                if (!defined($sublists{$key})) {
+                    $sublists{$key} = "itable_${h}_".$k++;
+                    print D "\nstatic const struct itemplate * const ",
+                        $sublists{$key}, "[] = {\n";
+                    foreach $n (@sub) {
+                        print D "    instrux + $n,\n";
+                    }
+                    print D "};\n";
+                }
+                push(@sel, sprintf("{ %s, %u }", $sublists{$key},
+                                   scalar(@sub)));
+            }
+            print D "\nstatic const struct disasm_index itable_${h}_sel[] = {\n";
+            foreach $j (@sel) {
+                print D "    $j,\n";
+            }
+            print D "};\n";
+            next;
+        }
+        print D "\nstatic const struct itemplate * const itable_${h}[] = {\n";
         foreach $j (@{$dinstables{$h}}) {
             print D "    instrux + $j,\n";
         }
@@ -313,6 +388,8 @@ if ( $output eq 'd' ) {
                 die "$fname: ambiguous decoding of $nn\n"
                     if (defined($dinstables{$nn}));
                 printf D "    /* 0x%02x */ { itable_%s, -1 },\n", $c, $nn;
+            } elsif (dissplit($nn)) {
+                printf D "    /* 0x%02x */ { itable_%s_sel, -2 },\n", $c, $nn;
             } elsif (defined($dinstables{$nn})) {
                 printf D "    /* 0x%02x */ { itable_%s, %u },\n", $c,
                        $nn, scalar(@{$dinstables{$nn}});
@@ -669,6 +746,93 @@ sub startseq($$) {
     return $prefix;
 }
 
+# For the disassembler, find out which templates in the list for
+# a starting sequence can possibly match, depending on the ModRM reg
+# field of the byte after the starting sequence and on the 66, F2
+# and F3 prefixes.  Returns a bit mask of the DISASM_SEL() values
+# from insns.h the template is worth trying for; anything not ruled
+# out here is left to matches() in disasm.c.
+
+sub dissel($$$) {
+    my ($codestr, $relax, $seq) = @_;
+    my @codes = decodify($codestr, $relax);
+    my $regmask = 0xff;
+    my $pfxmask = 077;
+    my $skip, $pos, $c, $d, $m, $s;
+
+    # Bytes of the instruction the starting sequence accounts for
+    $skip = ($seq =~ /^(vex|xop|evex)/) ? 1 : length($seq) >> 1;
+    $pos = 0;
+
+    while ($c = shift(@codes)) {
+        if ($c >= 01 && $c <= 04) {
+            while ($c--) {
+                $d = shift(@codes);
+                $regmask = 1 << (($d >> 3) & 7) if ($pos == $skip);
+                $pos++ if ($pos >= 0);
+            }
+        } elsif (($c & ~3) == 010 || $c == 0330) {
+            $d = shift(@codes);
+            if ($pos == $skip) {
+                $m = 0;
+                foreach $s ($d..($d + ($c == 0330 ? 15 : 7))) {
+                    $m |= 1 << (($s >> 3) & 7);
+                }
+                $regmask = $m;
+            }
+            $pos++ if ($pos >= 0);
+        } elsif ($c >= 0200 && $c <= 0237) {
+            $regmask = 1 << ($c & 7) if ($pos == $skip);
+            $pos = -1;          # Variable length from here on
+        } elsif (($c & ~3) == 0240 || $c == 0250) {
+            splice(@codes, 0, 3);
+        } elsif (($c & ~3) == 0260 || $c == 0270) {
+            splice(@codes, 0, 2);
+        } elsif ($c == 0172 || $c == 0173) {
+            shift(@codes);
+            $pos = -1;
+        } elsif (($c >= 05 && $c <= 07) || ($c & ~3) == 014 ||
+                 ($c >= 0271 && $c <= 0273) || $c >= 0300) {
+            # No instruction bytes, but maybe a prefix requirement.
+            # The prefix states are no/66 times no/F2/F3 prefix.
+            $pfxmask &= 001 if ($c == 0360);
+            $pfxmask &= 010 if ($c == 0361);
+            $pfxmask &= 022 if ($c == 0332);
+            $pfxmask &= 044 if ($c == 0333);
+            $pfxmask &= 033 if ($c == 0326);
+            $pfxmask &= 011 if ($c == 0331);
+            $pfxmask &= 007 if ($c == 0364);
+            $pfxmask &= 070 if ($c == 0366);
+        } else {
+            # Anything else takes some instruction bytes
+            $pos = -1;
+        }
+    }
+
+    $m = 0;
+    for ($d = 0; $d < 8; $d++) {
+        for ($s = 0; $s < 6; $s++) {
+            $m |= 1 << ($d*6 + $s)
+                if (($regmask & (1 << $d)) && ($pfxmask & (1 << $s)));
+        }
+    }
+    return $m;
+}
+
+# Is the list for this starting sequence worth splitting up?
+sub dissplit($) {
+    my ($seq) = @_;
+    my $all = (1 << $dissel_size) - 1;
+    my $m;
+
+    return 0 if (!defined($dinstables{$seq}) || $seq eq '' ||
+                 scalar(@{$dinstables{$seq}}) < 3);
+    foreach $m (@{$dinsel{$seq}}) {
+        return 1 if ($m != $all);
+    }
+    return 0;
+}
+
 # EVEX tuple types offset is 0300. e.g. 0301 is for full vector(fv).
 sub tupletype($) {
     my ($tuplestr) = @_;